@@ -10,6 +10,7 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <libgen.h>
+#include <dirent.h>
 #ifndef PATH_MAX
 #define PATH_MAX 1024
 #endif
@@ -272,6 +273,37 @@ bool File::try_remove(const std::string& filename)
 
 /////////////////////////////////////////////////////////////////////////////
 
+#ifndef WIN32
+static std::vector<std::string> FindDirectoryEntries(const std::string& filename, bool wantDirectories)
+{
+	// The search string is expected to be a folder followed by a "*" wildcard
+	std::string path = FilePath::remove_last_component(filename);
+	if (path.empty())
+		path = ".";
+
+	DIR* dir = opendir(path.c_str());
+	if (!dir)
+		return {};
+
+	std::vector<std::string> files;
+	while (dirent* entry = readdir(dir))
+	{
+		std::string name = entry->d_name;
+		if (name == "." || name == "..")
+			continue;
+
+		struct stat info;
+		if (stat(FilePath::combine(path, name).c_str(), &info) != 0)
+			continue;
+
+		if (S_ISDIR(info.st_mode) == wantDirectories)
+			files.push_back(name);
+	}
+	closedir(dir);
+	return files;
+}
+#endif
+
 std::vector<std::string> Directory::files(const std::string& filename)
 {
 #ifdef WIN32
@@ -300,7 +332,7 @@ std::vector<std::string> Directory::files(const std::string& filename)
 
 	return files;
 #else
-	throw std::runtime_error("Directory::files not implemented");
+	return FindDirectoryEntries(filename, false);
 #endif
 }
 
@@ -336,7 +368,7 @@ std::vector<std::string> Directory::folders(const std::string& filename)
 
 	return files;
 #else
-	throw std::runtime_error("Directory::folders not implemented");
+	return FindDirectoryEntries(filename, true);
 #endif
 }
 
@@ -23,6 +23,16 @@
 */
 
 #include "halffloat.h"
+#include <cstdint>
+#ifndef DISABLE_SSE
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET_F16C
+#else
+#define TARGET_F16C __attribute__((target("avx,f16c")))
+#endif
+#endif
 
 namespace HalfFloatTables
 {
@@ -2181,37 +2191,37 @@ namespace HalfFloatTables
 		1024,
 		1024,
 		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
 	};
 
 	unsigned short base_table[512] =
@@ -3289,7 +3299,10 @@ namespace HalfFloatTables
 		offset_table[0] = 0;
 		offset_table[32] = 0;
 		for (int i = 1; i < 32; i++)
+		{
 			offset_table[i] = 1024;
+			offset_table[i + 32] = 1024;
+		}
 
 		for(unsigned int i=0; i<256; ++i)
 		{
@@ -3379,3 +3392,150 @@ namespace HalfFloatTables
 	}
 	*/
 }
+
+#ifndef DISABLE_SSE
+
+// The tables round towards zero, except that they turn everything too large for a half into infinity and keep
+// the top of the mantissa of a NaN as it is. These fix up the lanes where the hardware conversions do it differently.
+
+static __m128i PackHalves(__m128i v)
+{
+	// Sign extend from 16 bits so that the saturating pack keeps the values as they are
+	return _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(v, 16), 16), _mm_setzero_si128());
+}
+
+static __m128i FloatToHalfOverflow(__m128i bits, __m128i& mask)
+{
+	__m128i sign = _mm_and_si128(_mm_srli_epi32(bits, 16), _mm_set1_epi32(0x8000));
+	__m128i abs = _mm_and_si128(bits, _mm_set1_epi32(0x7fffffff));
+	__m128i nan = _mm_cmpgt_epi32(abs, _mm_set1_epi32(0x7f800000));
+	__m128i nanMantissa = _mm_and_si128(nan, _mm_and_si128(_mm_srli_epi32(abs, 13), _mm_set1_epi32(0x3ff)));
+	mask = _mm_cmpgt_epi32(abs, _mm_set1_epi32(0x477fffff));
+	return _mm_or_si128(_mm_or_si128(sign, _mm_set1_epi32(0x7c00)), nanMantissa);
+}
+
+static __m128i HalfToFloatSpecial(__m128i halves, __m128i& mask)
+{
+	__m128i sign = _mm_slli_epi32(_mm_and_si128(halves, _mm_set1_epi32(0x8000)), 16);
+	__m128i abs = _mm_and_si128(halves, _mm_set1_epi32(0x7fff));
+	mask = _mm_cmpgt_epi32(abs, _mm_set1_epi32(0x7bff));
+	return _mm_or_si128(_mm_or_si128(sign, _mm_set1_epi32(0x7f800000)), _mm_slli_epi32(_mm_and_si128(abs, _mm_set1_epi32(0x3ff)), 13));
+}
+
+static __m128i Select(__m128i mask, __m128i a, __m128i b)
+{
+	return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+TARGET_F16C static void FloatToHalfF16C(const float* src, unsigned short* dest, size_t count)
+{
+	for (size_t i = 0; i < count; i += 4)
+	{
+		__m128 f = _mm_loadu_ps(src + i);
+		__m128i mask;
+		__m128i overflow = PackHalves(FloatToHalfOverflow(_mm_castps_si128(f), mask));
+		__m128i halves = _mm_cvtps_ph(f, _MM_FROUND_TO_ZERO);
+		_mm_storel_epi64((__m128i*)(dest + i), Select(_mm_packs_epi32(mask, mask), overflow, halves));
+	}
+}
+
+TARGET_F16C static void HalfToFloatF16C(const unsigned short* src, float* dest, size_t count)
+{
+	for (size_t i = 0; i < count; i += 4)
+	{
+		__m128i halves = _mm_loadl_epi64((const __m128i*)(src + i));
+		__m128i mask;
+		__m128i special = HalfToFloatSpecial(_mm_unpacklo_epi16(halves, _mm_setzero_si128()), mask);
+		__m128i floats = _mm_castps_si128(_mm_cvtph_ps(halves));
+		_mm_storeu_ps(dest + i, _mm_castsi128_ps(Select(mask, special, floats)));
+	}
+}
+
+// SSE2 versions for processors without F16C
+
+static void FloatToHalfSSE2(const float* src, unsigned short* dest, size_t count)
+{
+	for (size_t i = 0; i < count; i += 4)
+	{
+		__m128 f = _mm_loadu_ps(src + i);
+		__m128i bits = _mm_castps_si128(f);
+		__m128i sign = _mm_and_si128(_mm_srli_epi32(bits, 16), _mm_set1_epi32(0x8000));
+		__m128i abs = _mm_and_si128(bits, _mm_set1_epi32(0x7fffffff));
+
+		// Normals rebias the exponent. Denormals are the float scaled by 2^24, truncated.
+		__m128i normal = _mm_srli_epi32(_mm_sub_epi32(abs, _mm_set1_epi32(0x38000000)), 13);
+		__m128i denormal = _mm_cvttps_epi32(_mm_mul_ps(_mm_castsi128_ps(abs), _mm_set1_ps(16777216.0f)));
+		__m128i isNormal = _mm_cmpgt_epi32(abs, _mm_set1_epi32(0x387fffff));
+		__m128i halves = _mm_or_si128(sign, Select(isNormal, normal, denormal));
+
+		__m128i mask;
+		__m128i overflow = FloatToHalfOverflow(bits, mask);
+		_mm_storel_epi64((__m128i*)(dest + i), PackHalves(Select(mask, overflow, halves)));
+	}
+}
+
+static void HalfToFloatSSE2(const unsigned short* src, float* dest, size_t count)
+{
+	for (size_t i = 0; i < count; i += 4)
+	{
+		__m128i halves = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i*)(src + i)), _mm_setzero_si128());
+		__m128i sign = _mm_slli_epi32(_mm_and_si128(halves, _mm_set1_epi32(0x8000)), 16);
+		__m128i abs = _mm_and_si128(halves, _mm_set1_epi32(0x7fff));
+
+		__m128i normal = _mm_add_epi32(_mm_slli_epi32(abs, 13), _mm_set1_epi32(0x38000000));
+		__m128i denormal = _mm_castps_si128(_mm_mul_ps(_mm_cvtepi32_ps(abs), _mm_set1_ps(1.0f / 16777216.0f)));
+		__m128i isNormal = _mm_cmpgt_epi32(abs, _mm_set1_epi32(0x3ff));
+		__m128i floats = _mm_or_si128(sign, Select(isNormal, normal, denormal));
+
+		__m128i mask;
+		__m128i special = HalfToFloatSpecial(halves, mask);
+		_mm_storeu_ps(dest + i, _mm_castsi128_ps(Select(mask, special, floats)));
+	}
+}
+
+static bool HasF16C()
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 1);
+	bool avx = (info[2] & (1 << 28)) && (info[2] & (1 << 27)) && (_xgetbv(0) & 6) == 6;
+	return avx && (info[2] & (1 << 29));
+#else
+	__builtin_cpu_init(); // Needed as this runs before main
+	return __builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c");
+#endif
+}
+
+static const bool UseF16C = HasF16C();
+
+#endif
+
+void floatToHalf(const float* src, unsigned short* dest, size_t count)
+{
+	size_t i = 0;
+#ifndef DISABLE_SSE
+	size_t simdCount = count & ~(size_t)3;
+	if (UseF16C)
+		FloatToHalfF16C(src, dest, simdCount);
+	else
+		FloatToHalfSSE2(src, dest, simdCount);
+	i = simdCount;
+#endif
+	for (; i < count; i++)
+		dest[i] = floatToHalf(src[i]);
+}
+
+void halfToFloat(const unsigned short* src, float* dest, size_t count)
+{
+	size_t i = 0;
+#ifndef DISABLE_SSE
+	size_t simdCount = count & ~(size_t)3;
+	if (UseF16C)
+		HalfToFloatF16C(src, dest, simdCount);
+	else
+		HalfToFloatSSE2(src, dest, simdCount);
+	i = simdCount;
+#endif
+	for (; i < count; i++)
+		dest[i] = halfToFloat(src[i]);
+}
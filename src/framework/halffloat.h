@@ -24,6 +24,8 @@
 
 #pragma once
 
+#include <cstddef>
+
 namespace HalfFloatTables
 {
 	extern unsigned int mantissa_table[2048];
@@ -66,3 +68,9 @@ inline unsigned short floatToHalf(float float_value)
 	unsigned int f = *static_cast<unsigned int*>(ptr);
 	return base_table[(f >> 23) & 0x1ff] + ((f & 0x007fffff) >> shift_table[(f >> 23) & 0x1ff]);
 }
+
+/// Convert an array of floats to half-floats. Rounds exactly like floatToHalf.
+void floatToHalf(const float* src, unsigned short* dest, size_t count);
+
+/// Convert an array of half-floats to floats. Gives exactly what halfToFloat does.
+void halfToFloat(const unsigned short* src, float* dest, size_t count);
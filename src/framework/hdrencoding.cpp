@@ -0,0 +1,394 @@
+
+#include "hdrencoding.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+uint32_t floatToRGB9E5(float r, float g, float b)
+{
+	// 9 mantissa bits per component and a 5 bit exponent with a bias of 15
+	const int mantissaBits = 9;
+	const int exponentBias = 15;
+	const float maxValue = 511.0f / 512.0f * 65536.0f;
+
+	r = r > 0.0f ? std::min(r, maxValue) : 0.0f;
+	g = g > 0.0f ? std::min(g, maxValue) : 0.0f;
+	b = b > 0.0f ? std::min(b, maxValue) : 0.0f;
+
+	float maxComponent = std::max(std::max(r, g), b);
+	if (maxComponent == 0.0f)
+		return 0;
+
+	int exponent;
+	std::frexp(maxComponent, &exponent); // frexp gives floor(log2(x)) + 1
+	int sharedExponent = std::max(exponent - 1, -exponentBias - 1) + 1 + exponentBias;
+	float scale = std::ldexp(1.0f, sharedExponent - exponentBias - mantissaBits);
+
+	// The largest component may round up to 512, which needs the next exponent
+	if ((int)std::floor(maxComponent / scale + 0.5f) == 1 << mantissaBits)
+	{
+		sharedExponent++;
+		scale *= 2.0f;
+	}
+
+	uint32_t rs = (uint32_t)std::floor(r / scale + 0.5f);
+	uint32_t gs = (uint32_t)std::floor(g / scale + 0.5f);
+	uint32_t bs = (uint32_t)std::floor(b / scale + 0.5f);
+	return rs | (gs << 9) | (bs << 18) | ((uint32_t)sharedExponent << 27);
+}
+
+void rgb9e5ToFloat(uint32_t packed, float* rgb)
+{
+	float scale = std::ldexp(1.0f, (int)(packed >> 27) - 15 - 9);
+	rgb[0] = (packed & 511) * scale;
+	rgb[1] = ((packed >> 9) & 511) * scale;
+	rgb[2] = ((packed >> 18) & 511) * scale;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+// The encoder works on the bit patterns of the half floats rather than on their values. That is the space BC6H
+// interpolates in, and it makes the error of a texel roughly relative to its brightness.
+namespace
+{
+	// Interpolation weights of the 4 bit indices, out of 64
+	const int BC6HWeights[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+	// Bit pattern of 65504, the largest half float an unsigned BC6H block can hold
+	const int BC6HMaxValue = 0x7bff;
+
+	const int BC6HEndpointBits = 10;
+	const int BC6HEndpointMax = (1 << BC6HEndpointBits) - 1;
+
+	// Mode 11: one region, both endpoints stored as 10 bits per component without deltas
+	const uint32_t BC6HMode11 = 0x03;
+
+	typedef int BC6HEndpoints[2][3];
+	typedef int BC6HPalette[16][3];
+
+	// Expands an endpoint to the 16 bit range the weights are applied in
+	int UnquantizeEndpoint(int q)
+	{
+		if (q == 0)
+			return 0;
+		else if (q == BC6HEndpointMax)
+			return 0xffff;
+		else
+			return ((q << 16) + 0x8000) >> BC6HEndpointBits;
+	}
+
+	void GetPalette(const BC6HEndpoints& endpoints, BC6HPalette& palette)
+	{
+		for (int c = 0; c < 3; c++)
+		{
+			int a = UnquantizeEndpoint(endpoints[0][c]);
+			int b = UnquantizeEndpoint(endpoints[1][c]);
+			for (int i = 0; i < 16; i++)
+			{
+				int value = ((64 - BC6HWeights[i]) * a + BC6HWeights[i] * b + 32) >> 6;
+				palette[i][c] = (value * 31) >> 6; // Scales the range back down to half floats
+			}
+		}
+	}
+
+	// Endpoint that decodes closest to a half float bit pattern
+	int QuantizeEndpoint(float value)
+	{
+		return std::clamp((int)std::floor((value - 15.5f) / 31.0f + 0.5f), 0, BC6HEndpointMax);
+	}
+
+	int64_t GetError(const int* texel, const int* color)
+	{
+		int64_t error = 0;
+		for (int c = 0; c < 3; c++)
+		{
+			int64_t d = texel[c] - color[c];
+			error += d * d;
+		}
+		return error;
+	}
+
+	// Picks the palette color of each texel and returns the total squared error. The palette is close to a straight
+	// line, so the projection onto it finds the right index or one next to it.
+	int64_t FindIndices(const int (&texels)[16][3], const BC6HEndpoints& endpoints, int (&indices)[16])
+	{
+		BC6HPalette palette;
+		GetPalette(endpoints, palette);
+
+		float dir[3], length2 = 0.0f;
+		for (int c = 0; c < 3; c++)
+		{
+			dir[c] = float(palette[15][c] - palette[0][c]);
+			length2 += dir[c] * dir[c];
+		}
+		float scale = length2 > 0.0f ? 15.0f / length2 : 0.0f;
+
+		int64_t totalError = 0;
+		for (int i = 0; i < 16; i++)
+		{
+			float t = 0.0f;
+			for (int c = 0; c < 3; c++)
+				t += (texels[i][c] - palette[0][c]) * dir[c];
+			int guess = std::clamp((int)std::floor(t * scale + 0.5f), 0, 15);
+
+			int best = guess;
+			int64_t bestError = GetError(texels[i], palette[guess]);
+			for (int index = std::max(guess - 1, 0); index <= std::min(guess + 1, 15); index++)
+			{
+				int64_t error = GetError(texels[i], palette[index]);
+				if (error < bestError)
+				{
+					best = index;
+					bestError = error;
+				}
+			}
+			indices[i] = best;
+			totalError += bestError;
+		}
+		return totalError;
+	}
+
+	// Least squares fit of the endpoints to the texels for the given indices
+	bool FitEndpoints(const int (&texels)[16][3], const int (&indices)[16], BC6HEndpoints& endpoints)
+	{
+		float s00 = 0.0f, s01 = 0.0f, s11 = 0.0f;
+		float r0[3] = {}, r1[3] = {};
+		for (int i = 0; i < 16; i++)
+		{
+			float t = BC6HWeights[indices[i]] / 64.0f;
+			s00 += (1.0f - t) * (1.0f - t);
+			s01 += (1.0f - t) * t;
+			s11 += t * t;
+			for (int c = 0; c < 3; c++)
+			{
+				r0[c] += (1.0f - t) * texels[i][c];
+				r1[c] += t * texels[i][c];
+			}
+		}
+
+		float det = s00 * s11 - s01 * s01;
+		if (det < 1e-3f)
+			return false;
+
+		for (int c = 0; c < 3; c++)
+		{
+			float a = (r0[c] * s11 - r1[c] * s01) / det;
+			float b = (r1[c] * s00 - r0[c] * s01) / det;
+			endpoints[0][c] = QuantizeEndpoint(std::clamp(a, 0.0f, (float)BC6HMaxValue));
+			endpoints[1][c] = QuantizeEndpoint(std::clamp(b, 0.0f, (float)BC6HMaxValue));
+		}
+		return true;
+	}
+
+	// Endpoints at the ends of the principal axis of the texels
+	void GuessEndpoints(const int (&texels)[16][3], BC6HEndpoints& endpoints)
+	{
+		float mean[3] = {}, minValue[3], maxValue[3];
+		for (int c = 0; c < 3; c++)
+		{
+			minValue[c] = maxValue[c] = (float)texels[0][c];
+			for (int i = 0; i < 16; i++)
+			{
+				mean[c] += texels[i][c] / 16.0f;
+				minValue[c] = std::min(minValue[c], (float)texels[i][c]);
+				maxValue[c] = std::max(maxValue[c], (float)texels[i][c]);
+			}
+		}
+
+		float cov[6] = {};
+		for (int i = 0; i < 16; i++)
+		{
+			float d[3] = { texels[i][0] - mean[0], texels[i][1] - mean[1], texels[i][2] - mean[2] };
+			cov[0] += d[0] * d[0];
+			cov[1] += d[0] * d[1];
+			cov[2] += d[0] * d[2];
+			cov[3] += d[1] * d[1];
+			cov[4] += d[1] * d[2];
+			cov[5] += d[2] * d[2];
+		}
+
+		// Power iteration, starting from the diagonal of the bounding box
+		float axis[3] = { maxValue[0] - minValue[0], maxValue[1] - minValue[1], maxValue[2] - minValue[2] };
+		for (int iteration = 0; iteration < 4; iteration++)
+		{
+			float x = cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2];
+			float y = cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2];
+			float z = cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2];
+			float length = std::sqrt(x * x + y * y + z * z);
+			if (length < 1e-6f)
+				break;
+			axis[0] = x / length;
+			axis[1] = y / length;
+			axis[2] = z / length;
+		}
+		float length = std::sqrt(axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2]);
+		if (length > 1e-6f)
+		{
+			for (int c = 0; c < 3; c++)
+				axis[c] /= length;
+		}
+
+		float tmin = 0.0f, tmax = 0.0f;
+		for (int i = 0; i < 16; i++)
+		{
+			float t = 0.0f;
+			for (int c = 0; c < 3; c++)
+				t += (texels[i][c] - mean[c]) * axis[c];
+			tmin = std::min(tmin, t);
+			tmax = std::max(tmax, t);
+		}
+
+		for (int c = 0; c < 3; c++)
+		{
+			endpoints[0][c] = QuantizeEndpoint(std::clamp(mean[c] + axis[c] * tmin, 0.0f, (float)BC6HMaxValue));
+			endpoints[1][c] = QuantizeEndpoint(std::clamp(mean[c] + axis[c] * tmax, 0.0f, (float)BC6HMaxValue));
+		}
+	}
+
+	class BC6HBitWriter
+	{
+	public:
+		BC6HBitWriter(uint8_t* dest) : dest(dest) { memset(dest, 0, 16); }
+
+		void Write(uint32_t value, int bits)
+		{
+			for (int i = 0; i < bits; i++, pos++)
+			{
+				if ((value >> i) & 1)
+					dest[pos >> 3] |= 1 << (pos & 7);
+			}
+		}
+
+	private:
+		uint8_t* dest;
+		int pos = 0;
+	};
+
+	class BC6HBitReader
+	{
+	public:
+		BC6HBitReader(const uint8_t* src) : src(src) { }
+
+		uint32_t Read(int bits)
+		{
+			uint32_t value = 0;
+			for (int i = 0; i < bits; i++, pos++)
+				value |= ((src[pos >> 3] >> (pos & 7)) & 1) << i;
+			return value;
+		}
+
+	private:
+		const uint8_t* src;
+		int pos = 0;
+	};
+}
+
+void encodeBC6HBlock(const uint16_t* src, uint8_t* dest)
+{
+	int texels[16][3];
+	for (int i = 0; i < 16; i++)
+	{
+		for (int c = 0; c < 3; c++)
+		{
+			int value = src[i * 3 + c];
+			texels[i][c] = (value & 0x8000) ? 0 : std::min(value, BC6HMaxValue);
+		}
+	}
+
+	BC6HEndpoints endpoints;
+	int indices[16];
+	GuessEndpoints(texels, endpoints);
+	int64_t error = FindIndices(texels, endpoints, indices);
+
+	// Refit the endpoints to the chosen indices while that helps
+	for (int iteration = 0; iteration < 2 && error > 0; iteration++)
+	{
+		BC6HEndpoints fitted;
+		int fittedIndices[16];
+		if (!FitEndpoints(texels, indices, fitted))
+			break;
+		int64_t fittedError = FindIndices(texels, fitted, fittedIndices);
+		if (fittedError >= error)
+			break;
+		memcpy(endpoints, fitted, sizeof(BC6HEndpoints));
+		memcpy(indices, fittedIndices, sizeof(indices));
+		error = fittedError;
+	}
+
+	// Nudge each quantized endpoint component by one step, as the rounding of the fit is rarely the best choice
+	for (int pass = 0; pass < 2 && error > 0; pass++)
+	{
+		bool improved = false;
+		for (int e = 0; e < 2; e++)
+		{
+			for (int c = 0; c < 3; c++)
+			{
+				for (int step : { -1, 1 })
+				{
+					int original = endpoints[e][c];
+					endpoints[e][c] = std::clamp(original + step, 0, BC6HEndpointMax);
+					int nudgedIndices[16];
+					int64_t nudgedError = FindIndices(texels, endpoints, nudgedIndices);
+					if (nudgedError < error)
+					{
+						memcpy(indices, nudgedIndices, sizeof(indices));
+						error = nudgedError;
+						improved = true;
+					}
+					else
+					{
+						endpoints[e][c] = original;
+					}
+				}
+			}
+		}
+		if (!improved)
+			break;
+	}
+
+	// The first index is stored with one bit less and must have its top bit clear
+	if (indices[0] & 8)
+	{
+		for (int c = 0; c < 3; c++)
+			std::swap(endpoints[0][c], endpoints[1][c]);
+		for (int i = 0; i < 16; i++)
+			indices[i] = 15 - indices[i];
+	}
+
+	BC6HBitWriter writer(dest);
+	writer.Write(BC6HMode11, 5);
+	for (int e = 0; e < 2; e++)
+	{
+		for (int c = 0; c < 3; c++)
+			writer.Write(endpoints[e][c], BC6HEndpointBits);
+	}
+	writer.Write(indices[0], 3);
+	for (int i = 1; i < 16; i++)
+		writer.Write(indices[i], 4);
+}
+
+void decodeBC6HBlock(const uint8_t* block, uint16_t* texels)
+{
+	BC6HBitReader reader(block);
+	if (reader.Read(5) != BC6HMode11)
+	{
+		memset(texels, 0, 16 * 3 * sizeof(uint16_t));
+		return;
+	}
+
+	BC6HEndpoints endpoints;
+	for (int e = 0; e < 2; e++)
+	{
+		for (int c = 0; c < 3; c++)
+			endpoints[e][c] = reader.Read(BC6HEndpointBits);
+	}
+
+	BC6HPalette palette;
+	GetPalette(endpoints, palette);
+	for (int i = 0; i < 16; i++)
+	{
+		int index = reader.Read(i == 0 ? 3 : 4);
+		for (int c = 0; c < 3; c++)
+			texels[i * 3 + c] = (uint16_t)palette[index][c];
+	}
+}
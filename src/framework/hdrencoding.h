@@ -0,0 +1,18 @@
+
+#pragma once
+
+#include <cstdint>
+
+// Packs an RGB color into the shared exponent RGB9E5 format (GL_EXT_texture_shared_exponent).
+// Negative and NaN components become 0 and components above 65408 are clamped.
+uint32_t floatToRGB9E5(float r, float g, float b);
+
+// Unpacks an RGB9E5 color into three floats
+void rgb9e5ToFloat(uint32_t packed, float* rgb);
+
+// Encodes a 4x4 block of RGB half floats (row by row, 3 halves per texel) as a 16 byte unsigned BC6H block.
+// Only the single region mode with 10 bit endpoints is used. Negative components become 0.
+void encodeBC6HBlock(const uint16_t* src, uint8_t* dest);
+
+// Decodes a block written by encodeBC6HBlock back into 4x4 RGB half floats. Other BC6H modes are not supported.
+void decodeBC6HBlock(const uint8_t* block, uint16_t* texels);
@@ -0,0 +1,69 @@
+
+#include "worker.h"
+#include "zdray.h"
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <exception>
+
+void Worker::RunJob(int count, std::function<void(int i)> callback)
+{
+	int threadCount = std::min(GetThreadCount(), count);
+	if (threadCount <= 1)
+	{
+		for (int i = 0; i < count; i++)
+			callback(i);
+		return;
+	}
+
+	// Hand out the work in batches small enough to even out uneven items, but large enough to keep the atomic off the hot path
+	int batchSize = std::max(count / (threadCount * 16), 1);
+
+	std::atomic<int> nextIndex(0);
+	std::atomic<bool> stop(false);
+	std::mutex mutex;
+	std::exception_ptr error;
+
+	auto threadMain = [&]()
+	{
+		try
+		{
+			while (!stop)
+			{
+				int start = nextIndex.fetch_add(batchSize);
+				if (start >= count)
+					break;
+
+				int end = std::min(start + batchSize, count);
+				for (int i = start; i < end; i++)
+					callback(i);
+			}
+		}
+		catch (...)
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			if (!error)
+				error = std::current_exception();
+			stop = true;
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (int i = 1; i < threadCount; i++)
+		threads.push_back(std::thread(threadMain));
+	threadMain();
+	for (std::thread& thread : threads)
+		thread.join();
+
+	if (error)
+		std::rethrow_exception(error);
+}
+
+int Worker::GetThreadCount()
+{
+	if (NumThreads > 0)
+		return NumThreads;
+	return std::max((int)std::thread::hardware_concurrency(), 1);
+}
@@ -0,0 +1,14 @@
+
+#pragma once
+
+#include <functional>
+
+class Worker
+{
+public:
+	// Calls callback(i) for every i in [0, count) spread over NumThreads threads (all cores when -j isn't given).
+	// The first exception thrown by a callback stops the remaining work and is rethrown on the calling thread.
+	static void RunJob(int count, std::function<void(int i)> callback);
+
+	static int GetThreadCount();
+};
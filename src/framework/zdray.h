@@ -22,13 +22,22 @@ enum ERejectMode
 	ERM_Rebuild
 };
 
+// Pixel format of the LIGHTMAP lump. The values are stored in the lump.
+enum ELightmapEncoding
+{
+	ELE_F16,		// Half float RGB, 6 bytes per texel
+	ELE_RGB9E5,		// Shared exponent RGB, 4 bytes per texel
+	ELE_BC6H		// Unsigned BC6H blocks, 1 byte per texel
+};
+
 extern const char		*Map;
 extern const char		*InName;
 extern const char		*OutName;
 extern bool				 BuildNodes, BuildGLNodes, ConformNodes, GLOnly, WriteComments;
-extern bool				 NoPrune;
+extern bool				 NoPrune, NoTiming;
 extern EBlockmapMode	 BlockmapMode;
 extern ERejectMode		 RejectMode;
+extern ELightmapEncoding LightmapEncoding;
 extern int				 MaxSegs;
 extern int				 SplitCost;
 extern int				 AAPreference;
@@ -36,6 +45,7 @@ extern bool				 CheckPolyobjs;
 extern bool				 CompressNodes, CompressGLNodes, ForceCompression, V5GLNodes;
 extern bool				 HaveSSE1, HaveSSE2;
 extern int				 SSELevel;
+extern int				 NumThreads;
 
 
 #define FIXED_MAX		INT_MAX
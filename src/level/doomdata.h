@@ -10,6 +10,7 @@
 #include <memory>
 #include <cmath>
 #include <optional>
+#include <stdexcept>
 #undef MIN
 #undef MAX
 #undef min
@@ -29,6 +30,27 @@ struct UDMFKey
 	const char *value;
 };
 
+// The properties of one map element. The keys live in FLevel::PropTable, which is
+// sized up front for the whole map, so Push never has to grow anything.
+struct UDMFKeyList
+{
+	UDMFKey *Keys = nullptr;
+	unsigned int Count = 0;
+	unsigned int Capacity = 0; // Keys counted for the element when the table was sized
+
+	void Push(const UDMFKey &key)
+	{
+		if (Count == Capacity)
+			throw std::runtime_error("More UDMF keys in a block than were counted for it");
+		Keys[Count++] = key;
+	}
+
+	unsigned int Size() const { return Count; }
+	const UDMFKey &operator[](unsigned int index) const { return Keys[index]; }
+	const UDMFKey *begin() const { return Keys; }
+	const UDMFKey *end() const { return Keys + Count; }
+};
+
 struct MapVertex
 {
 	short x, y;
@@ -97,7 +119,7 @@ struct IntSideDef
 	IntLineDef *line;
 
 	SideDefSampleProps sampling;
-	TArray<UDMFKey> props;
+	UDMFKeyList props;
 
 	FTextureID GetTexture(WallPart part)
 	{
@@ -161,7 +183,7 @@ struct IntLineDef
 	int args[5] = {};
 	uint32_t sidenum[2] = {NO_INDEX, NO_INDEX};
 
-	TArray<UDMFKey> props;
+	UDMFKeyList props;
 	TArray<int> ids;
 
 	IntSideDef* sidedef[2] = { nullptr, nullptr };
@@ -229,7 +251,7 @@ struct IntSector
 		struct { bool skyFloor, skyCeiling; };
 	};
 
-	TArray<UDMFKey> props;
+	UDMFKeyList props;
 
 	TArray<IntLineDef*> lines;
 	TArray<IntLineDef*> portals;
@@ -395,12 +417,12 @@ struct IntThing
 	float height = 0; // UDMF
 	float alpha = 1.0;
 
-	TArray<UDMFKey> props;
+	UDMFKeyList props;
 };
 
 struct IntVertex
 {
-	TArray<UDMFKey> props;
+	UDMFKeyList props;
 	double zfloor = 100000, zceiling = 100000;
 
 	inline bool HasZFloor() const { return zfloor != 100000; }
@@ -604,7 +626,8 @@ struct FLevel
 
 	fixed_t MinX, MinY, MaxX, MaxY;
 
-	TArray<UDMFKey> props;
+	UDMFKeyList props;
+	std::unique_ptr<UDMFKey[]> PropTable;
 
 	TArray<ThingLight> ThingLights;
 
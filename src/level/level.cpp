@@ -20,6 +20,8 @@
 
 #include "level/level.h"
 #include "lightmapper/gpuraytracer.h"
+#include "lightmapper/cpuraytracer.h"
+#include "lightmapper/hw_lightmapcache.h"
 //#include "rejectbuilder.h"
 #include <memory>
 
@@ -29,6 +31,9 @@
 #endif
 
 extern int LMDims;
+extern bool CPURaytrace;
+extern const char *LightmapCacheFile;
+extern float UniformTileTolerance;
 
 extern void ShowView (FLevel *level);
 
@@ -841,14 +846,52 @@ void FProcessor::BuildLightmaps()
 
 	printf("   Creating level mesh\n");
 	LightmapMesh = std::make_unique<DoomLevelMesh>(Level);
-	LightmapMesh->SetupTileTransforms();
 	LightmapMesh->PackLightmapAtlas(0);
 	LightmapMesh->BeginFrame(Level);
 	printf("   Surfaces: %d\n", LightmapMesh->GetSurfaceCount());
 	printf("   Tiles: %d\n", (int)LightmapMesh->LightmapTiles.Size());
 
-	std::unique_ptr<GPURaytracer> gpuraytracer = std::make_unique<GPURaytracer>();
-	gpuraytracer->Raytrace(LightmapMesh.get());
+	std::unique_ptr<GPURaytracer> gpuraytracer;
+	if (!CPURaytrace)
+	{
+		try
+		{
+			gpuraytracer = std::make_unique<GPURaytracer>();
+		}
+		catch (const std::exception& e)
+		{
+			printf("   Vulkan is unavailable (%s). Using the CPU ray tracer instead.\n", e.what());
+		}
+	}
+
+	// The ray tracer is picked first, as the two produce different texels and the cache must not mix them
+	LightmapCache cache;
+	if (LightmapCacheFile)
+	{
+		cache.Load(LightmapCacheFile, Wad.LumpName(Lump), !gpuraytracer);
+		cache.Apply(LightmapMesh.get());
+	}
+
+	if (gpuraytracer)
+	{
+		gpuraytracer->Raytrace(LightmapMesh.get());
+	}
+	else
+	{
+		CPURaytracer cpuraytracer;
+		cpuraytracer.Raytrace(LightmapMesh.get());
+	}
+
+	if (LightmapCacheFile)
+	{
+		cache.CopyCachedTiles(LightmapMesh.get());
+		cache.Save(LightmapMesh.get(), LightmapCacheFile);
+	}
+
+	// After the cache, as it keeps the tiles at their full size. Off unless asked for, as it changes the size and projection
+	// of the tiles in the LIGHTMAP lump from what the engine builds for the same surfaces.
+	if (UniformTileTolerance >= 0.0f)
+		LightmapMesh->CollapseUniformTiles(UniformTileTolerance);
 }
 
 void FProcessor::DumpMesh()
@@ -10,6 +10,9 @@
 #include "lightmapper/doom_levelmesh.h"
 #include <miniz/miniz.h>
 
+class UDMFScanner;
+class UDMFWriteBuffer;
+
 #define DEFINE_SPECIAL(name, num, min, max, map) name = num,
 
 typedef enum {
@@ -126,27 +129,27 @@ private:
 	void WriteNodes5(FWadWriter &out, const char *name, const MapNodeEx *zaNodes, int count) const;
 	void WriteSSectors5(FWadWriter &out, const char *name, const MapSubsectorEx *zaSubs, int count) const;
 
-	const char *ParseKey(const char *&value);
-	bool CheckKey(const char *&key, const char *&value);
-	void ParseThing(IntThing *th);
-	void ParseLinedef(IntLineDef *ld);
-	void ParseSidedef(IntSideDef *sd);
-	void ParseSector(IntSector *sec);
-	void ParseVertex(WideVertex *vt, IntVertex *vtp);
-	void ParseMapProperties();
+	void ParseThing(UDMFScanner &sc, IntThing *th);
+	void ParseLinedef(UDMFScanner &sc, IntLineDef *ld);
+	void ParseSidedef(UDMFScanner &sc, IntSideDef *sd);
+	void ParseSector(UDMFScanner &sc, IntSector *sec);
+	void ParseVertex(UDMFScanner &sc, WideVertex *vt, IntVertex *vtp);
+	void ParseMapProperties(UDMFScanner &sc);
 	void ParseTextMap(int lump);
 
-	void WriteProps(FWadWriter &out, TArray<UDMFKey> &props);
-	void WriteIntProp(FWadWriter &out, const char *key, int value);
-	void WriteThingUDMF(FWadWriter &out, IntThing *th, int num);
-	void WriteLinedefUDMF(FWadWriter &out, IntLineDef *ld, int num);
-	void WriteSidedefUDMF(FWadWriter &out, IntSideDef *sd, int num);
-	void WriteSectorUDMF(FWadWriter &out, IntSector *sec, int num);
-	void WriteVertexUDMF(FWadWriter &out, IntVertex *vt, int num);
+	void WriteProps(UDMFWriteBuffer &out, const UDMFKeyList &props);
+	void WriteIntProp(UDMFWriteBuffer &out, const char *key, int value);
+	void WriteBlockHeader(UDMFWriteBuffer &out, const char *type, int num);
+	void WriteThingUDMF(UDMFWriteBuffer &out, IntThing *th, int num);
+	void WriteLinedefUDMF(UDMFWriteBuffer &out, IntLineDef *ld, int num);
+	void WriteSidedefUDMF(UDMFWriteBuffer &out, IntSideDef *sd, int num);
+	void WriteSectorUDMF(UDMFWriteBuffer &out, IntSector *sec, int num);
+	void WriteVertexUDMF(UDMFWriteBuffer &out, IntVertex *vt, int num);
 	void WriteTextMap(FWadWriter &out);
 	void WriteUDMF(FWadWriter &out);
 
 	FLevel Level;
+	std::unique_ptr<char[]> TextMap;
 
 	TArray<FNodeBuilder::FPolyStart> PolyStarts;
 	TArray<FNodeBuilder::FPolyStart> PolyAnchors;
@@ -19,11 +19,12 @@
 */
 
 
-#include <float.h>
+#include <charconv>
+#include <chrono>
+#include <mutex>
 #include "level/level.h"
-#include "parse/sc_man.h"
-
-#include "framework/xs_Float.h"
+#include "parse/udmf_scanner.h"
+#include "framework/worker.h"
 
 #ifdef _MSC_VER
 #pragma warning(disable: 4267) // warning C4267: 'argument': conversion from 'size_t' to 'int', possible loss of data
@@ -49,108 +50,155 @@ static void CopyUDMFString(char *dest, int destlen, const char *udmfvalue)
 	*dest = 0;
 }
 
-class StringBuffer
-{
-	const static size_t BLOCK_SIZE = 100000;
-	const static size_t BLOCK_ALIGN = sizeof(size_t);
-
-	TDeletingArray<char *> blocks;
-	size_t currentindex;
+//===========================================================================
+//
+// Splits a moreids string on spaces and quotes. This used to be a strtok
+// loop, but strtok can't be used with blocks parsed on multiple threads.
+//
+//===========================================================================
 
-	char *Alloc(size_t size)
+static std::vector<long long> SplitTagList(const char *tags)
+{
+	std::vector<long long> result;
+	const char *p = tags;
+	while (*p != 0)
 	{
-		if (currentindex + size >= BLOCK_SIZE)
+		if (*p == ' ' || *p == '"')
 		{
-			// Block is full - get a new one!
-			char *newblock = new char[BLOCK_SIZE];
-			blocks.Push(newblock);
-			currentindex = 0;
+			p++;
+			continue;
 		}
-		size = (size + BLOCK_ALIGN-1) &~ (BLOCK_ALIGN-1);
-		char *p = blocks[blocks.Size()-1] + currentindex;
-		currentindex += size;
-		return p;
-	}
-public:
 
-	StringBuffer()
-	{
-		currentindex = BLOCK_SIZE;
+		result.push_back(strtoll(p, nullptr, 0));
+		while (*p != 0 && *p != ' ' && *p != '"')
+			p++;
 	}
-
-	char * Copy(const char * p)
-	{
-		return p != nullptr? strcpy(Alloc(strlen(p)+1) , p) : nullptr;
-	}
-};
-
-StringBuffer stbuf;
-
+	return result;
+}
 
 //===========================================================================
 //
-// Parses a 'key = value;' line of the map
+// Compile time perfect hashes for the keys each block type handles
+//
+// The constructor searches for a seed that gives every key its own slot,
+// so looking up a key costs one hash and one string compare.
 //
 //===========================================================================
 
-const char *FProcessor::ParseKey(const char *&value)
+constexpr uint32_t UDMFKeyHash(const char *key, uint32_t seed)
 {
-	SC_MustGetString();
-	const char *key = stbuf.Copy(sc_String);
-	SC_MustGetStringName("=");
-
-	sc_Number = INT_MIN;
-	sc_Float = DBL_MIN;
-	if (!SC_CheckFloat())
+	uint32_t hash = 2166136261u ^ seed;
+	for (; *key != 0; key++)
 	{
-		SC_MustGetString();
+		char c = (*key >= 'A' && *key <= 'Z') ? *key - 'A' + 'a' : *key;
+		hash = (hash ^ (uint8_t)c) * 16777619u;
 	}
-	value = stbuf.Copy(sc_String);
-	SC_MustGetStringName(";");
-	return key;
+	return hash;
 }
 
-bool FProcessor::CheckKey(const char *&key, const char *&value)
+template<size_t N>
+class UDMFKeyTable
 {
-	SC_SavePos();
-	SC_MustGetString();
-	if (SC_CheckString("="))
+public:
+	constexpr UDMFKeyTable(const char *const (&names)[N]) : Names(), Slots()
 	{
-		SC_RestorePos();
-		key = ParseKey(value);
-		return true;
+		for (size_t i = 0; i < N; i++)
+			Names[i] = names[i];
+
+		while (true)
+		{
+			for (int &slot : Slots)
+				slot = -1;
+
+			bool collision = false;
+			for (size_t i = 0; i < N && !collision; i++)
+			{
+				int &slot = Slots[UDMFKeyHash(names[i], Seed) & (TableSize - 1)];
+				collision = (slot != -1);
+				slot = (int)i;
+			}
+
+			if (!collision)
+				break;
+			Seed++;
+		}
 	}
-	SC_RestorePos();
-	return false;
-}
 
-int CheckInt(const char *key)
-{
-	if (sc_Number == INT_MIN)
+	// Returns the index of the key in the name list, or -1 if it isn't in there
+	int Find(const char *key) const
 	{
-		SC_ScriptError("Integer value expected for key '%s'", key);
+		int index = Slots[UDMFKeyHash(key, Seed) & (TableSize - 1)];
+		return (index != -1 && stricmp(key, Names[index]) == 0) ? index : -1;
 	}
-	return sc_Number;
-}
 
-double CheckFloat(const char *key)
-{
-	if (sc_Float == DBL_MIN)
+	// Returns the shared copy of a key found at index, so identical keys all point at the same string
+	const char *Intern(const char *key, int index) const
 	{
-		SC_ScriptError("Floating point value expected for key '%s'", key);
+		return (index != -1 && strcmp(key, Names[index]) == 0) ? Names[index] : key;
 	}
-	return sc_Float;
-}
 
-fixed_t CheckFixed(const char *key)
-{
-	double val = CheckFloat(key);
-	if (val < -32768 || val > 32767)
+private:
+	static constexpr size_t CalcTableSize()
 	{
-		SC_ScriptError("Fixed point value is out of range for key '%s'\n\t%.2f should be within [-32768,32767]", key, val / 65536);
+		size_t size = 1;
+		while (size < N * 4)
+			size <<= 1;
+		return size;
 	}
-	return xs_Fix<16>::ToFix(val);
-}
+
+	static constexpr size_t TableSize = CalcTableSize();
+
+	const char *Names[N];
+	int Slots[TableSize];
+	uint32_t Seed = 0;
+};
+
+enum class ThingKey { X, Y, Angle, Pitch, Type, Height, Special, Arg0, Arg1, Arg2, Arg3, Arg4, Alpha, Arg0Str, Count };
+static constexpr const char *ThingKeyNames[] = { "x", "y", "angle", "pitch", "type", "height", "special", "arg0", "arg1", "arg2", "arg3", "arg4", "alpha", "arg0str" };
+static_assert(std::size(ThingKeyNames) == (size_t)ThingKey::Count, "ThingKeyNames does not match ThingKey");
+static constexpr UDMFKeyTable ThingKeys(ThingKeyNames);
+
+enum class LinedefKey
+{
+	V1, V2, Special, Arg0, Arg1, Arg2, Arg3, Arg4, MoreIds, Blocking, BlockMonsters, TwoSided, Id,
+	SampleDist, SampleDistTop, SampleDistMid, SampleDistBot, SideFront, SideBack, Count
+};
+static constexpr const char *LinedefKeyNames[] =
+{
+	"v1", "v2", "special", "arg0", "arg1", "arg2", "arg3", "arg4", "moreids", "blocking", "blockmonsters", "twosided", "id",
+	"lm_sampledist", "lm_sampledist_top", "lm_sampledist_mid", "lm_sampledist_bot", "sidefront", "sideback"
+};
+static_assert(std::size(LinedefKeyNames) == (size_t)LinedefKey::Count, "LinedefKeyNames does not match LinedefKey");
+static constexpr UDMFKeyTable LinedefKeys(LinedefKeyNames);
+
+enum class SidedefKey { Sector, TextureTop, TextureMiddle, TextureBottom, OffsetXMid, OffsetYMid, SampleDist, SampleDistTop, SampleDistMid, SampleDistBot, Count };
+static constexpr const char *SidedefKeyNames[] =
+{
+	"sector", "texturetop", "texturemiddle", "texturebottom", "offsetx_mid", "offsety_mid",
+	"lm_sampledist", "lm_sampledist_top", "lm_sampledist_mid", "lm_sampledist_bot"
+};
+static_assert(std::size(SidedefKeyNames) == (size_t)SidedefKey::Count, "SidedefKeyNames does not match SidedefKey");
+static constexpr UDMFKeyTable SidedefKeys(SidedefKeyNames);
+
+enum class SectorKey
+{
+	HeightFloor, HeightCeiling, TextureCeiling, TextureFloor, LightLevel, Special, Id,
+	CeilingPlaneA, CeilingPlaneB, CeilingPlaneC, CeilingPlaneD, FloorPlaneA, FloorPlaneB, FloorPlaneC, FloorPlaneD,
+	MoreIds, SampleDistFloor, SampleDistCeiling, Count
+};
+static constexpr const char *SectorKeyNames[] =
+{
+	"heightfloor", "heightceiling", "textureceiling", "texturefloor", "lightlevel", "special", "id",
+	"ceilingplane_a", "ceilingplane_b", "ceilingplane_c", "ceilingplane_d", "floorplane_a", "floorplane_b", "floorplane_c", "floorplane_d",
+	"moreids", "lm_sampledist_floor", "lm_sampledist_ceiling"
+};
+static_assert(std::size(SectorKeyNames) == (size_t)SectorKey::Count, "SectorKeyNames does not match SectorKey");
+static constexpr UDMFKeyTable SectorKeys(SectorKeyNames);
+
+enum class VertexKey { X, Y, ZFloor, ZCeiling, Count };
+static constexpr const char *VertexKeyNames[] = { "x", "y", "zfloor", "zceiling" };
+static_assert(std::size(VertexKeyNames) == (size_t)VertexKey::Count, "VertexKeyNames does not match VertexKey");
+static constexpr UDMFKeyTable VertexKeys(VertexKeyNames);
 
 //===========================================================================
 //
@@ -158,74 +206,66 @@ fixed_t CheckFixed(const char *key)
 //
 //===========================================================================
 
-void FProcessor::ParseThing(IntThing *th)
+void FProcessor::ParseThing(UDMFScanner &sc, IntThing *th)
 {
-	SC_MustGetStringName("{");
-	while (!SC_CheckString("}"))
+	sc.MustGetStringName("{");
+	while (!sc.CheckString("}"))
 	{
 		const char *value;
-		const char *key = ParseKey(value);
-
-		if (!stricmp(key, "x"))
-		{
-			th->x = CheckFixed(key);
-		}
-		else if (!stricmp(key, "y"))
-		{
-			th->y = CheckFixed(key);
-		}
-		if (!stricmp(key, "angle"))
-		{
-			th->angle = (short)CheckInt(key);
-		}
-		if (!stricmp(key, "pitch"))
-		{
-			th->pitch = (short)CheckInt(key);
-		}
-		if (!stricmp(key, "type"))
-		{
-			th->type = (short)CheckInt(key);
-		}
-		if (!stricmp(key, "height"))
-		{
-			th->height = CheckInt(key);
-		}
-		if (!stricmp(key, "special"))
-		{
-			th->special = CheckInt(key);
-		}
-		if (!stricmp(key, "arg0"))
-		{
-			th->args[0] = CheckInt(key);
-		}
-		if (!stricmp(key, "arg1"))
-		{
-			th->args[1] = CheckInt(key);
-		}
-		if (!stricmp(key, "arg2"))
-		{
-			th->args[2] = CheckInt(key);
-		}
-		if (!stricmp(key, "arg3"))
-		{
-			th->args[3] = CheckInt(key);
-		}
-		if (!stricmp(key, "arg4"))
-		{
-			th->args[4] = CheckInt(key);
-		}
-		if (!stricmp(key, "alpha"))
-		{
-			th->alpha = CheckFloat(key);
-		}
-		if (!stricmp(key, "arg0str"))
-		{
+		const char *key = sc.ParseKey(value);
+
+		int index = ThingKeys.Find(key);
+		switch ((ThingKey)index)
+		{
+		case ThingKey::X:
+			th->x = sc.CheckFixed(key);
+			break;
+		case ThingKey::Y:
+			th->y = sc.CheckFixed(key);
+			break;
+		case ThingKey::Angle:
+			th->angle = (short)sc.CheckInt(key);
+			break;
+		case ThingKey::Pitch:
+			th->pitch = (short)sc.CheckInt(key);
+			break;
+		case ThingKey::Type:
+			th->type = (short)sc.CheckInt(key);
+			break;
+		case ThingKey::Height:
+			th->height = sc.CheckInt(key);
+			break;
+		case ThingKey::Special:
+			th->special = sc.CheckInt(key);
+			break;
+		case ThingKey::Arg0:
+			th->args[0] = sc.CheckInt(key);
+			break;
+		case ThingKey::Arg1:
+			th->args[1] = sc.CheckInt(key);
+			break;
+		case ThingKey::Arg2:
+			th->args[2] = sc.CheckInt(key);
+			break;
+		case ThingKey::Arg3:
+			th->args[3] = sc.CheckInt(key);
+			break;
+		case ThingKey::Arg4:
+			th->args[4] = sc.CheckInt(key);
+			break;
+		case ThingKey::Alpha:
+			th->alpha = sc.CheckFloat(key);
+			break;
+		case ThingKey::Arg0Str:
 			th->arg0str = value;
 			th->arg0str.StripChars("\"");
+			break;
+		default:
+			break;
 		}
 
 		// now store the key in its unprocessed form
-		UDMFKey k = {key, value};
+		UDMFKey k = {ThingKeys.Intern(key, index), value};
 		th->props.Push(k);
 	}
 }
@@ -236,7 +276,7 @@ void FProcessor::ParseThing(IntThing *th)
 //
 //===========================================================================
 
-void FProcessor::ParseLinedef(IntLineDef *ld)
+void FProcessor::ParseLinedef(UDMFScanner &sc, IntLineDef *ld)
 {
 	ld->sampling.SetGeneralSampleDistance(0);
 	ld->sampling.SetSampleDistance(WallPart::TOP, 0);
@@ -244,47 +284,46 @@ void FProcessor::ParseLinedef(IntLineDef *ld)
 	ld->sampling.SetSampleDistance(WallPart::BOTTOM, 0);
 
 	std::vector<int> moreids;
-	SC_MustGetStringName("{");
-	while (!SC_CheckString("}"))
+	sc.MustGetStringName("{");
+	while (!sc.CheckString("}"))
 	{
 		const char *value;
-		const char *key = ParseKey(value);
+		const char *key = sc.ParseKey(value);
 
-		if (!stricmp(key, "v1"))
+		int index = LinedefKeys.Find(key);
+		switch ((LinedefKey)index)
 		{
-			ld->v1 = CheckInt(key);
+		case LinedefKey::V1:
+			ld->v1 = sc.CheckInt(key);
 			continue;	// do not store in props
-		}
-		else if (!stricmp(key, "v2"))
-		{
-			ld->v2 = CheckInt(key);
+		case LinedefKey::V2:
+			ld->v2 = sc.CheckInt(key);
 			continue;	// do not store in props
-		}
-		else if (Extended && !stricmp(key, "special"))
-		{
-			ld->special = CheckInt(key);
-		}
-		else if (Extended && !stricmp(key, "arg0"))
-		{
-			ld->args[0] = CheckInt(key);
-		}
-		else if (Extended && !stricmp(key, "arg1"))
-		{
-			ld->args[1] = CheckInt(key);
-		}
-		else if (Extended && !stricmp(key, "arg2"))
-		{
-			ld->args[2] = CheckInt(key);
-		}
-		else if (Extended && !stricmp(key, "arg3"))
-		{
-			ld->args[3] = CheckInt(key);
-		}
-		else if (Extended && !stricmp(key, "arg4"))
-		{
-			ld->args[4] = CheckInt(key);
-		}
-		else if (stricmp(key, "moreids") == 0)
+		case LinedefKey::SideFront:
+			ld->sidenum[0] = sc.CheckInt(key);
+			continue;	// do not store in props
+		case LinedefKey::SideBack:
+			ld->sidenum[1] = sc.CheckInt(key);
+			continue;	// do not store in props
+		case LinedefKey::Special:
+			if (Extended) ld->special = sc.CheckInt(key);
+			break;
+		case LinedefKey::Arg0:
+			if (Extended) ld->args[0] = sc.CheckInt(key);
+			break;
+		case LinedefKey::Arg1:
+			if (Extended) ld->args[1] = sc.CheckInt(key);
+			break;
+		case LinedefKey::Arg2:
+			if (Extended) ld->args[2] = sc.CheckInt(key);
+			break;
+		case LinedefKey::Arg3:
+			if (Extended) ld->args[3] = sc.CheckInt(key);
+			break;
+		case LinedefKey::Arg4:
+			if (Extended) ld->args[4] = sc.CheckInt(key);
+			break;
+		case LinedefKey::MoreIds:
 		{
 			// delay parsing of the tag string until parsing of the sector is complete
 			// This ensures that the ID is always the first tag in the list.
@@ -292,66 +331,51 @@ void FProcessor::ParseLinedef(IntLineDef *ld)
 			if (tagstring != nullptr && *tagstring == '"')
 			{
 				// skip the quotation mark
-				auto workstring = strdup(tagstring + 1);
-				for (char* token = strtok(workstring, " \""); token; token = strtok(nullptr, " \""))
+				for (long long tag : SplitTagList(tagstring + 1))
 				{
-					auto tag = strtoll(token, nullptr, 0);
 					if (tag != -1 && (int)tag == tag)
 					{
 						moreids.push_back(tag);
 					}
 				}
-				free(workstring);
 			}
-		}
-		else if (!stricmp(key, "blocking") && !stricmp(value, "true"))
-		{
-			ld->flags |= ML_BLOCKING;
-		}
-		else if (!stricmp(key, "blockmonsters") && !stricmp(value, "true"))
-		{
-			ld->flags |= ML_BLOCKMONSTERS;
-		}
-		else if (!stricmp(key, "twosided") && !stricmp(value, "true"))
-		{
-			ld->flags |= ML_TWOSIDED;
-		}
-		else if (Extended && !stricmp(key, "id"))
-		{
-			int id = CheckInt(key);
-			ld->ids.Clear();
-			if (id != -1) ld->ids.Push(id);
-		}
-		else if (stricmp(key, "lm_sampledist") == 0)
-		{
-			ld->sampling.SetGeneralSampleDistance(CheckInt(key));
-		}
-		else if (stricmp(key, "lm_sampledist_top") == 0)
-		{
-			ld->sampling.SetSampleDistance(WallPart::TOP, CheckInt(key));
-		}
-		else if (stricmp(key, "lm_sampledist_mid") == 0)
-		{
-			ld->sampling.SetSampleDistance(WallPart::MIDDLE, CheckInt(key));
-		}
-		else if (stricmp(key, "lm_sampledist_bot") == 0)
-		{
-			ld->sampling.SetSampleDistance(WallPart::BOTTOM, CheckInt(key));
-		}
-
-		if (!stricmp(key, "sidefront"))
-		{
-			ld->sidenum[0] = CheckInt(key);
-			continue;	// do not store in props
-		}
-		else if (!stricmp(key, "sideback"))
-		{
-			ld->sidenum[1] = CheckInt(key);
-			continue;	// do not store in props
+			break;
+		}
+		case LinedefKey::Blocking:
+			if (!stricmp(value, "true")) ld->flags |= ML_BLOCKING;
+			break;
+		case LinedefKey::BlockMonsters:
+			if (!stricmp(value, "true")) ld->flags |= ML_BLOCKMONSTERS;
+			break;
+		case LinedefKey::TwoSided:
+			if (!stricmp(value, "true")) ld->flags |= ML_TWOSIDED;
+			break;
+		case LinedefKey::Id:
+			if (Extended)
+			{
+				int id = sc.CheckInt(key);
+				ld->ids.Clear();
+				if (id != -1) ld->ids.Push(id);
+			}
+			break;
+		case LinedefKey::SampleDist:
+			ld->sampling.SetGeneralSampleDistance(sc.CheckInt(key));
+			break;
+		case LinedefKey::SampleDistTop:
+			ld->sampling.SetSampleDistance(WallPart::TOP, sc.CheckInt(key));
+			break;
+		case LinedefKey::SampleDistMid:
+			ld->sampling.SetSampleDistance(WallPart::MIDDLE, sc.CheckInt(key));
+			break;
+		case LinedefKey::SampleDistBot:
+			ld->sampling.SetSampleDistance(WallPart::BOTTOM, sc.CheckInt(key));
+			break;
+		default:
+			break;
 		}
 
 		// now store the key in its unprocessed form
-		UDMFKey k = {key, value};
+		UDMFKey k = {LinedefKeys.Intern(key, index), value};
 		ld->props.Push(k);
 	}
 
@@ -365,9 +389,9 @@ void FProcessor::ParseLinedef(IntLineDef *ld)
 //
 //===========================================================================
 
-void FProcessor::ParseSidedef(IntSideDef *sd)
+void FProcessor::ParseSidedef(UDMFScanner &sc, IntSideDef *sd)
 {
-	SC_MustGetStringName("{");
+	sc.MustGetStringName("{");
 	sd->sector = NO_INDEX;
 	sd->textureoffset = 0;
 	sd->rowoffset = 0;
@@ -381,56 +405,50 @@ void FProcessor::ParseSidedef(IntSideDef *sd)
 	sd->sampling.SetSampleDistance(WallPart::TOP, 0);
 	sd->sampling.SetSampleDistance(WallPart::MIDDLE, 0);
 	sd->sampling.SetSampleDistance(WallPart::BOTTOM, 0);
-	while (!SC_CheckString("}"))
+	while (!sc.CheckString("}"))
 	{
 		const char *value;
-		const char *key = ParseKey(value);
+		const char *key = sc.ParseKey(value);
 
-		if (!stricmp(key, "sector"))
+		int index = SidedefKeys.Find(key);
+		switch ((SidedefKey)index)
 		{
-			sd->sector = CheckInt(key);
+		case SidedefKey::Sector:
+			sd->sector = sc.CheckInt(key);
 			continue;	// do not store in props
-		}
-
-		if (stricmp(key, "texturetop") == 0)
-		{
+		case SidedefKey::TextureTop:
 			CopyUDMFString(sd->toptexture, 64, value);
-		}
-		else if (stricmp(key, "texturemiddle") == 0)
-		{
+			break;
+		case SidedefKey::TextureMiddle:
 			CopyUDMFString(sd->midtexture, 64, value);
-		}
-		else if (stricmp(key, "texturebottom") == 0)
-		{
+			break;
+		case SidedefKey::TextureBottom:
 			CopyUDMFString(sd->bottomtexture, 64, value);
-		}
-		else if (stricmp(key, "offsetx_mid") == 0)
-		{
-			sd->textureoffset = CheckInt(key);
-		}
-		else if (stricmp(key, "offsety_mid") == 0)
-		{
-			sd->rowoffset = CheckInt(key);
-		}
-		else if (stricmp(key, "lm_sampledist") == 0)
-		{
-			sd->sampling.SetGeneralSampleDistance(CheckInt(key));
-		}
-		else if (stricmp(key, "lm_sampledist_top") == 0)
-		{
-			sd->sampling.SetSampleDistance(WallPart::TOP, CheckInt(key));
-		}
-		else if (stricmp(key, "lm_sampledist_mid") == 0)
-		{
-			sd->sampling.SetSampleDistance(WallPart::MIDDLE, CheckInt(key));
-		}
-		else if (stricmp(key, "lm_sampledist_bot") == 0)
-		{
-			sd->sampling.SetSampleDistance(WallPart::BOTTOM, CheckInt(key));
+			break;
+		case SidedefKey::OffsetXMid:
+			sd->textureoffset = sc.CheckInt(key);
+			break;
+		case SidedefKey::OffsetYMid:
+			sd->rowoffset = sc.CheckInt(key);
+			break;
+		case SidedefKey::SampleDist:
+			sd->sampling.SetGeneralSampleDistance(sc.CheckInt(key));
+			break;
+		case SidedefKey::SampleDistTop:
+			sd->sampling.SetSampleDistance(WallPart::TOP, sc.CheckInt(key));
+			break;
+		case SidedefKey::SampleDistMid:
+			sd->sampling.SetSampleDistance(WallPart::MIDDLE, sc.CheckInt(key));
+			break;
+		case SidedefKey::SampleDistBot:
+			sd->sampling.SetSampleDistance(WallPart::BOTTOM, sc.CheckInt(key));
+			break;
+		default:
+			break;
 		}
 
 		// now store the key in its unprocessed form
-		UDMFKey k = {key, value};
+		UDMFKey k = {SidedefKeys.Intern(key, index), value};
 		sd->props.Push(k);
 	}
 }
@@ -441,7 +459,7 @@ void FProcessor::ParseSidedef(IntSideDef *sd)
 //
 //===========================================================================
 
-void FProcessor::ParseSector(IntSector *sec)
+void FProcessor::ParseSector(UDMFScanner &sc, IntSector *sec)
 {
 	std::vector<int> moreids;
 	memset(&sec->data, 0, sizeof(sec->data));
@@ -450,101 +468,77 @@ void FProcessor::ParseSector(IntSector *sec)
 	sec->sampleDistanceFloor = 0;
 
 	int ceilingplane = 0, floorplane = 0;
-	bool floorTexZSet = false;
-	bool ceilingTexZSet = false;
 
-	SC_MustGetStringName("{");
-	while (!SC_CheckString("}"))
+	sc.MustGetStringName("{");
+	while (!sc.CheckString("}"))
 	{
 		const char *value;
-		const char *key = ParseKey(value);
-
-		if (stricmp(key, "heightfloor") == 0)
-		{
-			sec->floorTexZ = CheckFloat(key);
-			floorTexZSet = true;
-		}
-		else if (stricmp(key, "heightceiling") == 0)
-		{
-			sec->ceilingTexZ = CheckFloat(key);
-			ceilingTexZSet = true;
-		}
-		if (stricmp(key, "textureceiling") == 0)
-		{
+		const char *key = sc.ParseKey(value);
+
+		int index = SectorKeys.Find(key);
+		switch ((SectorKey)index)
+		{
+		case SectorKey::HeightFloor:
+			sec->data.floorheight = sc.CheckFloat(key);
+			sec->floorTexZ = sec->data.floorheight;
+			break;
+		case SectorKey::HeightCeiling:
+			sec->data.ceilingheight = sc.CheckFloat(key);
+			sec->ceilingTexZ = sec->data.ceilingheight;
+			break;
+		case SectorKey::TextureCeiling:
 			CopyUDMFString(sec->data.ceilingpic, 64, value);
-		}
-		else if (stricmp(key, "texturefloor") == 0)
-		{
+			break;
+		case SectorKey::TextureFloor:
 			CopyUDMFString(sec->data.floorpic, 64, value);
-		}
-		else if (stricmp(key, "heightceiling") == 0)
-		{
-			sec->data.ceilingheight = CheckFloat(key);
-			if (!ceilingTexZSet)
-				sec->ceilingTexZ = sec->data.ceilingheight;
-		}
-		else if (stricmp(key, "heightfloor") == 0)
-		{
-			sec->data.floorheight = CheckFloat(key);
-			if (!floorTexZSet)
-				sec->floorTexZ = sec->data.floorheight;
-		}
-		else if (stricmp(key, "lightlevel") == 0)
-		{
-			sec->data.lightlevel = CheckInt(key);
-		}
-		else if (stricmp(key, "special") == 0)
-		{
-			sec->data.special = CheckInt(key);
-		}
-		else if (stricmp(key, "id") == 0)
-		{
-			int id = CheckInt(key);
+			break;
+		case SectorKey::LightLevel:
+			sec->data.lightlevel = sc.CheckInt(key);
+			break;
+		case SectorKey::Special:
+			sec->data.special = sc.CheckInt(key);
+			break;
+		case SectorKey::Id:
+		{
+			int id = sc.CheckInt(key);
 			sec->data.tag = (short)id;
 			sec->tags.Clear();
 			if (id != 0) sec->tags.Push(id);
+			break;
 		}
-		else if (stricmp(key, "ceilingplane_a") == 0)
-		{
+		case SectorKey::CeilingPlaneA:
 			ceilingplane|=1;
-			sec->ceilingplane.a = CheckFloat(key);
-		}
-		else if (stricmp(key, "ceilingplane_b") == 0)
-		{
+			sec->ceilingplane.a = sc.CheckFloat(key);
+			break;
+		case SectorKey::CeilingPlaneB:
 			ceilingplane|=2;
-			sec->ceilingplane.b = CheckFloat(key);
-		}
-		else if (stricmp(key, "ceilingplane_c") == 0)
-		{
+			sec->ceilingplane.b = sc.CheckFloat(key);
+			break;
+		case SectorKey::CeilingPlaneC:
 			ceilingplane|=4;
-			sec->ceilingplane.c = CheckFloat(key);
-		}
-		else if (stricmp(key, "ceilingplane_d") == 0)
-		{
+			sec->ceilingplane.c = sc.CheckFloat(key);
+			break;
+		case SectorKey::CeilingPlaneD:
 			ceilingplane|=8;
-			sec->ceilingplane.d = CheckFloat(key);
-		}
-		else if (stricmp(key, "floorplane_a") == 0)
-		{
+			sec->ceilingplane.d = sc.CheckFloat(key);
+			break;
+		case SectorKey::FloorPlaneA:
 			floorplane|=1;
-			sec->floorplane.a = CheckFloat(key);
-		}
-		else if (stricmp(key, "floorplane_b") == 0)
-		{
+			sec->floorplane.a = sc.CheckFloat(key);
+			break;
+		case SectorKey::FloorPlaneB:
 			floorplane|=2;
-			sec->floorplane.b = CheckFloat(key);
-		}
-		else if (stricmp(key, "floorplane_c") == 0)
-		{
+			sec->floorplane.b = sc.CheckFloat(key);
+			break;
+		case SectorKey::FloorPlaneC:
 			floorplane|=4;
-			sec->floorplane.c = CheckFloat(key);
-		}
-		else if (stricmp(key, "floorplane_d") == 0)
-		{
+			sec->floorplane.c = sc.CheckFloat(key);
+			break;
+		case SectorKey::FloorPlaneD:
 			floorplane|=8;
-			sec->floorplane.d = CheckFloat(key);
-		}
-		else if (stricmp(key, "moreids") == 0)
+			sec->floorplane.d = sc.CheckFloat(key);
+			break;
+		case SectorKey::MoreIds:
 		{
 			// delay parsing of the tag string until parsing of the sector is complete
 			// This ensures that the ID is always the first tag in the list.
@@ -552,29 +546,28 @@ void FProcessor::ParseSector(IntSector *sec)
 			if (tagstring != nullptr && *tagstring == '"')
 			{
 				// skip the quotation mark
-				auto workstring = strdup(tagstring + 1);
-				for (char* token = strtok(workstring, " \""); token; token = strtok(nullptr, " \""))
+				for (long long tag : SplitTagList(tagstring + 1))
 				{
-					auto tag = strtoll(token, nullptr, 0);
 					if (tag != 0 && (int)tag == tag)
 					{
 						moreids.push_back(tag);
 					}
 				}
-				free(workstring);
 			}
+			break;
 		}
-		else if (stricmp(key, "lm_sampledist_floor") == 0)
-		{
-			sec->sampleDistanceFloor = CheckInt(key);
-		}
-		else if (stricmp(key, "lm_sampledist_ceiling") == 0)
-		{
-			sec->sampleDistanceCeiling = CheckInt(key);
+		case SectorKey::SampleDistFloor:
+			sec->sampleDistanceFloor = sc.CheckInt(key);
+			break;
+		case SectorKey::SampleDistCeiling:
+			sec->sampleDistanceCeiling = sc.CheckInt(key);
+			break;
+		default:
+			break;
 		}
 
 		// now store the key in its unprocessed form
-		UDMFKey k = {key, value};
+		UDMFKey k = {SectorKeys.Intern(key, index), value};
 		sec->props.Push(k);
 	}
 
@@ -622,34 +615,36 @@ void FProcessor::ParseSector(IntSector *sec)
 //
 //===========================================================================
 
-void FProcessor::ParseVertex(WideVertex *vt, IntVertex *vtp)
+void FProcessor::ParseVertex(UDMFScanner &sc, WideVertex *vt, IntVertex *vtp)
 {
 	vt->x = vt->y = 0;
-	SC_MustGetStringName("{");
-	while (!SC_CheckString("}"))
+	sc.MustGetStringName("{");
+	while (!sc.CheckString("}"))
 	{
 		const char *value;
-		const char *key = ParseKey(value);
-
-		if (!stricmp(key, "x"))
-		{
-			vt->x = CheckFixed(key);
-		}
-		else if (!stricmp(key, "y"))
-		{
-			vt->y = CheckFixed(key);
-		}
-		if (!stricmp(key, "zfloor"))
-		{
-			vtp->zfloor = CheckFloat(key);
-		}
-		else if (!stricmp(key, "zceiling"))
-		{
-			vtp->zceiling = CheckFloat(key);
+		const char *key = sc.ParseKey(value);
+
+		int index = VertexKeys.Find(key);
+		switch ((VertexKey)index)
+		{
+		case VertexKey::X:
+			vt->x = sc.CheckFixed(key);
+			break;
+		case VertexKey::Y:
+			vt->y = sc.CheckFixed(key);
+			break;
+		case VertexKey::ZFloor:
+			vtp->zfloor = sc.CheckFloat(key);
+			break;
+		case VertexKey::ZCeiling:
+			vtp->zceiling = sc.CheckFloat(key);
+			break;
+		default:
+			break;
 		}
 
 		// now store the key in its unprocessed form
-		UDMFKey k = {key, value};
+		UDMFKey k = {VertexKeys.Intern(key, index), value};
 		vtp->props.Push(k);
 	}
 }
@@ -661,13 +656,13 @@ void FProcessor::ParseVertex(WideVertex *vt, IntVertex *vtp)
 //
 //===========================================================================
 
-void FProcessor::ParseMapProperties()
+void FProcessor::ParseMapProperties(UDMFScanner &sc)
 {
 	const char *key, *value;
 
 	// all global keys must come before the first map element.
 
-	while (CheckKey(key, value))
+	while (sc.CheckKey(key, value))
 	{
 		if (!stricmp(key, "namespace"))
 		{
@@ -682,10 +677,62 @@ void FProcessor::ParseMapProperties()
 }
 
 
+//===========================================================================
+//
+// Figures out which kind of block follows a stretch of top level text.
+// Anything else in there is skipped like the sequential parser used to.
+//
+//===========================================================================
+
+enum class UDMFBlockType
+{
+	Unknown,
+	Thing,
+	Linedef,
+	Sidedef,
+	Sector,
+	Vertex,
+	NumTypes
+};
+
+static UDMFBlockType ParseBlockName(UDMFScanner &sc, bool blockFollows)
+{
+	while (sc.GetString())
+	{
+		UDMFBlockType type = UDMFBlockType::Unknown;
+		if (sc.Compare("thing")) type = UDMFBlockType::Thing;
+		else if (sc.Compare("linedef")) type = UDMFBlockType::Linedef;
+		else if (sc.Compare("sidedef")) type = UDMFBlockType::Sidedef;
+		else if (sc.Compare("sector")) type = UDMFBlockType::Sector;
+		else if (sc.Compare("vertex")) type = UDMFBlockType::Vertex;
+
+		if (type != UDMFBlockType::Unknown)
+		{
+			// The name must be immediately followed by the block
+			if (sc.GetString())
+			{
+				sc.UnGet();
+				sc.MustGetStringName("{");
+			}
+			else if (!blockFollows)
+			{
+				sc.MustGetString();
+			}
+			return type;
+		}
+	}
+	return UDMFBlockType::Unknown;
+}
+
 //===========================================================================
 //
 // Main parsing function
 //
+// The top level blocks are located first. Their names are read in order so
+// every block knows its slot in the level arrays up front, and then the
+// blocks themselves are parsed on all threads. When several things are
+// wrong with the map, the error closest to the start is reported.
+//
 //===========================================================================
 
 void FProcessor::ParseTextMap(int lump)
@@ -695,46 +742,131 @@ void FProcessor::ParseTextMap(int lump)
 	TArray<WideVertex> Vertices;
 
 	ReadLump<char> (Wad, lump, buffer, buffersize);
-	SC_OpenMem("TEXTMAP", buffer, buffersize);
 
-	SC_SetCMode(true);
-	ParseMapProperties();
+	// The parsed keys and values point straight into the lump text, so it has to stay around until the map has been written
+	TextMap.reset(buffer);
+
+	auto start = std::chrono::steady_clock::now();
 
-	while (SC_GetString())
+	std::vector<UDMFBlock> blocks = UDMFScanner::FindBlocks(buffer, buffersize);
+
+	// All properties go into a single table sized for the whole map, with every block filling in its own range of it
+	std::vector<unsigned int> propStart(blocks.size() + 1);
+	propStart[0] = UDMFScanner::CountKeys(buffer, blocks.empty() ? buffer + buffersize : blocks[0].Start);
+	Worker::RunJob((int)blocks.size(), [&](int i)
 	{
-		if (SC_Compare("thing"))
-		{
-			IntThing *th = &Level.Things[Level.Things.Reserve(1)];
-			ParseThing(th);
-		}
-		else if (SC_Compare("linedef"))
-		{
-			IntLineDef *ld = &Level.Lines[Level.Lines.Reserve(1)];
-			ParseLinedef(ld);
+		propStart[i + 1] = UDMFScanner::CountKeys(blocks[i].Start, blocks[i].End);
+	});
+	std::vector<unsigned int> propCapacity = propStart;
+	unsigned int propCount = 0;
+	for (unsigned int &start : propStart)
+	{
+		unsigned int count = start;
+		start = propCount;
+		propCount += count;
+	}
+	Level.PropTable.reset(new UDMFKey[propCount]);
+	Level.props = { &Level.PropTable[propStart[0]], 0, propCapacity[0] };
+	std::vector<UDMFBlockType> types(blocks.size());
+	std::vector<unsigned int> slots(blocks.size());
+	unsigned int counts[(int)UDMFBlockType::NumTypes] = {};
+
+	std::mutex errorMutex;
+	std::exception_ptr error;
+	size_t errorBlock = blocks.size();
+
+	char *textstart = buffer;
+	int textline = 1;
+	for (size_t i = 0; i <= blocks.size(); i++)
+	{
+		bool blockFollows = i < blocks.size();
+		char *textend = blockFollows ? blocks[i].Start : buffer + buffersize;
+		UDMFScanner sc(textstart, textend - textstart, textline);
+		try
+		{
+			if (i == 0)
+				ParseMapProperties(sc);
+			UDMFBlockType type = ParseBlockName(sc, blockFollows);
+			if (blockFollows)
+			{
+				types[i] = type;
+				slots[i] = counts[(int)type]++;
+				textstart = blocks[i].End;
+				textline = blocks[i].EndLine;
+			}
 		}
-		else if (SC_Compare("sidedef"))
+		catch (...)
 		{
-			IntSideDef *sd = &Level.Sides[Level.Sides.Reserve(1)];
-			ParseSidedef(sd);
+			// Blocks before this point can still have an earlier error
+			error = std::current_exception();
+			errorBlock = i;
+			break;
 		}
-		else if (SC_Compare("sector"))
+	}
+
+	unsigned int firstThing = Level.Things.Reserve(counts[(int)UDMFBlockType::Thing]);
+	unsigned int firstLine = Level.Lines.Reserve(counts[(int)UDMFBlockType::Linedef]);
+	unsigned int firstSide = Level.Sides.Reserve(counts[(int)UDMFBlockType::Sidedef]);
+	unsigned int firstSector = Level.Sectors.Reserve(counts[(int)UDMFBlockType::Sector]);
+	unsigned int firstVertexProps = Level.VertexProps.Reserve(counts[(int)UDMFBlockType::Vertex]);
+	Vertices.Reserve(counts[(int)UDMFBlockType::Vertex]);
+
+	Worker::RunJob((int)errorBlock, [&](int i)
+	{
+		UDMFScanner sc(blocks[i].Start, blocks[i].End - blocks[i].Start, blocks[i].Line);
+		unsigned int slot = slots[i];
+		UDMFKeyList props = { &Level.PropTable[propStart[i + 1]], 0, propCapacity[i + 1] };
+		try
 		{
-			IntSector *sec = &Level.Sectors[Level.Sectors.Reserve(1)];
-			ParseSector(sec);
+			switch (types[i])
+			{
+			case UDMFBlockType::Thing:
+				Level.Things[firstThing + slot].props = props;
+				ParseThing(sc, &Level.Things[firstThing + slot]);
+				break;
+			case UDMFBlockType::Linedef:
+				Level.Lines[firstLine + slot].props = props;
+				ParseLinedef(sc, &Level.Lines[firstLine + slot]);
+				break;
+			case UDMFBlockType::Sidedef:
+				Level.Sides[firstSide + slot].props = props;
+				ParseSidedef(sc, &Level.Sides[firstSide + slot]);
+				break;
+			case UDMFBlockType::Sector:
+				Level.Sectors[firstSector + slot].props = props;
+				ParseSector(sc, &Level.Sectors[firstSector + slot]);
+				break;
+			case UDMFBlockType::Vertex:
+				Vertices[slot].index = slot + 1;
+				Level.VertexProps[firstVertexProps + slot].props = props;
+				ParseVertex(sc, &Vertices[slot], &Level.VertexProps[firstVertexProps + slot]);
+				break;
+			default: break;
+			}
 		}
-		else if (SC_Compare("vertex"))
+		catch (...)
 		{
-			WideVertex *vt = &Vertices[Vertices.Reserve(1)];
-			IntVertex *vtp = &Level.VertexProps[Level.VertexProps.Reserve(1)];
-			vt->index = Vertices.Size();
-			ParseVertex(vt, vtp);
+			std::unique_lock<std::mutex> lock(errorMutex);
+			if ((size_t)i < errorBlock)
+			{
+				error = std::current_exception();
+				errorBlock = i;
+			}
 		}
-	}
+	});
+
+	if (error)
+		std::rethrow_exception(error);
+
 	Level.Vertices = new WideVertex[Vertices.Size()];
 	Level.NumVertices = Vertices.Size();
 	memcpy(Level.Vertices, &Vertices[0], Vertices.Size() * sizeof(WideVertex));
-	SC_Close();
-	delete[] buffer;
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	if (!NoTiming && seconds > 0.0)
+	{
+		printf("   TEXTMAP: %d bytes parsed in %.3f seconds (%.1f MB/s)\n", buffersize, seconds, buffersize / (seconds * 1024.0 * 1024.0));
+	}
 }
 
 
@@ -749,20 +881,59 @@ void FProcessor::LoadUDMF()
 	ParseTextMap(Lump+1);
 }
 
+//===========================================================================
+//
+// Memory buffer the TEXTMAP text is formatted into before it is handed to
+// the wad writer, so the lump goes out in a few large writes instead of
+// one fwrite per token.
+//
+//===========================================================================
+
+class UDMFWriteBuffer
+{
+public:
+	void Write(const char *text, size_t len)
+	{
+		Text.append(text, len);
+	}
+
+	void Write(const char *text)
+	{
+		Write(text, strlen(text));
+	}
+
+	void WriteInt(int value)
+	{
+		char buffer[16];
+		char *end = std::to_chars(buffer, buffer + sizeof(buffer), value).ptr;
+		Write(buffer, end - buffer);
+	}
+
+	void Flush(FWadWriter &out)
+	{
+		if (!Text.empty())
+			out.AddToLump(Text.data(), (int)Text.size());
+		Text.clear();
+	}
+
+private:
+	std::string Text;
+};
+
 //===========================================================================
 //
 // writes a property list
 //
 //===========================================================================
 
-void FProcessor::WriteProps(FWadWriter &out, TArray<UDMFKey> &props)
+void FProcessor::WriteProps(UDMFWriteBuffer &out, const UDMFKeyList &props)
 {
 	for(unsigned i=0; i< props.Size(); i++)
 	{
-		out.AddToLump(props[i].key, (int)strlen(props[i].key));
-		out.AddToLump(" = ", 3);
-		out.AddToLump(props[i].value, (int)strlen(props[i].value));
-		out.AddToLump(";\n", 2);
+		out.Write(props[i].key);
+		out.Write(" = ", 3);
+		out.Write(props[i].value);
+		out.Write(";\n", 2);
 	}
 }
 
@@ -772,34 +943,42 @@ void FProcessor::WriteProps(FWadWriter &out, TArray<UDMFKey> &props)
 //
 //===========================================================================
 
-void FProcessor::WriteIntProp(FWadWriter &out, const char *key, int value)
+void FProcessor::WriteIntProp(UDMFWriteBuffer &out, const char *key, int value)
 {
-	char buffer[20];
-
-	out.AddToLump(key, (int)strlen(key));
-	out.AddToLump(" = ", 3);
-	sprintf(buffer, "%d;\n", value);
-	out.AddToLump(buffer, (int)strlen(buffer));
+	out.Write(key);
+	out.Write(" = ", 3);
+	out.WriteInt(value);
+	out.Write(";\n", 2);
 }
 
 //===========================================================================
 //
-// writes a UDMF thing
+// writes the type name and opening brace of a block
 //
 //===========================================================================
 
-void FProcessor::WriteThingUDMF(FWadWriter &out, IntThing *th, int num)
+void FProcessor::WriteBlockHeader(UDMFWriteBuffer &out, const char *type, int num)
 {
-	out.AddToLump("thing", 5);
+	out.Write(type);
 	if (WriteComments)
 	{
-		char buffer[32];
-		int len = sprintf(buffer, " // %d", num);
-		out.AddToLump(buffer, len);
+		out.Write(" // ", 4);
+		out.WriteInt(num);
 	}
-	out.AddToLump("\n{\n", 3);
+	out.Write("\n{\n", 3);
+}
+
+//===========================================================================
+//
+// writes a UDMF thing
+//
+//===========================================================================
+
+void FProcessor::WriteThingUDMF(UDMFWriteBuffer &out, IntThing *th, int num)
+{
+	WriteBlockHeader(out, "thing", num);
 	WriteProps(out, th->props);
-	out.AddToLump("}\n\n", 3);
+	out.Write("}\n\n", 3);
 }
 
 //===========================================================================
@@ -808,22 +987,15 @@ void FProcessor::WriteThingUDMF(FWadWriter &out, IntThing *th, int num)
 //
 //===========================================================================
 
-void FProcessor::WriteLinedefUDMF(FWadWriter &out, IntLineDef *ld, int num)
+void FProcessor::WriteLinedefUDMF(UDMFWriteBuffer &out, IntLineDef *ld, int num)
 {
-	out.AddToLump("linedef", 7);
-	if (WriteComments)
-	{
-		char buffer[32];
-		int len = sprintf(buffer, " // %d", num);
-		out.AddToLump(buffer, len);
-	}
-	out.AddToLump("\n{\n", 3);
+	WriteBlockHeader(out, "linedef", num);
 	WriteIntProp(out, "v1", ld->v1);
 	WriteIntProp(out, "v2", ld->v2);
 	if (ld->sidenum[0] != NO_INDEX) WriteIntProp(out, "sidefront", ld->sidenum[0]);
 	if (ld->sidenum[1] != NO_INDEX) WriteIntProp(out, "sideback", ld->sidenum[1]);
 	WriteProps(out, ld->props);
-	out.AddToLump("}\n\n", 3);
+	out.Write("}\n\n", 3);
 }
 
 //===========================================================================
@@ -832,19 +1004,12 @@ void FProcessor::WriteLinedefUDMF(FWadWriter &out, IntLineDef *ld, int num)
 //
 //===========================================================================
 
-void FProcessor::WriteSidedefUDMF(FWadWriter &out, IntSideDef *sd, int num)
+void FProcessor::WriteSidedefUDMF(UDMFWriteBuffer &out, IntSideDef *sd, int num)
 {
-	out.AddToLump("sidedef", 7);
-	if (WriteComments)
-	{
-		char buffer[32];
-		int len = sprintf(buffer, " // %d", num);
-		out.AddToLump(buffer, len);
-	}
-	out.AddToLump("\n{\n", 3);
+	WriteBlockHeader(out, "sidedef", num);
 	WriteIntProp(out, "sector", sd->sector);
 	WriteProps(out, sd->props);
-	out.AddToLump("}\n\n", 3);
+	out.Write("}\n\n", 3);
 }
 
 //===========================================================================
@@ -853,18 +1018,11 @@ void FProcessor::WriteSidedefUDMF(FWadWriter &out, IntSideDef *sd, int num)
 //
 //===========================================================================
 
-void FProcessor::WriteSectorUDMF(FWadWriter &out, IntSector *sec, int num)
+void FProcessor::WriteSectorUDMF(UDMFWriteBuffer &out, IntSector *sec, int num)
 {
-	out.AddToLump("sector", 6);
-	if (WriteComments)
-	{
-		char buffer[32];
-		int len = sprintf(buffer, " // %d", num);
-		out.AddToLump(buffer, len);
-	}
-	out.AddToLump("\n{\n", 3);
+	WriteBlockHeader(out, "sector", num);
 	WriteProps(out, sec->props);
-	out.AddToLump("}\n\n", 3);
+	out.Write("}\n\n", 3);
 }
 
 //===========================================================================
@@ -873,60 +1031,80 @@ void FProcessor::WriteSectorUDMF(FWadWriter &out, IntSector *sec, int num)
 //
 //===========================================================================
 
-void FProcessor::WriteVertexUDMF(FWadWriter &out, IntVertex *vt, int num)
+void FProcessor::WriteVertexUDMF(UDMFWriteBuffer &out, IntVertex *vt, int num)
 {
-	out.AddToLump("vertex", 6);
-	if (WriteComments)
-	{
-		char buffer[32];
-		int len = sprintf(buffer, " // %d", num);
-		out.AddToLump(buffer, len);
-	}
-	out.AddToLump("\n{\n", 3);
+	WriteBlockHeader(out, "vertex", num);
 	WriteProps(out, vt->props);
-	out.AddToLump("}\n\n", 3);
+	out.Write("}\n\n", 3);
 }
 
 //===========================================================================
 //
 // writes a UDMF text map
 //
+// The blocks are formatted in parallel, a run of blocks of the same type
+// per buffer, and the buffers are then appended to the lump in order.
+//
 //===========================================================================
 
 void FProcessor::WriteTextMap(FWadWriter &out)
 {
-	out.StartWritingLump("TEXTMAP");
-	WriteProps(out, Level.props);
-	for(int i = 0; i < Level.NumThings(); i++)
+	const int blocksPerBuffer = 1024;
+
+	struct BlockRun
 	{
-		WriteThingUDMF(out, &Level.Things[i], i);
-	}
+		UDMFBlockType type;
+		int start, end;
+	};
 
-	for(int i = 0; i < Level.NumOrgVerts; i++)
+	std::vector<BlockRun> runs;
+	auto addRuns = [&](UDMFBlockType type, int count)
+	{
+		for (int start = 0; start < count; start += blocksPerBuffer)
+			runs.push_back({ type, start, std::min(start + blocksPerBuffer, count) });
+	};
+	addRuns(UDMFBlockType::Thing, Level.NumThings());
+	addRuns(UDMFBlockType::Vertex, Level.NumOrgVerts);
+	addRuns(UDMFBlockType::Linedef, Level.NumLines());
+	addRuns(UDMFBlockType::Sidedef, Level.NumSides());
+	addRuns(UDMFBlockType::Sector, Level.NumSectors());
+
+	for (int i = 0; i < Level.NumOrgVerts; i++)
 	{
-		WideVertex *vt = &Level.Vertices[i];
-		if (vt->index <= 0)
+		if (Level.Vertices[i].index <= 0)
 		{
 			// not valid!
 			throw std::runtime_error("Invalid vertex data.");
 		}
-		WriteVertexUDMF(out, &Level.VertexProps[vt->index-1], i);
 	}
 
-	for(int i = 0; i < Level.NumLines(); i++)
+	std::vector<UDMFWriteBuffer> buffers(runs.size());
+	Worker::RunJob((int)runs.size(), [&](int r)
 	{
-		WriteLinedefUDMF(out, &Level.Lines[i], i);
-	}
+		const BlockRun &run = runs[r];
+		UDMFWriteBuffer &buffer = buffers[r];
+		for (int i = run.start; i < run.end; i++)
+		{
+			switch (run.type)
+			{
+			case UDMFBlockType::Thing: WriteThingUDMF(buffer, &Level.Things[i], i); break;
+			case UDMFBlockType::Vertex: WriteVertexUDMF(buffer, &Level.VertexProps[Level.Vertices[i].index - 1], i); break;
+			case UDMFBlockType::Linedef: WriteLinedefUDMF(buffer, &Level.Lines[i], i); break;
+			case UDMFBlockType::Sidedef: WriteSidedefUDMF(buffer, &Level.Sides[i], i); break;
+			case UDMFBlockType::Sector: WriteSectorUDMF(buffer, &Level.Sectors[i], i); break;
+			default: break;
+			}
+		}
+	});
 
-	for(int i = 0; i < Level.NumSides(); i++)
-	{
-		WriteSidedefUDMF(out, &Level.Sides[i], i);
-	}
+	out.StartWritingLump("TEXTMAP");
 
-	for(int i = 0; i < Level.NumSectors(); i++)
-	{
-		WriteSectorUDMF(out, &Level.Sectors[i], i);
-	}
+	UDMFWriteBuffer header;
+	WriteProps(header, Level.props);
+	header.Flush(out);
+
+	for (UDMFWriteBuffer &buffer : buffers)
+		buffer.Flush(out);
 }
 
 //===========================================================================
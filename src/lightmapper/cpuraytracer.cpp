@@ -0,0 +1,1647 @@
+
+#include "cpuraytracer.h"
+#include "doom_levelmesh.h"
+#include "framework/halffloat.h"
+#include "framework/textureid.h"
+#include "framework/worker.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+extern bool lm_ao;
+extern bool lm_softshadows;
+extern bool lm_sunlight;
+extern bool lm_blur;
+extern bool lm_bounce;
+extern bool lm_adaptive;
+extern float lm_lightcutoff;
+extern int lm_lightbudget;
+extern int lm_radiosity;
+extern int lm_aosamples;
+extern int lm_bouncesamples;
+extern int lm_softshadowsamples;
+extern bool lm_denoise;
+
+namespace
+{
+	// Standard sample positions for 4x multisampling, which is what the GPU bake image uses
+	const float SampleLocations[4][2] =
+	{
+		{ 0.375f, 0.125f },
+		{ 0.875f, 0.375f },
+		{ 0.125f, 0.625f },
+		{ 0.625f, 0.875f }
+	};
+
+	// Adaptive sampling. A texel starts with the first round of samples and only takes the rest while the
+	// standard error of their mean is above the tolerance. These must match the ones in the shaders.
+	const int MaxSoftShadowSampleCount = 64;
+	const int SoftShadowFirstRound = 4;
+	const float SoftShadowTolerance = 0.02f; // Fraction of the light
+	const float AOTolerance = 0.01f;
+	const float BounceTolerance = 0.05f; // Fraction of the mean
+
+	// Texels that took few samples are traced again with all of them if a neighbour differs by more than this
+	const float NeighbourTolerance = 0.5f; // Fraction of the brighter of the two
+	const float NeighbourMinBrightness = 0.05f;
+
+	// Edge-aware a-trous filter run over the ambient occlusion and bounce light when denoising
+	const int DenoiseIterations = 3; // Steps of 1, 2 and 4 texels
+	const float DenoiseKernel[3] = { 0.25f, 0.5f, 0.25f };
+	const float DenoiseNormalPower = 32.0f;
+	const float DenoiseAOSigmas = 0.5f; // Edge stop in standard errors of independent samples. The Hammersley samples are less noisy than that.
+
+	// Disk sample i of a soft shadow. The first round spans the whole disk and the rest fill in between.
+	int GetSoftShadowSampleIndex(int i, int count)
+	{
+		if (i < SoftShadowFirstRound)
+			return i * (count - 1) / 3;
+		int index = i - SoftShadowFirstRound + 1;
+		if (index >= (count - 1) / 3)
+			index++;
+		if (index >= 2 * (count - 1) / 3)
+			index++;
+		return index;
+	}
+
+	float RadicalInverse_VdC(uint32_t bits)
+	{
+		bits = (bits << 16u) | (bits >> 16u);
+		bits = ((bits & 0x55555555u) << 1u) | ((bits & 0xAAAAAAAAu) >> 1u);
+		bits = ((bits & 0x33333333u) << 2u) | ((bits & 0xCCCCCCCCu) >> 2u);
+		bits = ((bits & 0x0F0F0F0Fu) << 4u) | ((bits & 0xF0F0F0F0u) >> 4u);
+		bits = ((bits & 0x00FF00FFu) << 8u) | ((bits & 0xFF00FF00u) >> 8u);
+		return float(bits) * 2.3283064365386963e-10f; // / 0x100000000
+	}
+
+	FVector2 Hammersley(uint32_t i, uint32_t N)
+	{
+		return FVector2(float(i) / float(N), RadicalInverse_VdC(i));
+	}
+
+	FVector2 GetVogelDiskSample(int sampleIndex, int sampleCount, float phi)
+	{
+		const float goldenAngle = 3.14159265359f * (3.0f - std::sqrt(5.0f));
+		float r = std::sqrt((sampleIndex + 0.5f) / sampleCount);
+		float theta = sampleIndex * goldenAngle + phi;
+		return FVector2(std::cos(theta) * r, std::sin(theta) * r);
+	}
+
+	float Smoothstep(float edge0, float edge1, float x)
+	{
+		float t = std::clamp((x - edge0) / (edge1 - edge0), 0.0f, 1.0f);
+		return t * t * (3.0f - 2.0f * t);
+	}
+
+	// Random numbers for skipping lights. They only depend on the texel and what is skipped, so the bake
+	// is the same for any thread count. These must match the ones in the shaders.
+	uint32_t HashUInt(uint32_t h)
+	{
+		h ^= h >> 16;
+		h *= 0x7feb352du;
+		h ^= h >> 15;
+		h *= 0x846ca68bu;
+		h ^= h >> 16;
+		return h;
+	}
+
+	float HashRandom(uint32_t seed, uint32_t index)
+	{
+		return float(HashUInt(seed ^ (index * 0x9e3779b9u)) >> 8) * (1.0f / 16777216.0f);
+	}
+
+	// Random number indexes for the light tree nodes and the light budget. The lights use their light list position.
+	const uint32_t LightNodeRandomIndex = 0x80000000u;
+	const uint32_t LightBudgetRandomIndex = 0x7fffffffu;
+	const uint32_t SampleRotationRandomIndex = 0x7ffffffeu;
+
+	// When denoising, every texel turns its hemisphere samples by a random angle around the normal. The low
+	// sample counts then give noise that the filter averages away instead of a pattern shared by the neighbours.
+	void RotateSampleFrame(FVector3& tangent, FVector3& bitangent, uint32_t seed)
+	{
+		float angle = HashRandom(seed, SampleRotationRandomIndex) * 6.28318530718f;
+		float c = std::cos(angle);
+		float s = std::sin(angle);
+		FVector3 t = tangent * c + bitangent * s;
+		bitangent = bitangent * c - tangent * s;
+		tangent = t;
+	}
+
+	// Attenuation of a light without its shadow, and the direction towards it
+	float GetLightAttenuation(const FVector3& origin, const FVector3& normal, const LevelMeshLight& light, float extraDistance, FVector3& dir)
+	{
+		const float minDistance = 0.01f;
+		float dist = (light.RelativeOrigin - origin).Length() + extraDistance;
+		if (dist <= minDistance || dist >= light.Radius)
+			return 0.0f;
+
+		dir = (light.RelativeOrigin - origin).Unit();
+
+		float distAttenuation = std::max(1.0f - (dist / light.Radius), 0.0f);
+		float angleAttenuation = std::max(normal | dir, 0.0f);
+		float spotAttenuation = 1.0f;
+		if (light.OuterAngleCos > -1.0f)
+		{
+			float cosDir = dir | light.SpotDir;
+			spotAttenuation = Smoothstep(light.OuterAngleCos, light.InnerAngleCos, cosDir);
+			spotAttenuation = std::max(spotAttenuation, 0.0f);
+		}
+		return distAttenuation * angleAttenuation * spotAttenuation;
+	}
+
+	// Upper bound for the unshadowed light that any of the lights in a light tree node can add to a point
+	float GetLightNodeBound(const LevelMeshLightNode& node, const FVector3& origin, const FVector3& normal, float extraDistance)
+	{
+		FVector3 center = (node.BoundsMin + node.BoundsMax) * 0.5f;
+		FVector3 extent = (node.BoundsMax - node.BoundsMin) * 0.5f;
+
+		// Are all of them behind the surface?
+		float planeDist = (normal | (center - origin)) + std::abs(normal.X) * extent.X + std::abs(normal.Y) * extent.Y + std::abs(normal.Z) * extent.Z;
+		if (planeDist <= 0.0f)
+			return 0.0f;
+
+		FVector3 delta;
+		delta.X = std::max(std::abs(origin.X - center.X) - extent.X, 0.0f);
+		delta.Y = std::max(std::abs(origin.Y - center.Y) - extent.Y, 0.0f);
+		delta.Z = std::max(std::abs(origin.Z - center.Z) - extent.Z, 0.0f);
+		float dist = delta.Length() + extraDistance;
+		if (dist >= node.MaxRadius)
+			return 0.0f;
+
+		return node.MaxPower * (1.0f - dist / node.MaxRadius);
+	}
+
+	// Index of sample i of a round in a Hammersley set of 1 << (roundBits + sizeBits) samples. Every round is a
+	// stratified subset of the set as the low bits of the index pick the Y strata and the high bits the X strata.
+	uint32_t GetRoundSampleIndex(uint32_t round, uint32_t i, uint32_t roundBits, uint32_t sizeBits)
+	{
+		uint32_t lowBits = sizeBits / 2;
+		uint32_t lowMask = (1u << lowBits) - 1;
+		return (i & lowMask) | (round << lowBits) | ((i >> lowBits) << (lowBits + roundBits));
+	}
+
+	// Running mean and variance of the samples taken for a texel
+	struct SampleVariance
+	{
+		SampleVariance(bool adaptive) : Adaptive(adaptive && lm_adaptive)
+		{
+		}
+
+		bool Adaptive;
+		int Count = 0;
+		float Sum = 0.0f;
+		float SumSquares = 0.0f;
+
+		void Add(float value)
+		{
+			Count++;
+			Sum += value;
+			SumSquares += value * value;
+		}
+
+		float Mean() const { return Sum / Count; }
+
+		bool IsConverged(float tolerance) const
+		{
+			if (!Adaptive || Count < 2)
+				return false;
+			float mean = Mean();
+			float variance = std::max(SumSquares / Count - mean * mean, 0.0f) * Count / (Count - 1);
+			return variance / Count <= tolerance * tolerance;
+		}
+	};
+
+	float Cross2D(const FVector2& a, const FVector2& b)
+	{
+		return a.X * b.Y - a.Y * b.X;
+	}
+
+	struct Color4
+	{
+		float R = 0.0f, G = 0.0f, B = 0.0f, A = 0.0f;
+
+		bool IsZero() const { return R == 0.0f && G == 0.0f && B == 0.0f && A == 0.0f; }
+
+		Color4& operator+=(const Color4& c) { R += c.R; G += c.G; B += c.B; A += c.A; return *this; }
+		Color4 operator*(float s) const { return { R * s, G * s, B * s, A * s }; }
+		Color4 operator+(const Color4& c) const { return { R + c.R, G + c.G, B + c.B, A + c.A }; }
+	};
+}
+
+CPURaytracer::CPURaytracer()
+{
+}
+
+CPURaytracer::~CPURaytracer()
+{
+}
+
+void CPURaytracer::Raytrace(DoomLevelMesh* levelMesh)
+{
+	mesh = levelMesh;
+	useSunLight = lm_sunlight && mesh->SunColor != FVector3(0.0f, 0.0f, 0.0f);
+
+	hasPortals = false;
+	for (int i = 0, count = mesh->GetSurfaceCount(); i < count; i++)
+	{
+		if (mesh->GetSurface(i)->PortalIndex != 0)
+		{
+			hasPortals = true;
+			break;
+		}
+	}
+
+	auto startTime = std::chrono::steady_clock::now();
+
+	printf("   Map uses %u lightmap textures\n", mesh->LMTextureCount);
+	printf("   CPU ray tracing with %d threads\n", Worker::GetThreadCount());
+
+	// Tiles that don't need an update keep what is in the texture already
+	unsigned int textureDataSize = mesh->LMTextureSize * mesh->LMTextureSize * mesh->LMTextureCount * 4;
+	if (mesh->LMTextureData.Size() != textureDataSize)
+	{
+		mesh->LMTextureData.Resize(textureDataSize);
+		memset(mesh->LMTextureData.Data(), 0, mesh->LMTextureData.Size() * sizeof(uint16_t));
+	}
+
+	TArray<LightmapTile*> tiles;
+	uint64_t totalPixels = 0;
+	for (unsigned int i = 0, count = mesh->LightmapTiles.Size(); i < count; i++)
+	{
+		LightmapTile* tile = &mesh->LightmapTiles[i];
+		if (tile->NeedsUpdate)
+		{
+			tiles.Push(tile);
+			totalPixels += tile->AtlasLocation.Area();
+		}
+	}
+
+	// In radiosity mode the first pass bakes the direct light and every pass after it gathers one more bounce from the texels of the pass before
+	gatherBounces = lm_bounce && lm_radiosity > 0;
+	int passCount = gatherBounces ? 1 + lm_radiosity : 1;
+	tileRadiance.clear();
+	if (gatherBounces)
+		tileRadiance.resize(mesh->LightmapTiles.Size());
+
+	// Bake the tiles in batches to keep the memory use down and to be able to report progress
+	uint64_t batchPixels = std::max(totalPixels / 50, (uint64_t)(64 * 64));
+	std::vector<TileBake> bakes;
+	std::vector<std::pair<int, int>> fragments;
+	uint64_t raysTraced = 0, raysSkipped = 0;
+	uint64_t lightsListed = 0, lightsTraced = 0;
+	int tilesMostlySkipped = 0, tilesPartlySkipped = 0;
+	for (int pass = 0; pass < passCount; pass++)
+	{
+		const char* passName = pass == 0 ? "Ray tracing tiles" : "Gathering bounce light";
+		unsigned int tileIndex = 0;
+		while (tileIndex < tiles.Size())
+		{
+			printf("   %s: %u / %u\r", passName, tileIndex, tiles.Size());
+
+			bakes.clear();
+			uint64_t pixels = 0;
+			while (tileIndex < tiles.Size() && pixels < batchPixels)
+			{
+				TileBake bake;
+				bake.Tile = tiles[tileIndex++];
+				pixels += bake.Tile->AtlasLocation.Area();
+				bakes.push_back(std::move(bake));
+			}
+
+			Worker::RunJob((int)bakes.size(), [&](int i) { RasterizeTile(bakes[i]); });
+
+			// Shade the fragments of all tiles in one go as some tiles have many more lights than others
+			fragments.clear();
+			for (size_t i = 0; i < bakes.size(); i++)
+			{
+				for (size_t j = 0; j < bakes[i].Fragments.size(); j++)
+					fragments.push_back({ (int)i, (int)j });
+			}
+
+			if (pass == 0)
+			{
+				Worker::RunJob((int)fragments.size(), [&](int i) { ShadeFragment(bakes[fragments[i].first].Tile, bakes[fragments[i].first].Fragments[fragments[i].second]); });
+
+				if (lm_adaptive)
+				{
+					Worker::RunJob((int)bakes.size(), [&](int i) { FindTexelsToRefine(bakes[i]); });
+
+					fragments.clear();
+					for (size_t i = 0; i < bakes.size(); i++)
+					{
+						for (size_t j = 0; j < bakes[i].Fragments.size(); j++)
+						{
+							if (!bakes[i].Fragments[j].Sampling.Adaptive)
+								fragments.push_back({ (int)i, (int)j });
+						}
+					}
+					Worker::RunJob((int)fragments.size(), [&](int i) { ShadeFragment(bakes[fragments[i].first].Tile, bakes[fragments[i].first].Fragments[fragments[i].second]); });
+				}
+
+				if (lm_denoise)
+					Worker::RunJob((int)bakes.size(), [&](int i) { DenoiseTile(bakes[i], false); });
+
+				Worker::RunJob((int)bakes.size(), [&](int i) { ResolveTile(bakes[i]); });
+			}
+			else
+			{
+				Worker::RunJob((int)fragments.size(), [&](int i) { GatherFragment(bakes[fragments[i].first].Tile, bakes[fragments[i].first].Fragments[fragments[i].second]); });
+
+				if (lm_denoise)
+					Worker::RunJob((int)bakes.size(), [&](int i) { DenoiseTile(bakes[i], true); });
+
+				Worker::RunJob((int)bakes.size(), [&](int i) { ResolveBounce(bakes[i]); });
+			}
+
+			for (const TileBake& bake : bakes)
+			{
+				uint64_t tileTraced = 0, tileSkipped = 0;
+				for (const TileFragment& fragment : bake.Fragments)
+				{
+					tileTraced += fragment.Sampling.RaysTraced;
+					tileSkipped += fragment.Sampling.RaysSkipped;
+					lightsListed += fragment.Sampling.LightsListed;
+					lightsTraced += fragment.Sampling.LightsTraced;
+				}
+				raysTraced += tileTraced;
+				raysSkipped += tileSkipped;
+
+				if (pass == 0)
+				{
+					uint64_t tileRays = tileTraced + tileSkipped;
+					if (tileSkipped * 4 >= tileRays * 3)
+						tilesMostlySkipped++;
+					else if (tileSkipped * 4 >= tileRays)
+						tilesPartlySkipped++;
+				}
+			}
+		}
+
+		printf("   %s: %u / %u\n", passName, tiles.Size(), tiles.Size());
+
+		if (pass != 0)
+		{
+			for (LightmapTile* tile : tiles)
+			{
+				TileRadiance& radiance = tileRadiance[tile - mesh->LightmapTiles.Data()];
+				std::swap(radiance.Bounce, radiance.NextBounce);
+			}
+		}
+	}
+
+	if (gatherBounces)
+	{
+		Worker::RunJob((int)tiles.Size(), [&](int i) { AddBounceToLightmap((int)(tiles[i] - mesh->LightmapTiles.Data())); });
+		tileRadiance.clear();
+	}
+
+	for (LightmapTile* tile : tiles)
+		tile->NeedsUpdate = false;
+
+	if (lm_adaptive)
+	{
+		uint64_t rayCount = raysTraced + raysSkipped;
+		printf("   Adaptive sampling saved %llu of %llu rays (%.1f%%), %.0f rays per tile\n", (unsigned long long)raysSkipped, (unsigned long long)rayCount, rayCount ? raysSkipped * 100.0 / rayCount : 0.0, tiles.Size() ? (double)raysSkipped / tiles.Size() : 0.0);
+		printf("   Tiles saving at least 75%% of their rays: %d, 25%% to 75%%: %d, less: %d\n", tilesMostlySkipped, tilesPartlySkipped, (int)tiles.Size() - tilesMostlySkipped - tilesPartlySkipped);
+	}
+
+	printf("   Shadows traced for %llu of %llu listed lights (%.1f%%), light cutoff %g, light budget %d\n", (unsigned long long)lightsTraced, (unsigned long long)lightsListed, lightsListed ? lightsTraced * 100.0 / lightsListed : 0.0, lm_lightcutoff, lm_lightbudget);
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+	printf("   CPU ray tracing time was %.3f seconds.\n", seconds);
+	printf("   Ray trace complete\n");
+}
+
+void CPURaytracer::RasterizeTile(TileBake& bake)
+{
+	LightmapTile* tile = bake.Tile;
+	bake.SampleOwners.assign(tile->AtlasLocation.Width * tile->AtlasLocation.Height * 4, -1);
+
+	for (int surfaceIndex : tile->Surfaces)
+	{
+		LevelMeshSurface* surface = mesh->GetSurface(surfaceIndex);
+		const uint32_t* elements = mesh->Mesh.Indexes.Data() + surface->MeshLocation.StartElementIndex;
+		for (unsigned int i = 0; i + 2 < surface->MeshLocation.NumElements; i += 3)
+		{
+			FVector3 world[3];
+			FVector2 pos[3];
+			for (int j = 0; j < 3; j++)
+			{
+				world[j] = mesh->Mesh.Vertices[elements[i + j]].fPos();
+				FVector3 localPos = world[j] - tile->Transform.TranslateWorldToLocal;
+				pos[j] = FVector2(localPos | tile->Transform.ProjLocalToU, localPos | tile->Transform.ProjLocalToV);
+			}
+			RasterizeTriangle(bake, surfaceIndex, world, pos);
+		}
+	}
+
+	// Drop the fragments that later triangles completely covered up
+	std::vector<int> remap(bake.Fragments.size(), -1);
+	for (int owner : bake.SampleOwners)
+	{
+		if (owner != -1)
+			remap[owner] = 0;
+	}
+	int alive = 0;
+	for (size_t i = 0; i < bake.Fragments.size(); i++)
+	{
+		if (remap[i] != -1)
+		{
+			remap[i] = alive;
+			bake.Fragments[alive++] = bake.Fragments[i];
+		}
+	}
+	bake.Fragments.resize(alive);
+	for (int& owner : bake.SampleOwners)
+	{
+		if (owner != -1)
+			owner = remap[owner];
+	}
+}
+
+void CPURaytracer::RasterizeTriangle(TileBake& bake, int surfaceIndex, const FVector3* world, const FVector2* pos)
+{
+	int width = bake.Tile->AtlasLocation.Width;
+	int height = bake.Tile->AtlasLocation.Height;
+
+	// Both windings are drawn as the raytrace pipeline has culling disabled
+	int v0 = 0, v1 = 1, v2 = 2;
+	float area = Cross2D(pos[1] - pos[0], pos[2] - pos[0]);
+	if (area < 0.0f)
+	{
+		std::swap(v1, v2);
+		area = -area;
+	}
+	if (!(area > 0.0f))
+		return;
+
+	const int vertexIndexes[3] = { v0, v1, v2 };
+	FVector2 edgeStart[3], edgeDir[3];
+	bool edgeInclusive[3];
+	for (int i = 0; i < 3; i++)
+	{
+		edgeStart[i] = pos[vertexIndexes[i]];
+		edgeDir[i] = pos[vertexIndexes[(i + 1) % 3]] - edgeStart[i];
+
+		// Fill convention: a sample exactly on an edge shared by two triangles belongs to only one of them
+		edgeInclusive[i] = edgeDir[i].Y > 0.0f || (edgeDir[i].Y == 0.0f && edgeDir[i].X < 0.0f);
+	}
+
+	float minX = std::min({ pos[0].X, pos[1].X, pos[2].X });
+	float maxX = std::max({ pos[0].X, pos[1].X, pos[2].X });
+	float minY = std::min({ pos[0].Y, pos[1].Y, pos[2].Y });
+	float maxY = std::max({ pos[0].Y, pos[1].Y, pos[2].Y });
+	int x0 = std::max((int)std::floor(minX), 0);
+	int x1 = std::min((int)std::ceil(maxX), width);
+	int y0 = std::max((int)std::floor(minY), 0);
+	int y1 = std::min((int)std::ceil(maxY), height);
+
+	for (int y = y0; y < y1; y++)
+	{
+		for (int x = x0; x < x1; x++)
+		{
+			int mask = 0;
+			for (int s = 0; s < 4; s++)
+			{
+				FVector2 p(x + SampleLocations[s][0], y + SampleLocations[s][1]);
+				bool inside = true;
+				for (int i = 0; i < 3 && inside; i++)
+				{
+					float e = Cross2D(edgeDir[i], p - edgeStart[i]);
+					inside = e > 0.0f || (e == 0.0f && edgeInclusive[i]);
+				}
+				if (inside)
+					mask |= 1 << s;
+			}
+			if (mask == 0)
+				continue;
+
+			// Centroid interpolation: use the pixel center if it is covered, otherwise a covered sample
+			FVector2 p(x + 0.5f, y + 0.5f);
+			if (mask != 0xf)
+			{
+				int s = 0;
+				while ((mask & (1 << s)) == 0)
+					s++;
+				p = FVector2(x + SampleLocations[s][0], y + SampleLocations[s][1]);
+			}
+
+			float w1 = Cross2D(edgeDir[2], p - edgeStart[2]) / area; // Opposite of vertex v1
+			float w2 = Cross2D(edgeDir[0], p - edgeStart[0]) / area; // Opposite of vertex v2
+			float w0 = 1.0f - w1 - w2;
+
+			TileFragment fragment;
+			fragment.SurfaceIndex = surfaceIndex;
+			fragment.X = x;
+			fragment.Y = y;
+			fragment.Position = world[v0] * w0 + world[v1] * w1 + world[v2] * w2;
+			fragment.Color = FVector3(0.0f, 0.0f, 0.0f);
+
+			int fragmentIndex = (int)bake.Fragments.size();
+			bake.Fragments.push_back(fragment);
+
+			int* owners = &bake.SampleOwners[(x + y * width) * 4];
+			for (int s = 0; s < 4; s++)
+			{
+				if (mask & (1 << s))
+					owners[s] = fragmentIndex;
+			}
+		}
+	}
+}
+
+void CPURaytracer::ShadeFragment(const LightmapTile* tile, TileFragment& fragment)
+{
+	LevelMeshSurface* surface = mesh->GetSurface(fragment.SurfaceIndex);
+
+	// The shaders seed the soft shadow disk rotation with gl_FragCoord
+	float fragX = tile->AtlasLocation.X + fragment.X + 0.5f;
+	float fragY = tile->AtlasLocation.Y + fragment.Y + 0.5f;
+	float phi = fragX + fragY * 13.37f;
+
+	FVector3 normal = surface->Plane.XYZ();
+	FVector3 origin = fragment.Position;
+
+	uint32_t seed = HashUInt((uint32_t)(tile->AtlasLocation.X + fragment.X) | ((uint32_t)(tile->AtlasLocation.Y + fragment.Y) << 16));
+
+	// Texels traced again take every sample, so what the first pass saved is lost. The light counts describe
+	// a single shading of the texel and start over as well.
+	TexelSampling& sampling = fragment.Sampling;
+	if (!sampling.Adaptive)
+	{
+		sampling.RaysSkipped = 0;
+		sampling.LightsListed = 0;
+		sampling.LightsTraced = 0;
+	}
+
+	FVector3 incoming(0.0f, 0.0f, 0.0f);
+	if (useSunLight)
+		incoming += TraceSunLight(origin, normal, phi, sampling);
+
+	incoming += TraceLights(origin, normal, surface, 0.0f, phi, seed, sampling);
+
+	fragment.Bounce = FVector3(0.0f, 0.0f, 0.0f);
+	if (lm_bounce && !gatherBounces)
+	{
+		fragment.Bounce = TraceBounceLight(origin, normal, phi, seed, sampling);
+		incoming += fragment.Bounce;
+	}
+
+	fragment.Incoming = incoming;
+	fragment.Occlusion = lm_ao ? TraceAmbientOcclusion(origin, normal, seed, sampling) : 1.0f;
+	fragment.Color = incoming * fragment.Occlusion;
+}
+
+void CPURaytracer::GatherFragment(const LightmapTile* tile, TileFragment& fragment)
+{
+	LevelMeshSurface* surface = mesh->GetSurface(fragment.SurfaceIndex);
+	float fragX = tile->AtlasLocation.X + fragment.X + 0.5f;
+	float fragY = tile->AtlasLocation.Y + fragment.Y + 0.5f;
+	float phi = fragX + fragY * 13.37f;
+	uint32_t seed = HashUInt((uint32_t)(tile->AtlasLocation.X + fragment.X) | ((uint32_t)(tile->AtlasLocation.Y + fragment.Y) << 16));
+
+	fragment.Color = TraceBounceLight(fragment.Position, surface->Plane.XYZ(), phi, seed, fragment.Sampling);
+}
+
+void CPURaytracer::FindTexelsToRefine(TileBake& bake)
+{
+	// Adaptive sampling only looks at the samples of one texel. If they all agreed the texel may still
+	// have missed a shadow edge, which shows up as a difference to the neighbours on the same surface.
+
+	int width = bake.Tile->AtlasLocation.Width;
+	int height = bake.Tile->AtlasLocation.Height;
+	const int neighbours[4][2] = { { -1, 0 }, { 1, 0 }, { 0, -1 }, { 0, 1 } };
+
+	for (TileFragment& fragment : bake.Fragments)
+	{
+		if (fragment.Sampling.RaysSkipped == 0)
+			continue;
+
+		float brightness = fragment.Color.X + fragment.Color.Y + fragment.Color.Z;
+		for (int i = 0; i < 4 && fragment.Sampling.Adaptive; i++)
+		{
+			int x = fragment.X + neighbours[i][0];
+			int y = fragment.Y + neighbours[i][1];
+			if (x < 0 || y < 0 || x >= width || y >= height)
+				continue;
+
+			const int* owners = &bake.SampleOwners[(x + y * width) * 4];
+			for (int s = 0; s < 4; s++)
+			{
+				if (owners[s] == -1)
+					continue;
+
+				const TileFragment& neighbour = bake.Fragments[owners[s]];
+				if (neighbour.SurfaceIndex != fragment.SurfaceIndex)
+					continue;
+
+				float neighbourBrightness = neighbour.Color.X + neighbour.Color.Y + neighbour.Color.Z;
+				if (std::abs(brightness - neighbourBrightness) > NeighbourTolerance * std::max({ brightness, neighbourBrightness, NeighbourMinBrightness }))
+				{
+					fragment.Sampling.Adaptive = false;
+					break;
+				}
+			}
+		}
+	}
+}
+
+void CPURaytracer::DenoiseTile(TileBake& bake, bool gathered)
+{
+	// Only the ambient occlusion and the bounce light are filtered. They are the ones traced with many random
+	// rays and they change slowly over a surface. The direct light keeps its shadow edges as they were traced.
+	// The fragments of the bounce passes hold nothing but gathered bounce light in their color.
+
+	bool filterAO = lm_ao && !gathered;
+	bool filterBounce = gathered || (lm_bounce && !gatherBounces);
+	if (!filterAO && !filterBounce)
+		return;
+
+	LightmapTile* tile = bake.Tile;
+	int width = tile->AtlasLocation.Width;
+	int height = tile->AtlasLocation.Height;
+	float texelSize = std::max((float)tile->SampleDimension, 1.0f);
+	size_t count = bake.Fragments.size();
+
+	std::vector<float> occlusion(count), nextOcclusion(count);
+	std::vector<FVector3> bounce(count), nextBounce(count);
+	for (size_t i = 0; i < count; i++)
+	{
+		const TileFragment& fragment = bake.Fragments[i];
+		occlusion[i] = fragment.Occlusion;
+		bounce[i] = gathered ? fragment.Color : fragment.Bounce;
+	}
+
+	for (int iteration = 0; iteration < DenoiseIterations; iteration++)
+	{
+		int step = 1 << iteration;
+		for (size_t i = 0; i < count; i++)
+		{
+			const TileFragment& fragment = bake.Fragments[i];
+			const FVector4& plane = mesh->GetSurface(fragment.SurfaceIndex)->Plane;
+			FVector3 normal = plane.XYZ();
+			float planeDist = normal | fragment.Position;
+
+			// Standard error of the ambient occlusion estimate, with a floor so that fully open or closed texels still blend
+			float ao = occlusion[i];
+			float aoSigma = DenoiseAOSigmas * std::sqrt(std::max(ao * (1.0f - ao), 0.01f) / lm_aosamples);
+			float aoFalloff = -1.0f / (2.0f * aoSigma * aoSigma);
+
+			// Edge-stopped average of the fragments in the texel at an offset, and how much of the texel they cover
+			auto sampleTexel = [&](int dx, int dy, float& occlusionValue, FVector3& bounceValue) -> float
+			{
+				// The bake image ends at the tile. Its padding belongs to no surface and is never read from.
+				int x = fragment.X + dx * step;
+				int y = fragment.Y + dy * step;
+				if (x < 0 || y < 0 || x >= width || y >= height)
+					return 0.0f;
+
+				float texelWeight = 0.0f;
+				occlusionValue = 0.0f;
+				bounceValue = FVector3(0.0f, 0.0f, 0.0f);
+				const int* owners = &bake.SampleOwners[(x + y * width) * 4];
+				for (int s = 0; s < 4; s++)
+				{
+					// Most texels are covered by one fragment
+					int j = owners[s];
+					int coverage = 1;
+					while (s < 3 && owners[s + 1] == j)
+					{
+						coverage++;
+						s++;
+					}
+					if (j == -1)
+						continue;
+
+					// Fragments of the same surface are always on the same plane. Others must face the same way and lie
+					// on the plane as well, or the filter would carry light around corners and across height changes.
+					const TileFragment& neighbour = bake.Fragments[j];
+					float weight = coverage * 0.25f;
+					if (neighbour.SurfaceIndex != fragment.SurfaceIndex)
+					{
+						FVector3 neighbourNormal = mesh->GetSurface(neighbour.SurfaceIndex)->Plane.XYZ();
+						weight *= std::pow(std::max(normal | neighbourNormal, 0.0f), DenoiseNormalPower);
+						weight *= std::exp(-std::abs((normal | neighbour.Position) - planeDist) / (step * texelSize));
+					}
+
+					float diff = occlusion[j] - ao;
+					if (filterAO && diff != 0.0f)
+						weight *= std::exp(diff * diff * aoFalloff);
+
+					texelWeight += weight;
+					occlusionValue += occlusion[j] * weight;
+					bounceValue += bounce[j] * weight;
+				}
+
+				// Texels that are all but cut off by the edge stops count as not there
+				if (texelWeight < 1e-6f)
+					return 0.0f;
+
+				occlusionValue /= texelWeight;
+				bounceValue /= texelWeight;
+				return texelWeight;
+			};
+
+			// The fragment itself is always part of its texel, so the weight is never zero
+			float centerOcclusion;
+			FVector3 centerBounce;
+			float totalWeight = sampleTexel(0, 0, centerOcclusion, centerBounce) * DenoiseKernel[1] * DenoiseKernel[1];
+			float sumOcclusion = centerOcclusion * totalWeight;
+			FVector3 sumBounce = centerBounce * totalWeight;
+
+			// Texels are used in mirrored pairs with the weight of the weaker one. A gradient then stays where it is at
+			// the tile edges and next to other surfaces, instead of the light from one side bleeding over.
+			for (int dy = 0; dy <= 1; dy++)
+			{
+				for (int dx = -1; dx <= 1; dx++)
+				{
+					if (dy == 0 && dx <= 0)
+						continue;
+
+					float occlusion0, occlusion1;
+					FVector3 bounce0, bounce1;
+					float weight = std::min(sampleTexel(dx, dy, occlusion0, bounce0), sampleTexel(-dx, -dy, occlusion1, bounce1));
+					if (weight <= 0.0f)
+						continue;
+
+					weight *= DenoiseKernel[dx + 1] * DenoiseKernel[dy + 1];
+					totalWeight += weight * 2.0f;
+					sumOcclusion += (occlusion0 + occlusion1) * weight;
+					sumBounce += (bounce0 + bounce1) * weight;
+				}
+			}
+
+			nextOcclusion[i] = sumOcclusion / totalWeight;
+			nextBounce[i] = sumBounce / totalWeight;
+		}
+		if (filterAO)
+			occlusion.swap(nextOcclusion);
+		if (filterBounce)
+			bounce.swap(nextBounce);
+	}
+
+	for (size_t i = 0; i < count; i++)
+	{
+		TileFragment& fragment = bake.Fragments[i];
+		if (gathered)
+		{
+			fragment.Color = bounce[i];
+		}
+		else
+		{
+			fragment.Incoming = fragment.Incoming - fragment.Bounce + bounce[i];
+			fragment.Bounce = bounce[i];
+			fragment.Occlusion = occlusion[i];
+			fragment.Color = fragment.Incoming * fragment.Occlusion;
+		}
+	}
+}
+
+void CPURaytracer::ResolveTile(TileBake& bake)
+{
+	std::vector<FVector4> texels;
+	ResolveTexels(bake, [](const TileFragment& fragment) { return fragment.Color; }, texels);
+
+	if (gatherBounces)
+	{
+		// Keep what the bounce passes gather from. The bounce light is added to the lightmap after the last pass.
+		TileRadiance& radiance = tileRadiance[bake.Tile - mesh->LightmapTiles.Data()];
+		ResolveTexels(bake, [](const TileFragment& fragment) { return fragment.Incoming; }, radiance.Direct);
+
+		std::vector<FVector4> occlusion;
+		ResolveTexels(bake, [](const TileFragment& fragment) { return FVector3(fragment.Occlusion, fragment.Occlusion, fragment.Occlusion); }, occlusion);
+		radiance.Occlusion.resize(occlusion.size());
+		for (size_t i = 0; i < occlusion.size(); i++)
+			radiance.Occlusion[i] = occlusion[i].X;
+
+		radiance.Bounce.assign(texels.size(), FVector3(0.0f, 0.0f, 0.0f));
+	}
+
+	LightmapTile* tile = bake.Tile;
+	int textureSize = mesh->LMTextureSize;
+	uint16_t* dest = mesh->LMTextureData.Data() + (size_t)tile->AtlasLocation.ArrayIndex * textureSize * textureSize * 4;
+	for (int y = 0; y < tile->AtlasLocation.Height; y++)
+	{
+		uint16_t* line = dest + ((size_t)(tile->AtlasLocation.Y + y) * textureSize + tile->AtlasLocation.X) * 4;
+		floatToHalf(&texels[y * tile->AtlasLocation.Width].X, line, tile->AtlasLocation.Width * 4);
+	}
+}
+
+void CPURaytracer::ResolveBounce(TileBake& bake)
+{
+	std::vector<FVector4> texels;
+	ResolveTexels(bake, [](const TileFragment& fragment) { return fragment.Color; }, texels);
+
+	TileRadiance& radiance = tileRadiance[bake.Tile - mesh->LightmapTiles.Data()];
+	radiance.NextBounce.resize(texels.size());
+	for (size_t i = 0; i < texels.size(); i++)
+		radiance.NextBounce[i] = texels[i].XYZ();
+}
+
+void CPURaytracer::AddBounceToLightmap(int tileIndex)
+{
+	const LightmapTile& tile = mesh->LightmapTiles[tileIndex];
+	const TileRadiance& radiance = tileRadiance[tileIndex];
+	int textureSize = mesh->LMTextureSize;
+	uint16_t* dest = mesh->LMTextureData.Data() + (size_t)tile.AtlasLocation.ArrayIndex * textureSize * textureSize * 4;
+	std::vector<FVector4> texels(tile.AtlasLocation.Width);
+	for (int y = 0; y < tile.AtlasLocation.Height; y++)
+	{
+		uint16_t* line = dest + ((size_t)(tile.AtlasLocation.Y + y) * textureSize + tile.AtlasLocation.X) * 4;
+		halfToFloat(line, &texels[0].X, texels.size() * 4);
+		for (int x = 0; x < tile.AtlasLocation.Width; x++)
+		{
+			int i = x + y * tile.AtlasLocation.Width;
+			FVector3 bounce = radiance.Bounce[i] * radiance.Occlusion[i];
+			texels[x].X += bounce.X;
+			texels[x].Y += bounce.Y;
+			texels[x].Z += bounce.Z;
+		}
+		floatToHalf(&texels[0].X, line, texels.size() * 4);
+	}
+}
+
+void CPURaytracer::ResolveTexels(const TileBake& bake, const std::function<FVector3(const TileFragment&)>& value, std::vector<FVector4>& texels)
+{
+	LightmapTile* tile = bake.Tile;
+	int width = tile->AtlasLocation.Width;
+	int height = tile->AtlasLocation.Height;
+
+	// Average of the covered samples in a texel. Everything outside the tile is the empty padding of the bake image.
+	auto samplePixel = [&](int x, int y) -> Color4
+	{
+		Color4 c;
+		if (x < 0 || y < 0 || x >= width || y >= height)
+			return c;
+		const int* owners = &bake.SampleOwners[(x + y * width) * 4];
+		for (int s = 0; s < 4; s++)
+		{
+			if (owners[s] != -1)
+			{
+				FVector3 color = value(bake.Fragments[owners[s]]);
+				c += Color4{ color.X, color.Y, color.Z, 1.0f };
+			}
+		}
+		if (c.A > 0.0f)
+			c = c * (1.0f / c.A);
+		return c;
+	};
+
+	// Resolve one texel beyond the tile on each side as the blur reads from there
+	int rwidth = width + 2;
+	int rheight = height + 2;
+	std::vector<Color4> resolved(rwidth * rheight);
+	for (int y = -1; y <= height; y++)
+	{
+		for (int x = -1; x <= width; x++)
+		{
+			Color4 c = samplePixel(x, y);
+			if (c.A == 0.0f)
+			{
+				// Fill texels without coverage with their neighbours to avoid seams when the lightmap is sampled
+				for (int yy = -1; yy <= 1; yy++)
+				{
+					for (int xx = -1; xx <= 1; xx++)
+					{
+						if (xx != 0 || yy != 0)
+							c += samplePixel(x + xx, y + yy);
+					}
+				}
+				if (c.A > 0.0f)
+					c = c * (1.0f / c.A);
+			}
+			resolved[(x + 1) + (y + 1) * rwidth] = c;
+		}
+	}
+
+	std::vector<Color4> blurred;
+	auto output = [&](int x, int y) -> const Color4& { return resolved[(x + 1) + (y + 1) * rwidth]; };
+	if (lm_blur)
+	{
+		auto clampedSample = [](const Color4& f, const Color4& center) -> Color4 { return !f.IsZero() ? f : center; };
+
+		std::vector<Color4> horizontal(width * rheight);
+		for (int y = -1; y <= height; y++)
+		{
+			for (int x = 0; x < width; x++)
+			{
+				const Color4& center = resolved[(x + 1) + (y + 1) * rwidth];
+				horizontal[x + (y + 1) * width] =
+					center * 0.5f +
+					clampedSample(resolved[(x + 2) + (y + 1) * rwidth], center) * 0.25f +
+					clampedSample(resolved[x + (y + 1) * rwidth], center) * 0.25f;
+			}
+		}
+
+		blurred.resize(width * height);
+		for (int y = 0; y < height; y++)
+		{
+			for (int x = 0; x < width; x++)
+			{
+				const Color4& center = horizontal[x + (y + 1) * width];
+				blurred[x + y * width] =
+					center * 0.5f +
+					clampedSample(horizontal[x + (y + 2) * width], center) * 0.25f +
+					clampedSample(horizontal[x + y * width], center) * 0.25f;
+			}
+		}
+	}
+
+	texels.resize(width * height);
+	for (int y = 0; y < height; y++)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			const Color4& c = lm_blur ? blurred[x + y * width] : output(x, y);
+			texels[x + y * width] = FVector4(c.R, c.G, c.B, c.A);
+		}
+	}
+}
+
+FVector3 CPURaytracer::TraceSunLight(const FVector3& origin, const FVector3& normal, float phi, TexelSampling& sampling)
+{
+	const FVector3& sunDir = mesh->SunDirection;
+
+	float angleAttenuation = std::max(normal | sunDir, 0.0f);
+	if (angleAttenuation == 0.0f)
+		return FVector3(0.0f, 0.0f, 0.0f);
+
+	const float minDistance = 0.01f;
+	const float dist = 65536.0f;
+
+	FVector3 rayColor = mesh->SunColor;
+
+	FVector3 incoming(0.0f, 0.0f, 0.0f);
+	if (lm_softshadows)
+	{
+		FVector3 target = origin + sunDir * dist;
+		FVector3 v = (std::abs(sunDir.X) > std::abs(sunDir.Y)) ? FVector3(0.0f, 1.0f, 0.0f) : FVector3(1.0f, 0.0f, 0.0f);
+		FVector3 xdir = (sunDir ^ v).Unit();
+		FVector3 ydir = sunDir ^ xdir;
+
+		const float lightsize = 100.0f;
+		const int sampleCount = lm_softshadowsamples;
+		FVector3 dirs[MaxSoftShadowSampleCount];
+		for (int i = 0; i < sampleCount; i++)
+		{
+			FVector2 gridoffset = GetVogelDiskSample(GetSoftShadowSampleIndex(i, sampleCount), sampleCount, phi) * lightsize;
+			FVector3 pos = target + xdir * gridoffset.X + ydir * gridoffset.Y;
+			dirs[i] = (pos - origin).Unit();
+		}
+
+		float rayLight = rayColor.X + rayColor.Y + rayColor.Z;
+		float lightScale = rayLight != 0.0f ? 1.0f / rayLight : 0.0f;
+		SampleVariance variance(sampling.Adaptive);
+		for (int first = 0; first < sampleCount && !variance.IsConverged(SoftShadowTolerance); first = variance.Count)
+		{
+			int count = first == 0 ? SoftShadowFirstRound : sampleCount - first;
+			TraceResult results[MaxSoftShadowSampleCount];
+			TraceFirstHit(origin, minDistance, dirs + first, dist, results, count);
+			for (int i = 0; i < count; i++)
+			{
+				FVector3 color = TraceSunRay(origin, minDistance, dirs[first + i], dist, rayColor, &results[i]);
+				variance.Add((color.X + color.Y + color.Z) * lightScale);
+				incoming += color;
+			}
+		}
+		incoming /= (float)variance.Count;
+		sampling.RaysTraced += variance.Count;
+		sampling.RaysSkipped += sampleCount - variance.Count;
+	}
+	else
+	{
+		incoming = TraceSunRay(origin, minDistance, sunDir, dist, rayColor);
+		sampling.RaysTraced++;
+	}
+
+	return incoming * angleAttenuation;
+}
+
+FVector3 CPURaytracer::TraceSunRay(FVector3 origin, float tmin, FVector3 dir, float tmax, FVector3 rayColor, const TraceResult* firstHit)
+{
+	for (int i = 0; i < 3; i++)
+	{
+		TraceResult result = (i == 0 && firstHit) ? *firstHit : TraceFirstHit(origin, tmin, dir, tmax);
+
+		// Stop if we hit nothing. We have to hit a sky surface to hit the sky.
+		if (result.primitiveIndex == -1)
+			return FVector3(0.0f, 0.0f, 0.0f);
+
+		LevelMeshSurface* surface = GetSurface(result.primitiveIndex);
+
+		// Stop if we hit the sky.
+		if (surface->IsSky)
+			return rayColor;
+
+		// Pass through surface texture
+		rayColor = PassRayThroughSurface(surface, GetSurfaceUV(result.primitiveIndex, result.primitiveWeights), rayColor);
+
+		// Stop if there is no light left
+		if (rayColor.X + rayColor.Y + rayColor.Z <= 0.0f)
+			return FVector3(0.0f, 0.0f, 0.0f);
+
+		// Move to surface hit point
+		origin += dir * result.t;
+		tmax -= result.t;
+		if (tmax <= tmin)
+			return FVector3(0.0f, 0.0f, 0.0f);
+
+		// Move through the portal, if any
+		TransformRay(surface->PortalIndex, origin, dir);
+	}
+	return FVector3(0.0f, 0.0f, 0.0f);
+}
+
+FVector3 CPURaytracer::TraceLights(const FVector3& origin, const FVector3& normal, const LevelMeshSurface* surface, float extraDistance, float phi, uint32_t seed, TexelSampling& sampling)
+{
+	sampling.LightsListed += surface->LightList.Count;
+	if (surface->LightList.NodeCount == 0)
+		return FVector3(0.0f, 0.0f, 0.0f);
+
+	thread_local std::vector<LightCandidate> candidates;
+	candidates.clear();
+	GatherLights(origin, normal, surface, extraDistance, surface->LightList.NodePos, 1.0f, seed, candidates);
+
+	FVector3 incoming(0.0f, 0.0f, 0.0f);
+	if (lm_lightbudget <= 0 || candidates.size() <= (size_t)lm_lightbudget)
+	{
+		for (const LightCandidate& candidate : candidates)
+			incoming += TraceLight(origin, normal, mesh->Mesh.Lights[candidate.LightIndex], extraDistance, phi, sampling) * candidate.Scale;
+	}
+	else
+	{
+		// Pick the budget with systematic sampling in proportion to the unshadowed light. A light picked
+		// n times stands in for n / (budget * probability) of itself.
+		float total = 0.0f;
+		for (const LightCandidate& candidate : candidates)
+			total += candidate.Value;
+
+		float step = total / lm_lightbudget;
+		float next = HashRandom(seed, LightBudgetRandomIndex) * step;
+		float sum = 0.0f;
+		int picked = 0;
+		for (const LightCandidate& candidate : candidates)
+		{
+			sum += candidate.Value;
+			int picks = 0;
+			while (next < sum && picked < lm_lightbudget)
+			{
+				next += step;
+				picks++;
+				picked++;
+			}
+			if (picks > 0)
+				incoming += TraceLight(origin, normal, mesh->Mesh.Lights[candidate.LightIndex], extraDistance, phi, sampling) * (candidate.Scale * picks * step / candidate.Value);
+		}
+	}
+	return incoming;
+}
+
+void CPURaytracer::GatherLights(const FVector3& origin, const FVector3& normal, const LevelMeshSurface* surface, float extraDistance, int nodeIndex, float scale, uint32_t seed, std::vector<LightCandidate>& candidates)
+{
+	const LevelMeshLightNode& node = mesh->Mesh.LightNodes[nodeIndex];
+	float bound = GetLightNodeBound(node, origin, normal, extraDistance) * scale;
+	if (bound <= 0.0f)
+		return;
+
+	// Russian roulette: a subtree that can't add more than the cutoff is kept with a probability in
+	// proportion to its bound, and what survives is scaled up to make up for the subtrees skipped.
+	// The random numbers go by the position within the surface so that other surfaces can't change them.
+	if (bound < lm_lightcutoff)
+	{
+		if (HashRandom(seed, LightNodeRandomIndex + nodeIndex - surface->LightList.NodePos) * lm_lightcutoff >= bound)
+			return;
+		scale *= lm_lightcutoff / bound;
+	}
+
+	if (node.Skip != nodeIndex + 1)
+	{
+		GatherLights(origin, normal, surface, extraDistance, nodeIndex + 1, scale, seed, candidates);
+		GatherLights(origin, normal, surface, extraDistance, mesh->Mesh.LightNodes[nodeIndex + 1].Skip, scale, seed, candidates);
+		return;
+	}
+
+	for (int j = node.LightStart, end = node.LightStart + node.LightCount; j < end; j++)
+	{
+		int lightIndex = mesh->Mesh.LightIndexes[j];
+		const LevelMeshLight& light = mesh->Mesh.Lights[lightIndex];
+
+		FVector3 dir;
+		float value = GetLightAttenuation(origin, normal, light, extraDistance, dir) * std::abs(light.Intensity) * (light.Color.X + light.Color.Y + light.Color.Z) * scale;
+		if (value <= 0.0f)
+			continue;
+
+		// Same roulette for the lights themselves
+		float lightScale = scale;
+		if (value < lm_lightcutoff)
+		{
+			if (HashRandom(seed, j - surface->LightList.Pos) * lm_lightcutoff >= value)
+				continue;
+			lightScale *= lm_lightcutoff / value;
+			value = lm_lightcutoff;
+		}
+		candidates.push_back({ lightIndex, value, lightScale });
+	}
+}
+
+FVector3 CPURaytracer::TraceLight(const FVector3& origin, const FVector3& normal, const LevelMeshLight& light, float extraDistance, float phi, TexelSampling& sampling)
+{
+	const float minDistance = 0.01f;
+	FVector3 incoming(0.0f, 0.0f, 0.0f);
+	FVector3 dir;
+	float attenuation = GetLightAttenuation(origin, normal, light, extraDistance, dir);
+	if (attenuation > 0.0f)
+	{
+		FVector3 rayColor = light.Color * (attenuation * light.Intensity);
+		sampling.LightsTraced++;
+
+		if (lm_softshadows && light.SoftShadowRadius != 0.0f)
+		{
+			FVector3 v = (std::abs(dir.X) > std::abs(dir.Y)) ? FVector3(0.0f, 1.0f, 0.0f) : FVector3(1.0f, 0.0f, 0.0f);
+			FVector3 xdir = (dir ^ v).Unit();
+			FVector3 ydir = dir ^ xdir;
+
+			float lightsize = light.SoftShadowRadius;
+			const int sampleCount = lm_softshadowsamples;
+			OcclusionRay shadowRays[MaxSoftShadowSampleCount];
+			for (int i = 0; i < sampleCount; i++)
+			{
+				FVector2 gridoffset = GetVogelDiskSample(GetSoftShadowSampleIndex(i, sampleCount), sampleCount, phi) * lightsize;
+				shadowRays[i].Origin = origin;
+				shadowRays[i].Target = light.Origin + xdir * gridoffset.X + ydir * gridoffset.Y;
+				shadowRays[i].TMin = minDistance;
+				shadowRays[i].Color = rayColor;
+			}
+
+			float rayLight = rayColor.X + rayColor.Y + rayColor.Z;
+			float lightScale = rayLight != 0.0f ? 1.0f / rayLight : 0.0f;
+			SampleVariance variance(sampling.Adaptive);
+			for (int first = 0; first < sampleCount && !variance.IsConverged(SoftShadowTolerance); first = variance.Count)
+			{
+				int count = first == 0 ? SoftShadowFirstRound : sampleCount - first;
+				FVector3 colors[MaxSoftShadowSampleCount];
+				TraceOcclusion(shadowRays + first, colors, count);
+				for (int i = 0; i < count; i++)
+				{
+					variance.Add((colors[i].X + colors[i].Y + colors[i].Z) * lightScale);
+					incoming += colors[i];
+				}
+			}
+			incoming /= (float)variance.Count;
+			sampling.RaysTraced += variance.Count;
+			sampling.RaysSkipped += sampleCount - variance.Count;
+		}
+		else
+		{
+			incoming += TraceOcclusion(origin, light.Origin, minDistance, rayColor);
+			sampling.RaysTraced++;
+		}
+	}
+	return incoming;
+}
+
+FVector3 CPURaytracer::TracePointLightRay(FVector3 origin, const FVector3& lightpos, float tmin, FVector3 rayColor)
+{
+	FVector3 dir = (lightpos - origin).Unit();
+	float tmax = (lightpos - origin).Length();
+
+	for (int i = 0; i < 3; i++)
+	{
+		TraceResult result = TraceFirstHit(origin, tmin, dir, tmax);
+
+		// Stop if we hit nothing - the point light is visible.
+		if (result.primitiveIndex == -1)
+			return rayColor;
+
+		LevelMeshSurface* surface = GetSurface(result.primitiveIndex);
+
+		// Pass through surface texture
+		rayColor = PassRayThroughSurface(surface, GetSurfaceUV(result.primitiveIndex, result.primitiveWeights), rayColor);
+
+		// Stop if there is no light left
+		if (rayColor.X + rayColor.Y + rayColor.Z <= 0.0f)
+			return FVector3(0.0f, 0.0f, 0.0f);
+
+		// Move to surface hit point
+		origin += dir * result.t;
+		tmax -= result.t;
+
+		// Move through the portal, if any
+		TransformRay(surface->PortalIndex, origin, dir);
+	}
+	return FVector3(0.0f, 0.0f, 0.0f);
+}
+
+FVector3 CPURaytracer::TraceOcclusion(const FVector3& origin, const FVector3& target, float tmin, const FVector3& rayColor)
+{
+	FVector3 dir = (target - origin).Unit();
+	float tmax = (target - origin).Length();
+	if (tmax <= tmin)
+		return rayColor;
+
+	OcclusionState state;
+	state.Dir = dir;
+	state.Color = rayColor;
+
+	TriangleMeshBVH4::find_any_hit(mesh->CollisionBVH4.get(), origin + dir * tmin, origin + dir * tmax, [this, &state](const TraceHit& hit) { return AcceptOcclusionHit(state, hit); });
+
+	if (state.Portal)
+		return TracePointLightRay(origin, target, tmin, rayColor);
+	return state.Color;
+}
+
+void CPURaytracer::TraceOcclusion(const OcclusionRay* rays, FVector3* colors, int count)
+{
+	// The rays are traced as packets. They usually come from one texel and go towards the same light.
+	const int packetSize = TriangleMeshBVH4::max_packet_size;
+	for (int first = 0; first < count; first += packetSize)
+	{
+		int packetCount = std::min(count - first, packetSize);
+
+		OcclusionState states[packetSize];
+		FVector3 start[packetSize], end[packetSize];
+		for (int i = 0; i < packetCount; i++)
+		{
+			const OcclusionRay& ray = rays[first + i];
+			FVector3 dir = (ray.Target - ray.Origin).Unit();
+			float tmax = (ray.Target - ray.Origin).Length();
+			states[i].Dir = dir;
+			states[i].Color = ray.Color;
+
+			// A ray too short to trace becomes an empty segment that can't hit anything
+			start[i] = ray.Origin + dir * std::min(ray.TMin, tmax);
+			end[i] = ray.Origin + dir * tmax;
+		}
+
+		TraceHit hits[packetSize];
+		TriangleMeshBVH4::find_any_hit(mesh->CollisionBVH4.get(), start, end, packetCount, hits, [this, &states](int ray, const TraceHit& hit) { return AcceptOcclusionHit(states[ray], hit); });
+
+		for (int i = 0; i < packetCount; i++)
+		{
+			const OcclusionRay& ray = rays[first + i];
+			if (states[i].Portal)
+				colors[first + i] = TracePointLightRay(ray.Origin, ray.Target, ray.TMin, ray.Color);
+			else
+				colors[first + i] = states[i].Color;
+		}
+	}
+}
+
+bool CPURaytracer::AcceptOcclusionHit(OcclusionState& state, const TraceHit& hit)
+{
+	// The order of the hits only matters if the ray goes through a portal. Without one, the light that
+	// makes it through is the product of all the surfaces in the way, and the first opaque one ends the search.
+
+	if (!IsFrontFace(hit.triangle, state.Dir))
+		return false;
+
+	// A ray going through the shared edge of two triangles hits the same surface twice
+	if (hit.surface == state.LastSurface)
+		return false;
+	state.LastSurface = hit.surface;
+
+	LevelMeshSurface* surface = mesh->GetSurface(hit.surface);
+	if (surface->PortalIndex != 0)
+	{
+		state.Portal = true;
+		return true;
+	}
+
+	state.Color = PassRayThroughSurface(surface, GetSurfaceUV(hit.triangle, FVector3(hit.b, hit.c, 1.0f - hit.b - hit.c)), state.Color);
+
+	// TracePointLightRay gives up after passing through three surfaces
+	if (state.Color.X + state.Color.Y + state.Color.Z <= 0.0f || ++state.SurfaceCount == 3)
+	{
+		state.Color = FVector3(0.0f, 0.0f, 0.0f);
+		return !hasPortals; // A portal closer to the origin could still send the ray somewhere else
+	}
+	return false;
+}
+
+FVector3 CPURaytracer::TraceBounceLight(const FVector3& origin, const FVector3& normal, float phi, uint32_t seed, TexelSampling& sampling)
+{
+	const float minDistance = 0.01f;
+	const float maxDistance = 1000.0f;
+	const int roundSize = 4;
+	const int sampleCount = std::max(lm_bouncesamples, roundSize);
+	uint32_t roundBits = 0;
+	while ((roundSize << roundBits) < sampleCount)
+		roundBits++;
+
+	FVector3 N = normal;
+	FVector3 up = std::abs(N.X) < std::abs(N.Y) ? FVector3(1.0f, 0.0f, 0.0f) : FVector3(0.0f, 1.0f, 0.0f);
+	FVector3 tangent = (up ^ N).Unit();
+	FVector3 bitangent = N ^ tangent;
+	if (lm_denoise)
+		RotateSampleFrame(tangent, bitangent, seed);
+	FVector3 incoming(0.0f, 0.0f, 0.0f);
+
+	// The rays traced from the hit points are part of the cost of a bounce sample
+	TexelSampling bounceSampling;
+	bounceSampling.Adaptive = sampling.Adaptive;
+	SampleVariance variance(sampling.Adaptive);
+	for (int round = 0; round < sampleCount / roundSize && (round == 0 || !variance.IsConverged(BounceTolerance * variance.Mean())); round++)
+	{
+		FVector3 dirs[roundSize];
+		for (int i = 0; i < roundSize; i++)
+		{
+			FVector2 Xi = Hammersley(GetRoundSampleIndex(round, i, roundBits, 2), sampleCount);
+			FVector3 H = FVector3(Xi.X * 2.0f - 1.0f, Xi.Y * 2.0f - 1.0f, 1.5f - Xi.Length()).Unit();
+			dirs[i] = tangent * H.X + bitangent * H.Y + N * H.Z;
+		}
+
+		TraceResult results[roundSize];
+		TraceFirstHit(origin, minDistance, dirs, maxDistance, results, roundSize);
+		bounceSampling.RaysTraced += roundSize;
+
+		for (int i = 0; i < roundSize; i++)
+		{
+			const FVector3& L = dirs[i];
+			const TraceResult& result = results[i];
+
+			// We hit nothing.
+			if (result.primitiveIndex == -1)
+			{
+				variance.Add(0.0f);
+				continue;
+			}
+
+			LevelMeshSurface* surface = GetSurface(result.primitiveIndex);
+			FVector3 surfaceNormal = surface->Plane.XYZ();
+			FVector3 surfacepos = origin + L * result.t;
+
+			float angleAttenuation = std::max(normal | L, 0.0f);
+
+			FVector3 sample(0.0f, 0.0f, 0.0f);
+			if (gatherBounces)
+			{
+				sample = GetLightmapRadiance(surface, result.primitiveIndex, result.primitiveWeights) * angleAttenuation;
+			}
+			else
+			{
+				if (useSunLight)
+					sample += TraceSunLight(surfacepos, surfaceNormal, phi, bounceSampling) * angleAttenuation;
+
+				uint32_t sampleSeed = HashUInt(seed + round * roundSize + i + 1);
+				sample += TraceLights(surfacepos, surfaceNormal, surface, result.t, phi, sampleSeed, bounceSampling) * angleAttenuation;
+			}
+
+			variance.Add(sample.X + sample.Y + sample.Z);
+			incoming += sample;
+		}
+	}
+
+	// Skipped samples are assumed to cost as much as the ones we took
+	sampling.LightsListed += bounceSampling.LightsListed;
+	sampling.LightsTraced += bounceSampling.LightsTraced;
+	sampling.RaysTraced += bounceSampling.RaysTraced;
+	sampling.RaysSkipped += bounceSampling.RaysSkipped + (sampleCount - variance.Count) * bounceSampling.RaysTraced / variance.Count;
+	return incoming / (float)variance.Count;
+}
+
+float CPURaytracer::TraceAmbientOcclusion(const FVector3& origin, const FVector3& normal, uint32_t seed, TexelSampling& sampling)
+{
+	const float minDistance = 0.01f;
+	const float aoDistance = 100.0f;
+	const int roundSize = TriangleMeshBVH4::max_packet_size;
+	const int sampleCount = std::max(lm_aosamples, roundSize);
+	uint32_t roundBits = 0;
+	while ((roundSize << roundBits) < sampleCount)
+		roundBits++;
+
+	FVector3 N = normal;
+	FVector3 up = std::abs(N.X) < std::abs(N.Y) ? FVector3(1.0f, 0.0f, 0.0f) : FVector3(0.0f, 1.0f, 0.0f);
+	FVector3 tangent = (up ^ N).Unit();
+	FVector3 bitangent = N ^ tangent;
+	if (lm_denoise)
+		RotateSampleFrame(tangent, bitangent, seed);
+
+	// Each round is one ray packet. Two rounds are needed before the variance means anything.
+	SampleVariance variance(sampling.Adaptive);
+	for (int round = 0; round < sampleCount / roundSize && (round < 2 || !variance.IsConverged(AOTolerance)); round++)
+	{
+		FVector3 dirs[roundSize];
+		for (int i = 0; i < roundSize; i++)
+		{
+			FVector2 Xi = Hammersley(GetRoundSampleIndex(round, i, roundBits, 4), sampleCount);
+			FVector3 H = FVector3(Xi.X * 2.0f - 1.0f, Xi.Y * 2.0f - 1.0f, 1.5f - Xi.Length()).Unit();
+			dirs[i] = tangent * H.X + bitangent * H.Y + N * H.Z;
+		}
+
+		TraceResult results[roundSize];
+		TraceFirstHit(origin, minDistance, dirs, aoDistance, results, roundSize);
+		for (int i = 0; i < roundSize; i++)
+			variance.Add(std::clamp(TraceAORay(origin, minDistance, dirs[i], aoDistance, &results[i]) / aoDistance, 0.0f, 1.0f));
+	}
+
+	sampling.RaysTraced += variance.Count;
+	sampling.RaysSkipped += sampleCount - variance.Count;
+	return variance.Mean();
+}
+
+float CPURaytracer::TraceAORay(FVector3 origin, float tmin, FVector3 dir, float tmax, const TraceResult* firstHit)
+{
+	float tcur = 0.0f;
+	for (int i = 0; i < 3; i++)
+	{
+		TraceResult result = (i == 0 && firstHit) ? *firstHit : TraceFirstHit(origin, tmin, dir, tmax - tcur);
+		if (result.primitiveIndex == -1)
+			return tmax;
+
+		LevelMeshSurface* surface = GetSurface(result.primitiveIndex);
+
+		// Stop if hit sky portal
+		if (surface->IsSky)
+			return tmax;
+
+		// Stop if opaque surface
+		if (surface->PortalIndex == 0)
+			return tcur + result.t;
+
+		// Move to surface hit point
+		origin += dir * result.t;
+		tcur += result.t;
+		if (tcur >= tmax)
+			return tmax;
+
+		// Move through the portal, if any
+		TransformRay(surface->PortalIndex, origin, dir);
+	}
+	return tmax;
+}
+
+CPURaytracer::TraceResult CPURaytracer::TraceFirstHit(const FVector3& origin, float tmin, const FVector3& dir, float tmax)
+{
+	TraceResult result;
+	result.t = tmax;
+	result.primitiveWeights = FVector3(0.0f, 0.0f, 0.0f);
+	result.primitiveIndex = -1;
+
+	if (tmin >= tmax)
+		return result;
+
+	// The GPU trace culls triangles facing away from the ray
+	TraceHit hit = TriangleMeshBVH4::find_first_hit(mesh->CollisionBVH4.get(), origin + dir * tmin, origin + dir * tmax, true);
+	if (hit.triangle >= 0)
+	{
+		result.t = tmin + (tmax - tmin) * hit.fraction;
+		result.primitiveWeights = FVector3(hit.b, hit.c, 1.0f - hit.b - hit.c);
+		result.primitiveIndex = hit.triangle;
+	}
+	return result;
+}
+
+void CPURaytracer::TraceFirstHit(const FVector3& origin, float tmin, const FVector3* dirs, float tmax, TraceResult* results, int count)
+{
+	// Rays leaving the same point stay close enough together to be traced as packets
+	const int packetSize = TriangleMeshBVH4::max_packet_size;
+	for (int first = 0; first < count; first += packetSize)
+	{
+		int packetCount = std::min(count - first, packetSize);
+
+		FVector3 start[packetSize], end[packetSize];
+		for (int i = 0; i < packetCount; i++)
+		{
+			start[i] = origin + dirs[first + i] * tmin;
+			end[i] = origin + dirs[first + i] * tmax;
+		}
+
+		TraceHit hits[packetSize];
+		TriangleMeshBVH4::find_first_hit(mesh->CollisionBVH4.get(), start, end, packetCount, hits, true);
+
+		for (int i = 0; i < packetCount; i++)
+		{
+			TraceResult& result = results[first + i];
+			const TraceHit& hit = hits[i];
+			result.t = tmax;
+			result.primitiveWeights = FVector3(0.0f, 0.0f, 0.0f);
+			result.primitiveIndex = -1;
+			if (hit.triangle >= 0 && tmin < tmax)
+			{
+				result.t = tmin + (tmax - tmin) * hit.fraction;
+				result.primitiveWeights = FVector3(hit.b, hit.c, 1.0f - hit.b - hit.c);
+				result.primitiveIndex = hit.triangle;
+			}
+		}
+	}
+}
+
+bool CPURaytracer::IsFrontFace(int primitiveIndex, const FVector3& dir)
+{
+	// Note: the triangles wind the opposite way of the surface plane normal
+	const uint32_t* elements = mesh->Mesh.Indexes.Data() + primitiveIndex * 3;
+	FVector3 p0 = mesh->Mesh.Vertices[elements[0]].fPos();
+	FVector3 p1 = mesh->Mesh.Vertices[elements[1]].fPos();
+	FVector3 p2 = mesh->Mesh.Vertices[elements[2]].fPos();
+	return (dir | ((p1 - p0) ^ (p2 - p0))) >= 0.0f;
+}
+
+LevelMeshSurface* CPURaytracer::GetSurface(int primitiveIndex)
+{
+	return mesh->GetSurface(mesh->Mesh.SurfaceIndexes[primitiveIndex]);
+}
+
+FVector2 CPURaytracer::GetSurfaceUV(int primitiveIndex, const FVector3& primitiveWeights)
+{
+	const uint32_t* elements = mesh->Mesh.Indexes.Data() + primitiveIndex * 3;
+	const FFlatVertex& v0 = mesh->Mesh.Vertices[elements[0]];
+	const FFlatVertex& v1 = mesh->Mesh.Vertices[elements[1]];
+	const FFlatVertex& v2 = mesh->Mesh.Vertices[elements[2]];
+	return FVector2(
+		v1.u * primitiveWeights.X + v2.u * primitiveWeights.Y + v0.u * primitiveWeights.Z,
+		v1.v * primitiveWeights.X + v2.v * primitiveWeights.Y + v0.v * primitiveWeights.Z);
+}
+
+FVector3 CPURaytracer::PassRayThroughSurface(LevelMeshSurface* surface, const FVector2& uv, const FVector3& rayColor)
+{
+	if (!surface->Texture.isValid())
+		return rayColor;
+
+	// Nearest sampling with repeat, like the sampler used by the lightmapper. Textures without pixels are white.
+	FGameTexture* texture = TexMan.GetGameTexture(surface->Texture);
+	float alpha = 1.0f;
+	int width = texture->GetImageWidth();
+	int height = texture->GetImageHeight();
+	if (width > 0 && height > 0)
+	{
+		int x = (int)std::floor((uv.X - std::floor(uv.X)) * width);
+		int y = (int)std::floor((uv.Y - std::floor(uv.Y)) * height);
+		x = std::clamp(x, 0, width - 1);
+		y = std::clamp(y, 0, height - 1);
+		const uint8_t* pixels = (const uint8_t*)texture->GetImagePixels();
+		alpha = pixels[(x + y * width) * 4 + 3] * (1.0f / 255.0f);
+	}
+
+	return rayColor * (1.0f - alpha * surface->Alpha);
+}
+
+FVector3 CPURaytracer::GetLightmapRadiance(const LevelMeshSurface* surface, int primitiveIndex, const FVector3& primitiveWeights)
+{
+	if (surface->LightmapTileIndex < 0)
+		return FVector3(0.0f, 0.0f, 0.0f);
+
+	const LightmapTile& tile = mesh->LightmapTiles[surface->LightmapTileIndex];
+	const TileRadiance& radiance = tileRadiance[surface->LightmapTileIndex];
+
+	// Tiles that were not traced again have their final texels in the lightmap texture already
+	bool useLightmap = radiance.Direct.empty();
+	if (useLightmap && tile.NeedsUpdate)
+		return FVector3(0.0f, 0.0f, 0.0f);
+	const uint16_t* lightmap = mesh->LMTextureData.Data() + (size_t)tile.AtlasLocation.ArrayIndex * mesh->LMTextureSize * mesh->LMTextureSize * 4;
+	int width = tile.AtlasLocation.Width;
+	int height = tile.AtlasLocation.Height;
+
+	const uint32_t* elements = mesh->Mesh.Indexes.Data() + primitiveIndex * 3;
+	const FFlatVertex& v0 = mesh->Mesh.Vertices[elements[0]];
+	const FFlatVertex& v1 = mesh->Mesh.Vertices[elements[1]];
+	const FFlatVertex& v2 = mesh->Mesh.Vertices[elements[2]];
+	float lu = v1.lu * primitiveWeights.X + v2.lu * primitiveWeights.Y + v0.lu * primitiveWeights.Z;
+	float lv = v1.lv * primitiveWeights.X + v2.lv * primitiveWeights.Y + v0.lv * primitiveWeights.Z;
+
+	// Bilinear filter within the tile, leaving out the texels that no surface covers
+	float x = std::clamp(lu * mesh->LMTextureSize - tile.AtlasLocation.X - 0.5f, 0.0f, (float)(width - 1));
+	float y = std::clamp(lv * mesh->LMTextureSize - tile.AtlasLocation.Y - 0.5f, 0.0f, (float)(height - 1));
+	int x0 = (int)x;
+	int y0 = (int)y;
+	int x1 = std::min(x0 + 1, width - 1);
+	int y1 = std::min(y0 + 1, height - 1);
+	float fx = x - x0;
+	float fy = y - y0;
+
+	FVector3 color(0.0f, 0.0f, 0.0f);
+	float coverage = 0.0f;
+	auto addTexel = [&](int tx, int ty, float weight)
+	{
+		if (useLightmap)
+		{
+			const uint16_t* texel = lightmap + ((size_t)(tile.AtlasLocation.Y + ty) * mesh->LMTextureSize + tile.AtlasLocation.X + tx) * 4;
+			color += FVector3(halfToFloat(texel[0]), halfToFloat(texel[1]), halfToFloat(texel[2])) * weight;
+			coverage += halfToFloat(texel[3]) * weight;
+			return;
+		}
+
+		int i = tx + ty * width;
+		const FVector4& direct = radiance.Direct[i];
+		color += (direct.XYZ() + radiance.Bounce[i]) * weight;
+		coverage += direct.W * weight;
+	};
+	addTexel(x0, y0, (1.0f - fx) * (1.0f - fy));
+	addTexel(x1, y0, fx * (1.0f - fy));
+	addTexel(x0, y1, (1.0f - fx) * fy);
+	addTexel(x1, y1, fx * fy);
+	return coverage > 0.0f ? color / coverage : FVector3(0.0f, 0.0f, 0.0f);
+}
+
+void CPURaytracer::TransformRay(int portalIndex, FVector3& origin, FVector3& dir)
+{
+	if (portalIndex == 0)
+		return;
+
+	// The portal matrices are built for the Y/Z swapped coordinate system the shaders use
+	const VSMatrix& transformation = mesh->Portals[portalIndex].transformation;
+	FVector4 o = transformation * FVector4(origin.X, origin.Z, origin.Y, 1.0f);
+	FVector4 d = transformation * FVector4(dir.X, dir.Z, dir.Y, 0.0f);
+	origin = FVector3(o.X, o.Z, o.Y);
+	dir = FVector3(d.X, d.Z, d.Y);
+}
@@ -0,0 +1,142 @@
+#pragma once
+
+#include "framework/vectors.h"
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+class DoomLevelMesh;
+class LevelMeshLight;
+struct TraceHit;
+struct LevelMeshSurface;
+struct LightmapTile;
+
+// Bakes the lightmap on the CPU for machines without a Vulkan device.
+//
+// This follows the same steps as VkLightmapper: every tile is rasterized with 4x multisampling,
+// each fragment is ray traced like frag_raytrace does it, and the result is resolved and blurred
+// before it is copied into the lightmap texture.
+class CPURaytracer
+{
+public:
+	CPURaytracer();
+	~CPURaytracer();
+
+	void Raytrace(DoomLevelMesh* levelMesh);
+
+private:
+	// Shadow ray towards a light
+	struct OcclusionRay
+	{
+		FVector3 Origin;
+		FVector3 Target;
+		float TMin;
+		FVector3 Color;
+	};
+
+	// Light left in a shadow ray while its hits are collected by TraceOcclusion
+	struct OcclusionState
+	{
+		FVector3 Dir;
+		FVector3 Color;
+		int SurfaceCount = 0;
+		int LastSurface = -1;
+		bool Portal = false;
+	};
+
+	// Adaptive sampling state of a texel and the rays it traced or decided it could do without
+	struct TexelSampling
+	{
+		bool Adaptive = true; // False when the texel is traced again with every sample
+		uint64_t RaysTraced = 0;
+		uint64_t RaysSkipped = 0;
+		uint64_t LightsListed = 0; // Lights in the light lists of the surfaces shaded
+		uint64_t LightsTraced = 0; // Lights that shadow rays were traced for
+	};
+
+	// Light picked by the light tree, with the weight that makes up for the dim lights it randomly skipped
+	struct LightCandidate
+	{
+		int LightIndex;
+		float Value; // Unshadowed light times Scale, as the sum of its color channels
+		float Scale;
+	};
+
+	struct TraceResult
+	{
+		float t;
+		FVector3 primitiveWeights;
+		int primitiveIndex;
+	};
+
+	// One fragment shader invocation in the bake image
+	struct TileFragment
+	{
+		int SurfaceIndex;
+		int X, Y;
+		FVector3 Position;
+		FVector3 Color;
+		FVector3 Incoming; // Color before the ambient occlusion
+		FVector3 Bounce; // Part of Incoming that came from TraceBounceLight
+		float Occlusion = 1.0f;
+		TexelSampling Sampling;
+	};
+
+	struct TileBake
+	{
+		LightmapTile* Tile = nullptr;
+		std::vector<TileFragment> Fragments;
+		std::vector<int> SampleOwners; // Fragment covering each of the four samples in a texel, or -1
+	};
+
+	// Resolved texels of a tile kept between the passes when the bounces are gathered from the lightmap
+	struct TileRadiance
+	{
+		std::vector<FVector4> Direct; // Light without the ambient occlusion. W is the coverage.
+		std::vector<float> Occlusion;
+		std::vector<FVector3> Bounce; // Bounce light gathered in the last pass
+		std::vector<FVector3> NextBounce;
+	};
+
+	void RasterizeTile(TileBake& bake);
+	void RasterizeTriangle(TileBake& bake, int surfaceIndex, const FVector3* world, const FVector2* pos);
+	// The tile is the one being baked, which is not always the tile of the fragment's surface
+	void ShadeFragment(const LightmapTile* tile, TileFragment& fragment);
+	void GatherFragment(const LightmapTile* tile, TileFragment& fragment);
+	void FindTexelsToRefine(TileBake& bake);
+	void DenoiseTile(TileBake& bake, bool gathered);
+	void ResolveTile(TileBake& bake);
+	void ResolveBounce(TileBake& bake);
+	void ResolveTexels(const TileBake& bake, const std::function<FVector3(const TileFragment&)>& value, std::vector<FVector4>& texels);
+	void AddBounceToLightmap(int tileIndex);
+
+	FVector3 TraceSunLight(const FVector3& origin, const FVector3& normal, float phi, TexelSampling& sampling);
+	FVector3 TraceSunRay(FVector3 origin, float tmin, FVector3 dir, float tmax, FVector3 rayColor, const TraceResult* firstHit = nullptr);
+	FVector3 TraceLights(const FVector3& origin, const FVector3& normal, const LevelMeshSurface* surface, float extraDistance, float phi, uint32_t seed, TexelSampling& sampling);
+	void GatherLights(const FVector3& origin, const FVector3& normal, const LevelMeshSurface* surface, float extraDistance, int nodeIndex, float scale, uint32_t seed, std::vector<LightCandidate>& candidates);
+	FVector3 TraceLight(const FVector3& origin, const FVector3& normal, const LevelMeshLight& light, float extraDistance, float phi, TexelSampling& sampling);
+	FVector3 TracePointLightRay(FVector3 origin, const FVector3& lightpos, float tmin, FVector3 rayColor);
+	FVector3 TraceOcclusion(const FVector3& origin, const FVector3& target, float tmin, const FVector3& rayColor);
+	void TraceOcclusion(const OcclusionRay* rays, FVector3* colors, int count);
+	bool AcceptOcclusionHit(OcclusionState& state, const TraceHit& hit);
+	FVector3 TraceBounceLight(const FVector3& origin, const FVector3& normal, float phi, uint32_t seed, TexelSampling& sampling);
+	float TraceAmbientOcclusion(const FVector3& origin, const FVector3& normal, uint32_t seed, TexelSampling& sampling);
+	float TraceAORay(FVector3 origin, float tmin, FVector3 dir, float tmax, const TraceResult* firstHit = nullptr);
+
+	TraceResult TraceFirstHit(const FVector3& origin, float tmin, const FVector3& dir, float tmax);
+	void TraceFirstHit(const FVector3& origin, float tmin, const FVector3* dirs, float tmax, TraceResult* results, int count);
+	bool IsFrontFace(int primitiveIndex, const FVector3& dir);
+	LevelMeshSurface* GetSurface(int primitiveIndex);
+	FVector2 GetSurfaceUV(int primitiveIndex, const FVector3& primitiveWeights);
+	FVector3 GetLightmapRadiance(const LevelMeshSurface* surface, int primitiveIndex, const FVector3& primitiveWeights);
+	FVector3 PassRayThroughSurface(LevelMeshSurface* surface, const FVector2& uv, const FVector3& rayColor);
+	void TransformRay(int portalIndex, FVector3& origin, FVector3& dir);
+
+	DoomLevelMesh* mesh = nullptr;
+	bool useSunLight = false;
+	bool hasPortals = false;
+
+	// Radiosity mode gathers the bounces from these instead of tracing the lights again from every bounce
+	bool gatherBounces = false;
+	std::vector<TileRadiance> tileRadiance; // Indexed like LevelMesh::LightmapTiles
+};
@@ -2,11 +2,17 @@
 #include "doom_levelmesh.h"
 #include "level/level.h"
 #include "framework/halffloat.h"
+#include "framework/hdrencoding.h"
 #include "framework/binfile.h"
+#include "framework/worker.h"
 #include <algorithm>
+#include <cmath>
 #include <map>
 #include <set>
 #include <unordered_map>
+#ifndef DISABLE_SSE
+#include <immintrin.h>
+#endif
 
 extern float lm_scale;
 
@@ -27,6 +33,9 @@ DoomLevelMesh::DoomLevelMesh(FLevel& doomMap)
 	CreateSurfaces(doomMap);
 
 	SortIndexes();
+
+	// The tile surface lists skip the surfaces outside the tile, which needs the tile transforms
+	SetupTileTransforms();
 	BuildTileSurfaceLists();
 
 	Mesh.DynamicIndexStart = Mesh.Indexes.Size();
@@ -48,14 +57,29 @@ void DoomLevelMesh::CreateLights(FLevel& doomMap)
 	if (Mesh.Lights.Size() != 0)
 		return;
 
-	for (unsigned i = 0; i < doomMap.ThingLights.Size(); ++i)
-	{
-		printf("   Building light lists: %u / %u\r", i, doomMap.ThingLights.Size());
-		PropagateLight(doomMap, &doomMap.ThingLights[i], 0);
-	}
+	// Find the surfaces touched by each light in parallel
+	int lightCount = doomMap.ThingLights.Size();
+	std::vector<std::vector<int>> lightSurfaces(lightCount);
+	Worker::RunJob(lightCount, [&](int i) { PropagateLight(doomMap, &doomMap.ThingLights[i], 0, lightSurfaces[i]); });
 
 	printf("   Building light lists: %u / %u\n", doomMap.ThingLights.Size(), doomMap.ThingLights.Size());
 
+	// The surface lists from PropagateLight have no duplicates, so adding the lights in order gives
+	// every surface its lights in the same order as the ThingLights array
+	std::vector<unsigned int> surfaceLightCount(Surfaces.Size(), 0);
+	for (const std::vector<int>& surfaces : lightSurfaces)
+	{
+		for (int surfaceIndex : surfaces)
+			surfaceLightCount[surfaceIndex]++;
+	}
+	for (unsigned int i = 0; i < Surfaces.Size(); i++)
+		Surfaces[i].Lights.Grow(surfaceLightCount[i]);
+	for (int i = 0; i < lightCount; i++)
+	{
+		for (int surfaceIndex : lightSurfaces[i])
+			Surfaces[surfaceIndex].Lights.Push(&doomMap.ThingLights[i]);
+	}
+
 	for (DoomLevelMeshSurface& surface : Surfaces)
 	{
 		surface.LightList.Pos = Mesh.LightIndexes.Size();
@@ -72,9 +96,11 @@ void DoomLevelMesh::CreateLights(FLevel& doomMap)
 			}
 		}
 	}
+
+	BuildLightTrees();
 }
 
-void DoomLevelMesh::PropagateLight(FLevel& doomMap, ThingLight* light, int recursiveDepth)
+void DoomLevelMesh::PropagateLight(FLevel& doomMap, ThingLight* light, int recursiveDepth, std::vector<int>& surfaces)
 {
 	if (recursiveDepth > 32)
 		return;
@@ -85,7 +111,7 @@ void DoomLevelMesh::PropagateLight(FLevel& doomMap, ThingLight* light, int recur
 	//std::set<Portal, RecursivePortalComparator> portalsToErase;
 	for (int triangleIndex : TriangleMeshShape::find_all_hits(Collision.get(), &sphere))
 	{
-		DoomLevelMeshSurface* surface = &Surfaces[Mesh.SurfaceIndexes[triangleIndex]];
+		int surfaceIndex = Mesh.SurfaceIndexes[triangleIndex];
 
 		// skip any surface which isn't physically connected to the sector group in which the light resides
 		//if (light->sectorGroup == surface->sectorGroup)
@@ -101,24 +127,13 @@ void DoomLevelMesh::PropagateLight(FLevel& doomMap, ThingLight* light, int recur
 					fakeLight->relativePosition.emplace(portal->TransformPosition(light->LightRelativeOrigin()));
 					fakeLight->sectorGroup = portal->targetSectorGroup;
 
-					PropagateLight(doomMap, fakeLight.get(), recursiveDepth + 1);
+					PropagateLight(doomMap, fakeLight.get(), recursiveDepth + 1, surfaces);
 					portalsToErase.insert(*portal);
 					portalLights.push_back(std::move(fakeLight));
 				}
 			}*/
 
-			// Add light to the list if it isn't already there
-			bool found = false;
-			for (ThingLight* light2 : surface->Lights)
-			{
-				if (light2 == light)
-				{
-					found = true;
-					break;
-				}
-			}
-			if (!found)
-				surface->Lights.Push(light);
+			surfaces.push_back(surfaceIndex);
 		}
 	}
 
@@ -126,6 +141,10 @@ void DoomLevelMesh::PropagateLight(FLevel& doomMap, ThingLight* light, int recur
 	{
 		touchedPortals.erase(portal);
 	}*/
+
+	// A surface usually has several triangles inside the sphere
+	std::sort(surfaces.begin(), surfaces.end());
+	surfaces.erase(std::unique(surfaces.begin(), surfaces.end()), surfaces.end());
 }
 
 int DoomLevelMesh::GetLightIndex(ThingLight* light, int portalgroup)
@@ -1293,6 +1312,114 @@ void DoomLevelMesh::CreatePortals(FLevel& doomMap)
 	}
 }
 
+// Copies a line of RGBA16F texels to the lump as little endian RGB16F
+static void CopyLightmapLine(const uint16_t* src, uint8_t* dest, int width)
+{
+	int x = 0;
+#ifndef DISABLE_SSE
+	// Four texels at a time: drop the alpha of each pair and pack the two 12 byte halves into 24 bytes
+	const __m128i rgbMask = _mm_setr_epi16(-1, -1, -1, 0, 0, 0, 0, 0);
+	const __m128i secondMask = _mm_setr_epi16(0, 0, 0, -1, -1, -1, 0, 0);
+	for (; x + 4 <= width; x += 4)
+	{
+		__m128i texels01 = _mm_loadu_si128((const __m128i*)(src + x * 4));
+		__m128i texels23 = _mm_loadu_si128((const __m128i*)(src + x * 4 + 8));
+		__m128i rgb01 = _mm_or_si128(_mm_and_si128(texels01, rgbMask), _mm_and_si128(_mm_srli_si128(texels01, 2), secondMask));
+		__m128i rgb23 = _mm_or_si128(_mm_and_si128(texels23, rgbMask), _mm_and_si128(_mm_srli_si128(texels23, 2), secondMask));
+		_mm_storeu_si128((__m128i*)dest, _mm_or_si128(rgb01, _mm_slli_si128(rgb23, 12)));
+		_mm_storel_epi64((__m128i*)(dest + 16), _mm_srli_si128(rgb23, 4));
+		dest += 24;
+	}
+#endif
+	for (; x < width; x++)
+	{
+		for (int i = 0; i < 3; i++)
+		{
+			uint16_t value = src[x * 4 + i];
+			*(dest++) = value & 0xff;
+			*(dest++) = value >> 8;
+		}
+	}
+}
+
+// Encodes the RGBA16F texels of a tile as RGB9E5 and returns the squared error of the encoded colors
+static double EncodeLightmapTileRGB9E5(const uint16_t* src, int width, int height, int pitch, uint8_t* dest)
+{
+	double error = 0.0;
+	std::vector<float> line(width * 4);
+	for (int y = 0; y < height; y++)
+	{
+		halfToFloat(src + (size_t)y * pitch * 4, line.data(), line.size());
+		for (int x = 0; x < width; x++)
+		{
+			const float* texel = &line[x * 4];
+			uint32_t packed = floatToRGB9E5(texel[0], texel[1], texel[2]);
+			*(dest++) = packed & 0xff;
+			*(dest++) = (packed >> 8) & 0xff;
+			*(dest++) = (packed >> 16) & 0xff;
+			*(dest++) = packed >> 24;
+
+			float decoded[3];
+			rgb9e5ToFloat(packed, decoded);
+			for (int i = 0; i < 3; i++)
+				error += (decoded[i] - texel[i]) * (double)(decoded[i] - texel[i]);
+		}
+	}
+	return error;
+}
+
+// Encodes the RGBA16F texels of a tile as 4x4 BC6H blocks, row by row. The edge texels are repeated to fill the blocks
+// at the right and bottom. Returns the squared error of the texels inside the tile.
+static double EncodeLightmapTileBC6H(const uint16_t* src, int width, int height, int pitch, uint8_t* dest)
+{
+	double error = 0.0;
+	for (int blockY = 0; blockY < height; blockY += 4)
+	{
+		for (int blockX = 0; blockX < width; blockX += 4)
+		{
+			uint16_t texels[16 * 3];
+			for (int i = 0; i < 16; i++)
+			{
+				int x = std::min(blockX + (i & 3), width - 1);
+				int y = std::min(blockY + (i >> 2), height - 1);
+				const uint16_t* texel = src + (x + (size_t)y * pitch) * 4;
+				texels[i * 3] = texel[0];
+				texels[i * 3 + 1] = texel[1];
+				texels[i * 3 + 2] = texel[2];
+			}
+
+			encodeBC6HBlock(texels, dest);
+
+			uint16_t decoded[16 * 3];
+			decodeBC6HBlock(dest, decoded);
+			for (int i = 0; i < 16; i++)
+			{
+				if (blockX + (i & 3) >= width || blockY + (i >> 2) >= height)
+					continue;
+				for (int c = 0; c < 3; c++)
+				{
+					double d = halfToFloat(decoded[i * 3 + c]) - halfToFloat(texels[i * 3 + c]);
+					error += d * d;
+				}
+			}
+			dest += 16;
+		}
+	}
+	return error;
+}
+
+// Bytes a tile takes in the pixels of the lump
+static uint32_t GetEncodedTileSize(int width, int height)
+{
+	switch (LightmapEncoding)
+	{
+	default:
+	case ELE_F16: return width * height * 6;
+	case ELE_RGB9E5: return width * height * 4;
+	case ELE_BC6H: return ((width + 3) / 4) * ((height + 3) / 4) * 16;
+	}
+}
+
 void DoomLevelMesh::AddLightmapLump(FLevel& doomMap, FWadWriter& wadFile)
 {
 	/*
@@ -1319,10 +1446,25 @@ void DoomLevelMesh::AddLightmapLump(FLevel& doomMap, FWadWriter& wadFile)
 		vec3 projLocalToU;
 		vec3 projLocalToV;
 	};
+
+	// V4 is only written when --lightmap-format picks a compact encoding. It adds two fields to the header,
+	// and pixelsOffset becomes a byte offset into the pixel data:
+
+	struct LightmapLumpV4
+	{
+		int version = 4;
+		uint32_t tileCount;
+		uint32_t pixelCount;
+		uint32_t encoding; // 1 = RGB9E5 (uint32_t per texel), 2 = unsigned BC6H (16 bytes per 4x4 block)
+		uint32_t pixelDataSize; // in bytes
+		TileEntry tiles[tileCount];
+		uint8_t pixels[pixelDataSize]; // BC6H tiles are padded to whole blocks, which are stored row by row
+	};
 	*/
 	// Calculate size of lump
 	uint32_t tileCount = 0;
 	uint32_t pixelCount = 0;
+	uint32_t pixelDataSize = 0;
 
 	for (unsigned int i = 0; i < LightmapTiles.Size(); i++)
 	{
@@ -1331,18 +1473,18 @@ void DoomLevelMesh::AddLightmapLump(FLevel& doomMap, FWadWriter& wadFile)
 		{
 			tileCount++;
 			pixelCount += tile->AtlasLocation.Area();
+			pixelDataSize += GetEncodedTileSize(tile->AtlasLocation.Width, tile->AtlasLocation.Height);
 		}
 	}
 
 	printf("   Writing %u tiles out of %llu\n", tileCount, (size_t)LightmapTiles.Size());
 
-	const int version = 3;
+	const int version = LightmapEncoding == ELE_F16 ? 3 : 4;
 
-	const uint32_t headerSize = sizeof(int) + 2 * sizeof(uint32_t);
+	const uint32_t headerSize = sizeof(int) + (version == 3 ? 2 : 4) * sizeof(uint32_t);
 	const uint32_t bytesPerTileEntry = sizeof(uint32_t) * 4 + sizeof(uint16_t) * 2 + sizeof(float) * 9;
-	const uint32_t bytesPerPixel = sizeof(uint16_t) * 3; // F16 RGB
 
-	uint32_t lumpSize = headerSize + tileCount * bytesPerTileEntry + pixelCount * bytesPerPixel;
+	uint32_t lumpSize = headerSize + tileCount * bytesPerTileEntry + pixelDataSize;
 
 	bool debug = false;
 
@@ -1352,8 +1494,8 @@ void DoomLevelMesh::AddLightmapLump(FLevel& doomMap, FWadWriter& wadFile)
 		printf("Tiles: %u\nPixels: %u\n", tileCount, pixelCount);
 	}
 
-	// Setup buffer
-	std::vector<uint8_t> buffer(lumpSize);
+	// Setup buffer for everything but the pixels, which are streamed into the compressor after it
+	std::vector<uint8_t> buffer(headerSize + tileCount * bytesPerTileEntry);
 	BinFile lumpFile;
 	lumpFile.SetBuffer(buffer.data());
 
@@ -1361,6 +1503,11 @@ void DoomLevelMesh::AddLightmapLump(FLevel& doomMap, FWadWriter& wadFile)
 	lumpFile.Write32(version);
 	lumpFile.Write32(tileCount);
 	lumpFile.Write32(pixelCount);
+	if (version >= 4)
+	{
+		lumpFile.Write32(LightmapEncoding);
+		lumpFile.Write32(pixelDataSize);
+	}
 
 	if (debug)
 	{
@@ -1384,7 +1531,7 @@ void DoomLevelMesh::AddLightmapLump(FLevel& doomMap, FWadWriter& wadFile)
 		lumpFile.Write16(uint16_t(tile->AtlasLocation.Width));
 		lumpFile.Write16(uint16_t(tile->AtlasLocation.Height));
 
-		lumpFile.Write32(pixelsOffset * 3);
+		lumpFile.Write32(version == 3 ? pixelsOffset / sizeof(uint16_t) : pixelsOffset);
 
 		lumpFile.WriteFloat(tile->Transform.TranslateWorldToLocal.X);
 		lumpFile.WriteFloat(tile->Transform.TranslateWorldToLocal.Y);
@@ -1398,40 +1545,81 @@ void DoomLevelMesh::AddLightmapLump(FLevel& doomMap, FWadWriter& wadFile)
 		lumpFile.WriteFloat(tile->Transform.ProjLocalToV.Y);
 		lumpFile.WriteFloat(tile->Transform.ProjLocalToV.Z);
 
-		pixelsOffset += tile->AtlasLocation.Area();
+		pixelsOffset += GetEncodedTileSize(tile->AtlasLocation.Width, tile->AtlasLocation.Height);
 	}
 
+	// Compress and store in lump
+	ZLibOut zout(wadFile);
+	wadFile.StartWritingLump("LIGHTMAP");
+	zout.Write(buffer.data(), (int)(ptrdiff_t)(lumpFile.BufferAt() - lumpFile.Buffer()));
+
 	if (debug)
 	{
 		printf("--- Saving pixels ---\n");
 	}
 
-	// Write surface pixels
-	for (unsigned int i = 0; i < LightmapTiles.Size(); i++)
+	// Write surface pixels. The tiles are encoded in parallel into one chunk at a time, which is then compressed.
+	const uint32_t chunkBytes = 1536 * 1024;
+	std::vector<uint8_t> chunk;
+	std::vector<std::pair<LightmapTile*, uint32_t>> chunkTiles; // Tile and its offset in the chunk
+	std::vector<double> tileErrors;
+	double totalError = 0.0;
+	unsigned int tileIndex = 0;
+	while (tileIndex < LightmapTiles.Size())
 	{
-		LightmapTile* tile = &LightmapTiles[i];
+		chunkTiles.clear();
+		uint32_t chunkSize = 0;
+		while (tileIndex < LightmapTiles.Size() && chunkSize < chunkBytes)
+		{
+			LightmapTile* tile = &LightmapTiles[tileIndex++];
+			if (tile->AtlasLocation.ArrayIndex == -1)
+				continue;
 
-		if (tile->AtlasLocation.ArrayIndex == -1)
-			continue;
+			chunkTiles.push_back({ tile, chunkSize });
+			chunkSize += GetEncodedTileSize(tile->AtlasLocation.Width, tile->AtlasLocation.Height);
+		}
+		if (chunkTiles.empty())
+			break;
 
-		const uint16_t* pixels = LMTextureData.Data() + tile->AtlasLocation.ArrayIndex * LMTextureSize * LMTextureSize * 4;
-		int width = tile->AtlasLocation.Width;
-		int height = tile->AtlasLocation.Height;
-		for (int y = 0; y < height; y++)
-		{
-			const uint16_t* srcline = pixels + (tile->AtlasLocation.X + (tile->AtlasLocation.Y + y) * LMTextureSize) * 4;
-			for (int x = 0; x < width; x++)
+		chunk.resize(chunkSize);
+		tileErrors.assign(chunkTiles.size(), 0.0);
+		Worker::RunJob((int)chunkTiles.size(), [&](int i) {
+			LightmapTile* tile = chunkTiles[i].first;
+			const uint16_t* pixels = LMTextureData.Data() + (size_t)tile->AtlasLocation.ArrayIndex * LMTextureSize * LMTextureSize * 4;
+			const uint16_t* src = pixels + (tile->AtlasLocation.X + (size_t)tile->AtlasLocation.Y * LMTextureSize) * 4;
+			uint8_t* dest = chunk.data() + chunkTiles[i].second;
+			int width = tile->AtlasLocation.Width;
+			int height = tile->AtlasLocation.Height;
+			if (LightmapEncoding == ELE_RGB9E5)
 			{
-				lumpFile.Write16(*(srcline++));
-				lumpFile.Write16(*(srcline++));
-				lumpFile.Write16(*(srcline++));
-				srcline++;
+				tileErrors[i] = EncodeLightmapTileRGB9E5(src, width, height, LMTextureSize, dest);
 			}
-		}
+			else if (LightmapEncoding == ELE_BC6H)
+			{
+				tileErrors[i] = EncodeLightmapTileBC6H(src, width, height, LMTextureSize, dest);
+			}
+			else
+			{
+				for (int y = 0; y < height; y++)
+				{
+					CopyLightmapLine(src + (size_t)y * LMTextureSize * 4, dest, width);
+					dest += width * 6;
+				}
+			}
+		});
+
+		for (double error : tileErrors)
+			totalError += error;
+
+		zout.Write(chunk.data(), (int)chunk.size());
 	}
 
-	// Compress and store in lump
-	ZLibOut zout(wadFile);
-	wadFile.StartWritingLump("LIGHTMAP");
-	zout.Write(buffer.data(), (int)(ptrdiff_t)(lumpFile.BufferAt() - lumpFile.Buffer()));
+	if (LightmapEncoding != ELE_F16 && pixelCount != 0)
+	{
+		// PSNR of the linear colors, with 1.0 (a fully lit texel) as the peak
+		double mse = totalError / (pixelCount * 3.0);
+		double psnr = mse > 0.0 ? 10.0 * std::log10(1.0 / mse) : 99.0;
+		printf("   Encoded %u texels as %s in %u bytes (%.2f:1 against F16 RGB), PSNR %.2f dB\n",
+			pixelCount, LightmapEncoding == ELE_BC6H ? "BC6H" : "RGB9E5", pixelDataSize, pixelCount * 6.0 / pixelDataSize, psnr);
+	}
 }
@@ -106,7 +106,7 @@ private:
 
 	void CreatePortals(FLevel& doomMap);
 
-	void PropagateLight(FLevel& doomMap, ThingLight* light, int recursiveDepth);
+	void PropagateLight(FLevel& doomMap, ThingLight* light, int recursiveDepth, std::vector<int>& surfaces);
 	int GetLightIndex(ThingLight* light, int portalgroup);
 
 	static FVector4 ToPlane(const FFlatVertex& pt1, const FFlatVertex& pt2, const FFlatVertex& pt3)
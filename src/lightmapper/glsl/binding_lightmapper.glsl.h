@@ -3,9 +3,13 @@ static const char* binding_lightmapper_glsl = R"glsl(
 layout(set = 0, binding = 0) uniform Uniforms
 {
 	vec3 SunDir;
-	float Padding1;
+	uint AdaptiveSampling;
 	vec3 SunColor;
 	float SunIntensity;
+	float LightCutoff;
+	uint AOSampleCount;
+	uint BounceSampleCount;
+	uint SoftShadowSampleCount;
 };
 
 struct SurfaceInfo
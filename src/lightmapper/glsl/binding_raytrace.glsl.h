@@ -14,8 +14,8 @@ struct CollisionNode
 	float padding2;
 	int left;
 	int right;
-	int element_index;
-	int padding3;
+	int triangle_start;
+	int triangle_count;
 };
 
 layout(std430, set = 1, binding = 0) buffer NodeBuffer
@@ -27,6 +27,8 @@ layout(std430, set = 1, binding = 0) buffer NodeBuffer
 	CollisionNode nodes[];
 };
 
+layout(std430, set = 1, binding = 3) buffer NodeTriangleBuffer { int nodeTriangles[]; };
+
 #endif
 
 struct SurfaceVertex // Note: this must always match the FFlatVertex struct
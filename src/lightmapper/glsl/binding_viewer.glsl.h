@@ -55,8 +55,8 @@ struct CollisionNode
 	float padding2;
 	int left;
 	int right;
-	int element_index;
-	int padding3;
+	int triangle_start;
+	int triangle_count;
 };
 
 layout(set = 0, binding = 5, std430) buffer NodeBuffer
@@ -68,6 +68,8 @@ layout(set = 0, binding = 5, std430) buffer NodeBuffer
 	CollisionNode nodes[];
 };
 
+layout(set = 0, binding = 8, std430) buffer NodeTriangleBuffer { int nodeTriangles[]; };
+
 #endif
 
 struct SurfaceVertex // Note: this must always match the FFlatVertex struct
@@ -94,4 +96,10 @@ layout(push_constant) uniform PushConstants
 	float SunIntensity;
 };
 
+const uint AdaptiveSampling = 1;
+const float LightCutoff = 0.0;
+const uint AOSampleCount = 128;
+const uint BounceSampleCount = 8;
+const uint SoftShadowSampleCount = 10;
+
 )glsl";
@@ -23,6 +23,7 @@ void main()
 
 	vec3 normal = surfaces[SurfaceIndex].Normal;
 	vec3 origin = worldpos;
+	uint seed = HashUInt(uint(gl_FragCoord.x) | (uint(gl_FragCoord.y) << 16));
 
 #if defined(USE_SUNLIGHT)
 	vec3 incoming = TraceSunLight(origin, normal);
@@ -32,11 +33,11 @@ void main()
 
 	for (uint j = LightStart; j < LightEnd; j++)
 	{
-		incoming += TraceLight(origin, normal, lights[lightIndexes[j]], 0.0);
+		incoming += TraceLight(origin, normal, lights[lightIndexes[j]], 0.0, HashRandom(seed, j - LightStart));
 	}
 
 #if defined(USE_BOUNCE)
-	incoming += TraceBounceLight(origin, normal);
+	incoming += TraceBounceLight(origin, normal, seed);
 #endif
 
 #if defined(USE_AO)
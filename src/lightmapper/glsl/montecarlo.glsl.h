@@ -15,6 +15,54 @@ vec2 Hammersley(uint i, uint N)
 	return vec2(float(i) / float(N), RadicalInverse_VdC(i));
 }
 
+// Index of sample i of a round in a Hammersley set of 1 << (roundBits + sizeBits) samples. Every round is a
+// stratified subset of the set as the low bits of the index pick the Y strata and the high bits the X strata.
+uint GetRoundSampleIndex(uint round, uint i, uint roundBits, uint sizeBits)
+{
+	uint lowBits = sizeBits / 2;
+	uint lowMask = (1u << lowBits) - 1;
+	return (i & lowMask) | (round << lowBits) | ((i >> lowBits) << (lowBits + roundBits));
+}
+
+// Disk sample i of a soft shadow. The first four span the whole disk and the rest fill in between them.
+int GetSoftShadowSampleIndex(int i, int count)
+{
+	if (i < 4)
+		return i * (count - 1) / 3;
+	int index = i - 3;
+	if (index >= (count - 1) / 3)
+		index++;
+	if (index >= 2 * (count - 1) / 3)
+		index++;
+	return index;
+}
+
+// Adaptive sampling stops once the standard error of the mean of the samples is below the tolerance
+bool IsConverged(float sum, float sumSquares, int count, float tolerance)
+{
+	if (count < 2)
+		return false;
+	float mean = sum / float(count);
+	float variance = max(sumSquares / float(count) - mean * mean, 0.0) * float(count) / float(count - 1);
+	return variance / float(count) <= tolerance * tolerance;
+}
+
+// Random numbers for skipping lights. They only depend on the texel and what is skipped.
+uint HashUInt(uint h)
+{
+	h ^= h >> 16;
+	h *= 0x7feb352du;
+	h ^= h >> 15;
+	h *= 0x846ca68bu;
+	h ^= h >> 16;
+	return h;
+}
+
+float HashRandom(uint seed, uint index)
+{
+	return float(HashUInt(seed ^ (index * 0x9e3779b9u)) >> 8) * (1.0 / 16777216.0);
+}
+
 vec2 getVogelDiskSample(int sampleIndex, int sampleCount, float phi) 
 {
     const float goldenAngle = radians(180.0) * (3.0 - sqrt(5.0));
@@ -97,9 +97,9 @@ bool overlap_bv_ray(RayBBox ray, int a)
 
 #define FLT_EPSILON 1.192092896e-07F // smallest such that 1.0+FLT_EPSILON != 1.0
 
-float intersect_triangle_ray(RayBBox ray, int a, out float barycentricB, out float barycentricC)
+float intersect_triangle_ray(RayBBox ray, int triangle, out float barycentricB, out float barycentricC)
 {
-	int start_element = nodes[a].element_index;
+	int start_element = triangle * 3;
 
 	vec3 p[3];
 	p[0] = vertices[elements[start_element]].pos.xyz;
@@ -160,7 +160,7 @@ float intersect_triangle_ray(RayBBox ray, int a, out float barycentricB, out flo
 
 bool is_leaf(int node_index)
 {
-	return nodes[node_index].element_index != -1;
+	return nodes[node_index].triangle_count != 0;
 }
 
 /*
@@ -182,11 +182,14 @@ bool TraceAnyHit(vec3 origin, float tmin, vec3 dir, float tmax)
 		{
 			if (is_leaf(a))
 			{
-				float baryB, baryC;
-				float t = intersect_triangle_ray(ray, a, baryB, baryC);
-				if (t >= tmin && t < 1.0)
+				for (int i = 0; i < nodes[a].triangle_count; i++)
 				{
-					return true;
+					float baryB, baryC;
+					float t = intersect_triangle_ray(ray, nodeTriangles[nodes[a].triangle_start + i], baryB, baryC);
+					if (t >= tmin && t < 1.0)
+					{
+						return true;
+					}
 				}
 			}
 			else
@@ -226,14 +229,18 @@ TraceHit find_first_hit(RayBBox ray)
 		{
 			if (is_leaf(a))
 			{
-				float baryB, baryC;
-				float t = intersect_triangle_ray(ray, a, baryB, baryC);
-				if (t < hit.fraction)
+				for (int i = 0; i < nodes[a].triangle_count; i++)
 				{
-					hit.fraction = t;
-					hit.triangle = nodes[a].element_index / 3;
-					hit.b = baryB;
-					hit.c = baryC;
+					int triangle = nodeTriangles[nodes[a].triangle_start + i];
+					float baryB, baryC;
+					float t = intersect_triangle_ray(ray, triangle, baryB, baryC);
+					if (t < hit.fraction)
+					{
+						hit.fraction = t;
+						hit.triangle = triangle;
+						hit.b = baryB;
+						hit.c = baryC;
+					}
 				}
 			}
 			else
@@ -8,22 +8,38 @@ float TraceAmbientOcclusion(vec3 origin, vec3 normal)
 {
 	const float minDistance = 0.01;
 	const float aoDistance = 100;
-	const int SampleCount = 128;
+	uint SampleCount = AOSampleCount;
 
 	vec3 N = normal;
 	vec3 up = abs(N.x) < abs(N.y) ? vec3(1.0, 0.0, 0.0) : vec3(0.0, 1.0, 0.0);
 	vec3 tangent = normalize(cross(up, N));
 	vec3 bitangent = cross(N, tangent);
 
+	// The samples are taken in rounds of 16. Two rounds are needed before the variance means anything.
+	const uint RoundSize = 16;
+	const float Tolerance = 0.01;
+	uint RoundBits = uint(findMSB(SampleCount / RoundSize));
+
 	float ambience = 0.0f;
-	for (uint i = 0; i < SampleCount; i++)
+	float ambienceSquares = 0.0f;
+	int count = 0;
+	for (uint round = 0; round < SampleCount / RoundSize; round++)
 	{
-		vec2 Xi = Hammersley(i, SampleCount);
-		vec3 H = normalize(vec3(Xi.x * 2.0f - 1.0f, Xi.y * 2.0f - 1.0f, 1.5 - length(Xi)));
-		vec3 L = H.x * tangent + H.y * bitangent + H.z * N;
-		ambience += clamp(TraceAORay(origin, minDistance, L, aoDistance) / aoDistance, 0.0, 1.0);
+		if (round >= 2 && AdaptiveSampling != 0 && IsConverged(ambience, ambienceSquares, count, Tolerance))
+			break;
+
+		for (uint i = 0; i < RoundSize; i++)
+		{
+			vec2 Xi = Hammersley(GetRoundSampleIndex(round, i, RoundBits, 4), SampleCount);
+			vec3 H = normalize(vec3(Xi.x * 2.0f - 1.0f, Xi.y * 2.0f - 1.0f, 1.5 - length(Xi)));
+			vec3 L = H.x * tangent + H.y * bitangent + H.z * N;
+			float value = clamp(TraceAORay(origin, minDistance, L, aoDistance) / aoDistance, 0.0, 1.0);
+			ambience += value;
+			ambienceSquares += value * value;
+			count++;
+		}
 	}
-	return ambience / float(SampleCount);
+	return ambience / float(count);
 }
 
 float TraceAORay(vec3 origin, float tmin, vec3 dir, float tmax)
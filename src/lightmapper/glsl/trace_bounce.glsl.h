@@ -2,11 +2,11 @@ static const char* trace_bounce_glsl = R"glsl(
 
 #include <shaders/lightmap/montecarlo.glsl>
 
-vec3 TraceBounceLight(vec3 origin, vec3 normal)
+vec3 TraceBounceLight(vec3 origin, vec3 normal, uint seed)
 {
 	const float minDistance = 0.01;
 	const float maxDistance = 1000.0;
-	const int SampleCount = 8;
+	uint SampleCount = BounceSampleCount;
 
 	vec3 N = normal;
 	vec3 up = abs(N.x) < abs(N.y) ? vec3(1.0, 0.0, 0.0) : vec3(0.0, 1.0, 0.0);
@@ -14,13 +14,26 @@ vec3 TraceBounceLight(vec3 origin, vec3 normal)
 	vec3 bitangent = cross(N, tangent);
 	vec3 incoming = vec3(0.0);
 
-	for (uint i = 0; i < SampleCount; i++)
+	// The samples are taken in rounds of 4. The next round is only taken if the ones before disagree.
+	const uint RoundSize = 4;
+	const float Tolerance = 0.05; // Fraction of the mean
+	uint RoundBits = uint(findMSB(SampleCount / RoundSize));
+
+	float sum = 0.0;
+	float sumSquares = 0.0;
+	int count = 0;
+	for (uint n = 0; n < SampleCount; n++)
 	{
-		vec2 Xi = Hammersley(i, SampleCount);
+		uint round = n / RoundSize;
+		if (n != 0 && n % RoundSize == 0 && AdaptiveSampling != 0 && IsConverged(sum, sumSquares, count, Tolerance * sum / float(count)))
+			break;
+
+		vec2 Xi = Hammersley(GetRoundSampleIndex(round, n % RoundSize, RoundBits, 2), SampleCount);
 		vec3 H = normalize(vec3(Xi.x * 2.0f - 1.0f, Xi.y * 2.0f - 1.0f, 1.5 - length(Xi)));
 		vec3 L = H.x * tangent + H.y * bitangent + H.z * N;
 
 		TraceResult result = TraceFirstHit(origin, minDistance, L, maxDistance);
+		count++;
 
 		// We hit nothing.
 		if (result.primitiveIndex == -1)
@@ -32,17 +45,24 @@ vec3 TraceBounceLight(vec3 origin, vec3 normal)
 		vec3 surfacepos = origin + L * result.t;
 
 		float angleAttenuation = max(dot(normal, L), 0.0);
+		uint sampleSeed = HashUInt(seed + n + 1);
 
+		vec3 bounce = vec3(0.0);
 #if defined(USE_SUNLIGHT)
-		incoming += TraceSunLight(surfacepos, surface.Normal) * angleAttenuation;
+		bounce += TraceSunLight(surfacepos, surface.Normal) * angleAttenuation;
 #endif
 
 		for (uint j = LightStart; j < LightEnd; j++)
 		{
-			incoming += TraceLight(surfacepos, surface.Normal, lights[lightIndexes[j]], result.t) * angleAttenuation;
+			bounce += TraceLight(surfacepos, surface.Normal, lights[lightIndexes[j]], result.t, HashRandom(sampleSeed, j - LightStart)) * angleAttenuation;
 		}
+
+		float value = bounce.r + bounce.g + bounce.b;
+		sum += value;
+		sumSquares += value * value;
+		incoming += bounce;
 	}
-	return incoming / float(SampleCount);
+	return incoming / float(count);
 }
 
 )glsl";
@@ -4,7 +4,8 @@ static const char* trace_light_glsl = R"glsl(
 
 vec3 TracePointLightRay(vec3 origin, vec3 lightpos, float tmin, vec3 rayColor);
 
-vec3 TraceLight(vec3 origin, vec3 normal, LightInfo light, float extraDistance)
+// Lights adding less than LightCutoff are skipped when random is above their share of it
+vec3 TraceLight(vec3 origin, vec3 normal, LightInfo light, float extraDistance, float random)
 {
 	const float minDistance = 0.01;
 	vec3 incoming = vec3(0.0);
@@ -28,6 +29,14 @@ vec3 TraceLight(vec3 origin, vec3 normal, LightInfo light, float extraDistance)
 		{
 			vec3 rayColor = light.Color.rgb * (attenuation * light.Intensity);
 
+			float value = attenuation * abs(light.Intensity) * (light.Color.r + light.Color.g + light.Color.b);
+			if (value < LightCutoff)
+			{
+				if (random * LightCutoff >= value)
+					return vec3(0.0);
+				rayColor *= LightCutoff / value;
+			}
+
 #if defined(USE_SOFTSHADOWS)
 
 			if (light.SoftShadowRadius != 0.0)
@@ -36,15 +45,29 @@ vec3 TraceLight(vec3 origin, vec3 normal, LightInfo light, float extraDistance)
 				vec3 xdir = normalize(cross(dir, v));
 				vec3 ydir = cross(dir, xdir);
 
+				// The first four samples span the whole disk. The rest are only traced if they disagree.
+				const float tolerance = 0.02;
+
 				float lightsize = light.SoftShadowRadius;
-				int step_count = 10;
-				for (int i = 0; i < step_count; i++)
+				float rayLight = rayColor.r + rayColor.g + rayColor.b;
+				float lightScale = rayLight != 0.0 ? 1.0 / rayLight : 0.0;
+				int step_count = int(SoftShadowSampleCount);
+				float sum = 0.0;
+				float sumSquares = 0.0;
+				int i = 0;
+				while (i < step_count && (i != 4 || AdaptiveSampling == 0 || !IsConverged(sum, sumSquares, i, tolerance)))
 				{
-					vec2 gridoffset = getVogelDiskSample(i, step_count, gl_FragCoord.x + gl_FragCoord.y * 13.37) * lightsize;
+					vec2 gridoffset = getVogelDiskSample(GetSoftShadowSampleIndex(i, step_count), step_count, gl_FragCoord.x + gl_FragCoord.y * 13.37) * lightsize;
 					vec3 pos = light.Origin + xdir * gridoffset.x + ydir * gridoffset.y;
 
-					incoming += TracePointLightRay(origin, pos, minDistance, rayColor) / float(step_count);
+					vec3 color = TracePointLightRay(origin, pos, minDistance, rayColor);
+					float value = (color.r + color.g + color.b) * lightScale;
+					sum += value;
+					sumSquares += value * value;
+					incoming += color;
+					i++;
 				}
+				incoming /= float(i);
 			}
 			else
 			{
@@ -24,14 +24,28 @@ vec3 TraceSunLight(vec3 origin, vec3 normal)
 	vec3 xdir = normalize(cross(dir, v));
 	vec3 ydir = cross(dir, xdir);
 
+	// The first four samples span the whole disk. The rest are only traced if they disagree.
+	const float tolerance = 0.02;
+
 	float lightsize = 100;
-	int step_count = 10;
-	for (int i = 0; i < step_count; i++)
+	float rayLight = rayColor.r + rayColor.g + rayColor.b;
+	float lightScale = rayLight != 0.0 ? 1.0 / rayLight : 0.0;
+	int step_count = int(SoftShadowSampleCount);
+	float sum = 0.0;
+	float sumSquares = 0.0;
+	int i = 0;
+	while (i < step_count && (i != 4 || AdaptiveSampling == 0 || !IsConverged(sum, sumSquares, i, tolerance)))
 	{
-		vec2 gridoffset = getVogelDiskSample(i, step_count, gl_FragCoord.x + gl_FragCoord.y * 13.37) * lightsize;
+		vec2 gridoffset = getVogelDiskSample(GetSoftShadowSampleIndex(i, step_count), step_count, gl_FragCoord.x + gl_FragCoord.y * 13.37) * lightsize;
 		vec3 pos = target + xdir * gridoffset.x + ydir * gridoffset.y;
-		incoming += TraceSunRay(origin, minDistance, normalize(pos - origin), dist, rayColor) / float(step_count);
+		vec3 color = TraceSunRay(origin, minDistance, normalize(pos - origin), dist, rayColor);
+		float value = (color.r + color.g + color.b) * lightScale;
+		sum += value;
+		sumSquares += value * value;
+		incoming += color;
+		i++;
 	}
+	incoming /= float(i);
 			
 #else
 
@@ -21,11 +21,12 @@
 */
 
 #include "hw_collision.h"
+#include "framework/worker.h"
 #include <algorithm>
 #include <functional>
 #include <cfloat>
 #include <cstdint>
-#ifndef NO_SSE
+#ifndef DISABLE_SSE
 #include <immintrin.h>
 #endif
 
@@ -36,22 +37,55 @@ TriangleMeshShape::TriangleMeshShape(const FFlatVertex *vertices, int num_vertic
 	if (num_triangles <= 0)
 		return;
 
-	std::vector<int> triangles;
-	std::vector<FVector3> centroids;
-	triangles.reserve(num_triangles);
-	centroids.reserve(num_triangles);
+	std::vector<TriangleBounds> bounds(num_triangles);
+	triangles.resize(num_triangles);
 	for (int i = 0; i < num_triangles; i++)
 	{
-		triangles.push_back(i);
+		triangles[i] = i;
 
 		int element_index = i * 3;
-		FVector3 centroid = (vertices[elements[element_index + 0]].fPos() + vertices[elements[element_index + 1]].fPos() + vertices[elements[element_index + 2]].fPos()) * (1.0f / 3.0f);
-		centroids.push_back(centroid);
+		FVector3 p0 = vertices[elements[element_index + 0]].fPos();
+		FVector3 p1 = vertices[elements[element_index + 1]].fPos();
+		FVector3 p2 = vertices[elements[element_index + 2]].fPos();
+		bounds[i].min = FVector3(std::min({ p0.X, p1.X, p2.X }), std::min({ p0.Y, p1.Y, p2.Y }), std::min({ p0.Z, p1.Z, p2.Z }));
+		bounds[i].max = FVector3(std::max({ p0.X, p1.X, p2.X }), std::max({ p0.Y, p1.Y, p2.Y }), std::max({ p0.Z, p1.Z, p2.Z }));
+		bounds[i].centroid = (p0 + p1 + p2) * (1.0f / 3.0f);
 	}
 
-	std::vector<int> work_buffer(num_triangles * 2);
+	// Build the top of the tree on this thread. The subtrees below it are left as placeholders and built in parallel afterwards.
+	// The subtree size doesn't depend on the thread count so that the tree always comes out the same.
+	int subtree_size = std::max(num_triangles / 128, 512);
+	std::vector<std::pair<int, int>> subtrees;
+	root = subdivide(nodes, 0, num_triangles, bounds.data(), &subtrees, subtree_size);
 
-	root = subdivide(&triangles[0], (int)triangles.size(), &centroids[0], &work_buffer[0]);
+	std::vector<std::vector<Node>> subtree_nodes(subtrees.size());
+	Worker::RunJob((int)subtrees.size(), [&](int i) { subdivide(subtree_nodes[i], subtrees[i].first, subtrees[i].second, bounds.data(), nullptr, 0); });
+
+	// Append the subtrees and link them into the top of the tree
+	int top_count = (int)nodes.size();
+	std::vector<int> subtree_roots(subtrees.size());
+	for (size_t i = 0; i < subtrees.size(); i++)
+	{
+		int offset = (int)nodes.size();
+		for (Node node : subtree_nodes[i])
+		{
+			if (node.triangle_count == 0)
+			{
+				node.left += offset;
+				node.right += offset;
+			}
+			nodes.push_back(node);
+		}
+		subtree_roots[i] = offset;
+	}
+
+	auto link = [&](int &index) { if (index < -1) index = subtree_roots[-2 - index]; };
+	link(root);
+	for (int i = 0; i < top_count; i++)
+	{
+		link(nodes[i].left);
+		link(nodes[i].right);
+	}
 }
 
 float TriangleMeshShape::sweep(TriangleMeshShape *shape1, SphereShape *shape2, const FVector3 &target)
@@ -83,49 +117,17 @@ std::vector<int> TriangleMeshShape::find_all_hits(TriangleMeshShape* shape1, Sph
 	return hits;
 }
 
-bool TriangleMeshShape::find_any_hit(TriangleMeshShape *shape, const FVector3 &ray_start, const FVector3 &ray_end)
-{
-	if (shape->root == -1)
-		return false;
-
-	return find_any_hit(shape, RayBBox(ray_start, ray_end), shape->root);
-}
-
-TraceHit TriangleMeshShape::find_first_hit(TriangleMeshShape *shape, const FVector3 &ray_start, const FVector3 &ray_end)
-{
-	TraceHit hit;
-
-	if (shape->root == -1)
-		return hit;
-
-	// Perform segmented tracing to keep the ray AABB box smaller
-
-	FVector3 ray_dir = ray_end - ray_start;
-	float tracedist = (float)ray_dir.Length();
-	float segmentlen = std::max(100.0f, tracedist / 20.0f);
-	for (float t = 0.0f; t < tracedist; t += segmentlen)
-	{
-		float segstart = t / tracedist;
-		float segend = std::min(t + segmentlen, tracedist) / tracedist;
-
-		find_first_hit(shape, RayBBox(ray_start + ray_dir * segstart, ray_start + ray_dir * segend), shape->root, &hit);
-		if (hit.fraction < 1.0f)
-		{
-			hit.fraction = segstart * (1.0f - hit.fraction) + segend * hit.fraction;
-			break;
-		}
-	}
-
-	return hit;
-}
-
 float TriangleMeshShape::sweep(TriangleMeshShape *shape1, SphereShape *shape2, int a, const FVector3 &target)
 {
 	if (sweep_overlap_bv_sphere(shape1, shape2, a, target))
 	{
 		if (shape1->is_leaf(a))
 		{
-			return sweep_intersect_triangle_sphere(shape1, shape2, a, target);
+			const Node &node = shape1->nodes[a];
+			float t = 1.0f;
+			for (int i = 0; i < node.triangle_count; i++)
+				t = std::min(t, sweep_intersect_triangle_sphere(shape1, shape2, shape1->triangles[node.triangle_start + i], target));
+			return t;
 		}
 		else
 		{
@@ -141,7 +143,13 @@ bool TriangleMeshShape::find_any_hit(TriangleMeshShape *shape1, SphereShape *sha
 	{
 		if (shape1->is_leaf(a))
 		{
-			return overlap_triangle_sphere(shape1, shape2, a);
+			const Node &node = shape1->nodes[a];
+			for (int i = 0; i < node.triangle_count; i++)
+			{
+				if (overlap_triangle_sphere(shape1, shape2, shape1->triangles[node.triangle_start + i]))
+					return true;
+			}
+			return false;
 		}
 		else
 		{
@@ -160,9 +168,14 @@ void TriangleMeshShape::find_all_hits(TriangleMeshShape* shape1, SphereShape* sh
 	{
 		if (shape1->is_leaf(a))
 		{
-			if (overlap_triangle_sphere(shape1, shape2, a))
+			const Node &node = shape1->nodes[a];
+			for (int i = 0; i < node.triangle_count; i++)
 			{
-				hits.push_back(shape1->nodes[a].element_index / 3);
+				int triangle = shape1->triangles[node.triangle_start + i];
+				if (overlap_triangle_sphere(shape1, shape2, triangle))
+				{
+					hits.push_back(triangle);
+				}
 			}
 		}
 		else
@@ -226,119 +239,6 @@ bool TriangleMeshShape::find_any_hit(TriangleMeshShape *shape1, TriangleMeshShap
 	}
 }
 
-bool TriangleMeshShape::find_any_hit(TriangleMeshShape *shape, const RayBBox &ray, int a)
-{
-	if (overlap_bv_ray(shape, ray, a))
-	{
-		if (shape->is_leaf(a))
-		{
-			float baryB, baryC;
-			return intersect_triangle_ray(shape, ray, a, baryB, baryC) < 1.0f;
-		}
-		else
-		{
-			if (find_any_hit(shape, ray, shape->nodes[a].left))
-				return true;
-			else
-				return find_any_hit(shape, ray, shape->nodes[a].right);
-		}
-	}
-	return false;
-}
-
-void TriangleMeshShape::find_first_hit(TriangleMeshShape *shape, const RayBBox &ray, int a, TraceHit *hit)
-{
-	if (overlap_bv_ray(shape, ray, a))
-	{
-		if (shape->is_leaf(a))
-		{
-			float baryB, baryC;
-			float t = intersect_triangle_ray(shape, ray, a, baryB, baryC);
-			if (t < hit->fraction)
-			{
-				hit->fraction = t;
-				hit->triangle = shape->nodes[a].element_index / 3;
-				hit->b = baryB;
-				hit->c = baryC;
-			}
-		}
-		else
-		{
-			find_first_hit(shape, ray, shape->nodes[a].left, hit);
-			find_first_hit(shape, ray, shape->nodes[a].right, hit);
-		}
-	}
-}
-
-bool TriangleMeshShape::overlap_bv_ray(TriangleMeshShape *shape, const RayBBox &ray, int a)
-{
-	return IntersectionTest::ray_aabb(ray, shape->nodes[a].aabb) == IntersectionTest::overlap;
-}
-
-float TriangleMeshShape::intersect_triangle_ray(TriangleMeshShape *shape, const RayBBox &ray, int a, float &barycentricB, float &barycentricC)
-{
-	const int start_element = shape->nodes[a].element_index;
-
-	FVector3 p[3] =
-	{
-		shape->vertices[shape->elements[start_element]].fPos(),
-		shape->vertices[shape->elements[start_element + 1]].fPos(),
-		shape->vertices[shape->elements[start_element + 2]].fPos()
-	};
-
-	// MoellerTrumbore ray-triangle intersection algorithm:
-
-	FVector3 D = ray.end - ray.start;
-
-	// Find vectors for two edges sharing p[0]
-	FVector3 e1 = p[1] - p[0];
-	FVector3 e2 = p[2] - p[0];
-
-	// Begin calculating determinant - also used to calculate u parameter
-	FVector3 P = D ^ e2; // cross(D, e2);
-	float det = e1 | P; // dot(e1, P);
-
-	// Backface check
-	//if (det < 0.0f)
-	//	return 1.0f;
-
-	// If determinant is near zero, ray lies in plane of triangle
-	if (det > -FLT_EPSILON && det < FLT_EPSILON)
-		return 1.0f;
-
-	float inv_det = 1.0f / det;
-
-	// Calculate distance from p[0] to ray origin
-	FVector3 T = ray.start - p[0];
-
-	// Calculate u parameter and test bound
-	float u = (T | P) * inv_det; // dot(T, P) * inv_det;
-
-	// Check if the intersection lies outside of the triangle
-	if (u < 0.f || u > 1.f)
-		return 1.0f;
-
-	// Prepare to test v parameter
-	FVector3 Q = T ^ e1; // cross(T, e1);
-
-	// Calculate V parameter and test bound
-	float v = (D | Q) * inv_det; // dot(D, Q) * inv_det;
-
-	// The intersection lies outside of the triangle
-	if (v < 0.f || u + v  > 1.f)
-		return 1.0f;
-
-	float t = (e2 | Q) * inv_det; //dot(e2, Q) * inv_det;
-	if (t <= FLT_EPSILON)
-		return 1.0f;
-
-	// Return hit location on triangle in barycentric coordinates
-	barycentricB = u;
-	barycentricC = v;
-	
-	return t;
-}
-
 bool TriangleMeshShape::sweep_overlap_bv_sphere(TriangleMeshShape *shape1, SphereShape *shape2, int a, const FVector3 &target)
 {
 	// Convert to ray test by expanding the AABB:
@@ -351,9 +251,9 @@ bool TriangleMeshShape::sweep_overlap_bv_sphere(TriangleMeshShape *shape1, Spher
 	return IntersectionTest::ray_aabb(RayBBox(shape2->center, target), aabb) == IntersectionTest::overlap;
 }
 
-float TriangleMeshShape::sweep_intersect_triangle_sphere(TriangleMeshShape *shape1, SphereShape *shape2, int a, const FVector3 &target)
+float TriangleMeshShape::sweep_intersect_triangle_sphere(TriangleMeshShape *shape1, SphereShape *shape2, int triangle, const FVector3 &target)
 {
-	const int start_element = shape1->nodes[a].element_index;
+	const int start_element = triangle * 3;
 
 	FVector3 p[3] =
 	{
@@ -522,11 +422,11 @@ bool TriangleMeshShape::overlap_triangle_triangle(TriangleMeshShape *shape1, Tri
 	return false;
 }
 
-bool TriangleMeshShape::overlap_triangle_sphere(TriangleMeshShape *shape1, SphereShape *shape2, int shape1_node_index)
+bool TriangleMeshShape::overlap_triangle_sphere(TriangleMeshShape *shape1, SphereShape *shape2, int triangle)
 {
 	// http://realtimecollisiondetection.net/blog/?p=103
 
-	int element_index = shape1->nodes[shape1_node_index].element_index;
+	int element_index = triangle * 3;
 
 	FVector3 P = shape2->center;
 	FVector3 A = shape1->vertices[shape1->elements[element_index]].fPos() - P;
@@ -578,7 +478,7 @@ bool TriangleMeshShape::overlap_triangle_sphere(TriangleMeshShape *shape1, Spher
 
 bool TriangleMeshShape::is_leaf(int node_index)
 {
-	return nodes[node_index].element_index != -1;
+	return nodes[node_index].triangle_count != 0;
 }
 
 float TriangleMeshShape::volume(int node_index)
@@ -592,7 +492,7 @@ int TriangleMeshShape::get_min_depth() const
 	std::function<int(int, int)> visit;
 	visit = [&](int level, int node_index) -> int {
 		const Node &node = nodes[node_index];
-		if (node.element_index == -1)
+		if (node.triangle_count == 0)
 			return std::min(visit(level + 1, node.left), visit(level + 1, node.right));
 		else
 			return level;
@@ -605,7 +505,7 @@ int TriangleMeshShape::get_max_depth() const
 	std::function<int(int, int)> visit;
 	visit = [&](int level, int node_index) -> int {
 		const Node &node = nodes[node_index];
-		if (node.element_index == -1)
+		if (node.triangle_count == 0)
 			return std::max(visit(level + 1, node.left), visit(level + 1, node.right));
 		else
 			return level;
@@ -618,14 +518,14 @@ float TriangleMeshShape::get_average_depth() const
 	std::function<float(int, int)> visit;
 	visit = [&](int level, int node_index) -> float {
 		const Node &node = nodes[node_index];
-		if (node.element_index == -1)
+		if (node.triangle_count == 0)
 			return visit(level + 1, node.left) + visit(level + 1, node.right);
 		else
-			return (float)level;
+			return (float)(level * node.triangle_count);
 	};
 	float depth_sum = visit(1, root);
-	int leaf_count = (num_elements / 3);
-	return depth_sum / leaf_count;
+	int triangle_count = (num_elements / 3);
+	return depth_sum / triangle_count;
 }
 
 float TriangleMeshShape::get_balanced_depth() const
@@ -633,118 +533,810 @@ float TriangleMeshShape::get_balanced_depth() const
 	return std::log2((float)(num_elements / 3));
 }
 
-int TriangleMeshShape::subdivide(int *triangles, int num_triangles, const FVector3 *centroids, int *work_buffer)
+namespace
 {
-	if (num_triangles == 0)
-		return -1;
+	struct SplitBin
+	{
+		FVector3 min = FVector3(FLT_MAX, FLT_MAX, FLT_MAX);
+		FVector3 max = FVector3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+		int count = 0;
 
-	// Find bounding box and median of the triangle centroids
-	FVector3 median;
-	FVector3 min, max;
-	min = vertices[elements[triangles[0] * 3]].fPos();
-	max = min;
-	for (int i = 0; i < num_triangles; i++)
+		void add(const FVector3 &bmin, const FVector3 &bmax, int n)
+		{
+			min = FVector3(std::min(min.X, bmin.X), std::min(min.Y, bmin.Y), std::min(min.Z, bmin.Z));
+			max = FVector3(std::max(max.X, bmax.X), std::max(max.Y, bmax.Y), std::max(max.Z, bmax.Z));
+			count += n;
+		}
+
+		float area() const
+		{
+			if (count == 0)
+				return 0.0f;
+			FVector3 e = max - min;
+			return e.X * e.Y + e.Y * e.Z + e.Z * e.X;
+		}
+	};
+}
+
+int TriangleMeshShape::subdivide(std::vector<Node> &out_nodes, int start, int count, const TriangleBounds *bounds, std::vector<std::pair<int, int>> *subtrees, int subtree_size)
+{
+	// Cost of visiting a node relative to testing a triangle
+	const float traversal_cost = 1.0f;
+	const int max_leaf_triangles = 4;
+	const int num_bins = 16;
+
+	if (subtrees && count <= subtree_size)
+	{
+		subtrees->push_back({ start, count });
+		return -1 - (int)subtrees->size();
+	}
+
+	int *tris = triangles.data() + start;
+
+	// Find bounding box of the triangles and of their centroids
+	SplitBin total, centroids;
+	for (int i = 0; i < count; i++)
+	{
+		const TriangleBounds &b = bounds[tris[i]];
+		total.add(b.min, b.max, 1);
+		centroids.add(b.centroid, b.centroid, 1);
+	}
+
+	int node_index = (int)out_nodes.size();
+	out_nodes.push_back(Node(total.min, total.max));
+
+	// Find the split with the lowest surface area heuristic cost by sorting the centroids into bins along each axis
+	float best_cost = FLT_MAX;
+	int best_axis = -1;
+	int best_split = 0;
+	for (int axis = 0; axis < 3; axis++)
 	{
-		int element_index = triangles[i] * 3;
-		for (int j = 0; j < 3; j++)
+		float extent = centroids.max[axis] - centroids.min[axis];
+		if (extent <= 0.0f)
+			continue;
+
+		float scale = num_bins / extent;
+		SplitBin bins[num_bins];
+		for (int i = 0; i < count; i++)
+		{
+			const TriangleBounds &b = bounds[tris[i]];
+			int bin = std::min((int)((b.centroid[axis] - centroids.min[axis]) * scale), num_bins - 1);
+			bins[bin].add(b.min, b.max, 1);
+		}
+
+		float right_area[num_bins];
+		int right_count[num_bins];
+		SplitBin right;
+		for (int i = num_bins - 1; i > 0; i--)
 		{
-			const FVector3 &vertex = vertices[elements[element_index + j]].fPos();
+			right.add(bins[i].min, bins[i].max, bins[i].count);
+			right_area[i] = right.area();
+			right_count[i] = right.count;
+		}
 
-			min.X = std::min(min.X, vertex.X);
-			min.Y = std::min(min.Y, vertex.Y);
-			min.Z = std::min(min.Z, vertex.Z);
+		SplitBin left;
+		for (int split = 1; split < num_bins; split++)
+		{
+			left.add(bins[split - 1].min, bins[split - 1].max, bins[split - 1].count);
+			if (left.count == 0 || right_count[split] == 0)
+				continue;
 
-			max.X = std::max(max.X, vertex.X);
-			max.Y = std::max(max.Y, vertex.Y);
-			max.Z = std::max(max.Z, vertex.Z);
+			float cost = left.area() * left.count + right_area[split] * right_count[split];
+			if (cost < best_cost)
+			{
+				best_cost = cost;
+				best_axis = axis;
+				best_split = split;
+			}
 		}
+	}
 
-		median += centroids[triangles[i]];
+	float parent_area = total.area();
+	float split_cost = (best_axis != -1 && parent_area > 0.0f) ? traversal_cost + best_cost / parent_area : FLT_MAX;
+	if (count == 1 || (count <= max_leaf_triangles && count <= split_cost)) // Leaf node
+	{
+		out_nodes[node_index].triangle_start = start;
+		out_nodes[node_index].triangle_count = count;
+		return node_index;
+	}
+
+	int left_count;
+	if (best_axis != -1)
+	{
+		float axis_min = centroids.min[best_axis];
+		float scale = num_bins / (centroids.max[best_axis] - axis_min);
+		int *middle = std::partition(tris, tris + count, [&](int triangle) {
+			return std::min((int)((bounds[triangle].centroid[best_axis] - axis_min) * scale), num_bins - 1) < best_split;
+		});
+		left_count = (int)(middle - tris);
 	}
-	median /= (float)num_triangles;
+	else
+	{
+		// All the centroids are at the same spot. Split the list in half.
+		left_count = count / 2;
+	}
+
+	int left_index = subdivide(out_nodes, start, left_count, bounds, subtrees, subtree_size);
+	int right_index = subdivide(out_nodes, start + left_count, count - left_count, bounds, subtrees, subtree_size);
+	out_nodes[node_index].left = left_index;
+	out_nodes[node_index].right = right_index;
+	return node_index;
+}
+
+/////////////////////////////////////////////////////////////////////////////
 
-	if (num_triangles == 1) // Leaf node
+struct TriangleMeshBVH4::Ray
+{
+	Ray(const FVector3 &ray_start, const FVector3 &ray_end) : start(ray_start), dir(ray_end - ray_start)
 	{
-		nodes.push_back(Node(min, max, triangles[0] * 3));
-		return (int)nodes.size() - 1;
+		// Keep the inverse finite so that the slab test never multiplies zero by infinity
+		for (int i = 0; i < 3; i++)
+		{
+			float d = dir[i];
+			if (std::abs(d) < 1e-20f)
+				d = d < 0.0f ? -1e-20f : 1e-20f;
+			inv_dir[i] = 1.0f / d;
+		}
+
+#ifndef DISABLE_SSE
+		origin_x = _mm_set1_ps(start.X);
+		origin_y = _mm_set1_ps(start.Y);
+		origin_z = _mm_set1_ps(start.Z);
+		inv_dir_x = _mm_set1_ps(inv_dir.X);
+		inv_dir_y = _mm_set1_ps(inv_dir.Y);
+		inv_dir_z = _mm_set1_ps(inv_dir.Z);
+#endif
 	}
 
-	// Find the longest axis
-	float axis_lengths[3] =
+	FVector3 start, dir, inv_dir;
+
+#ifndef DISABLE_SSE
+	__m128 origin_x, origin_y, origin_z;
+	__m128 inv_dir_x, inv_dir_y, inv_dir_z;
+#endif
+};
+
+// Structure of arrays layout, so that the box and triangle tests can load four rays at a time
+struct TriangleMeshBVH4::Packet
+{
+	Packet(const FVector3 *ray_start, const FVector3 *ray_end, int count) : count(count), group_count((count + 3) / 4)
 	{
-		max.X - min.X,
-		max.Y - min.Y,
-		max.Z - min.Z
+		bbox_min = ray_start[0];
+		bbox_max = ray_start[0];
+		for (int i = 0; i < group_count * 4; i++)
+		{
+			// The unused lanes of the last group repeat the first ray. They are never part of a ray mask.
+			int src = i < count ? i : 0;
+			Ray ray(ray_start[src], ray_end[src]);
+			start_x[i] = ray.start.X;
+			start_y[i] = ray.start.Y;
+			start_z[i] = ray.start.Z;
+			dir_x[i] = ray.dir.X;
+			dir_y[i] = ray.dir.Y;
+			dir_z[i] = ray.dir.Z;
+			inv_dir_x[i] = ray.inv_dir.X;
+			inv_dir_y[i] = ray.inv_dir.Y;
+			inv_dir_z[i] = ray.inv_dir.Z;
+			tmax[i] = 1.0f;
+
+			for (int j = 0; j < 3; j++)
+			{
+				bbox_min[j] = std::min({ bbox_min[j], ray_start[src][j], ray_end[src][j] });
+				bbox_max[j] = std::max({ bbox_max[j], ray_start[src][j], ray_end[src][j] });
+			}
+		}
+	}
+
+	alignas(16) float start_x[max_packet_size], start_y[max_packet_size], start_z[max_packet_size];
+	alignas(16) float dir_x[max_packet_size], dir_y[max_packet_size], dir_z[max_packet_size];
+	alignas(16) float inv_dir_x[max_packet_size], inv_dir_y[max_packet_size], inv_dir_z[max_packet_size];
+	alignas(16) float tmax[max_packet_size]; // Fraction of the closest hit found so far
+	FVector3 bbox_min, bbox_max; // Box around all the ray segments
+	int count;
+	int group_count;
+};
+
+static void set_child(TriangleMeshBVH4::Node &node, int slot, const TriangleMeshShape::Node &child, int index)
+{
+	node.min_x[slot] = child.aabb.min.X;
+	node.min_y[slot] = child.aabb.min.Y;
+	node.min_z[slot] = child.aabb.min.Z;
+	node.max_x[slot] = child.aabb.max.X;
+	node.max_y[slot] = child.aabb.max.Y;
+	node.max_z[slot] = child.aabb.max.Z;
+	node.child[slot] = index;
+	node.triangle_count[slot] = child.triangle_count;
+}
+
+TriangleMeshBVH4::TriangleMeshBVH4(const TriangleMeshShape *shape, const int *surface_indexes, int num_surface_indexes)
+{
+	if (shape->root == -1)
+		return;
+
+	triangles.resize(shape->triangles.size());
+	for (size_t i = 0; i < triangles.size(); i++)
+	{
+		int triangle = shape->triangles[i];
+		const unsigned int *elements = shape->elements + triangle * 3;
+		FVector3 p0 = shape->vertices[elements[0]].fPos();
+		triangles[i].v0 = p0;
+		triangles[i].e1 = shape->vertices[elements[1]].fPos() - p0;
+		triangles[i].e2 = shape->vertices[elements[2]].fPos() - p0;
+		triangles[i].triangle = triangle;
+		triangles[i].surface = triangle < num_surface_indexes ? surface_indexes[triangle] : -1;
+	}
+
+	const TriangleMeshShape::Node &root = shape->nodes[shape->root];
+	if (root.triangle_count != 0)
+	{
+		Node node;
+		set_child(node, 0, root, root.triangle_start);
+		node.child_count = 1;
+		nodes.push_back(node);
+		max_stack = 1;
+	}
+	else
+	{
+		collapse(shape, shape->root, 1);
+	}
+}
+
+int TriangleMeshBVH4::collapse(const TriangleMeshShape *shape, int binary_node, int depth)
+{
+	const std::vector<TriangleMeshShape::Node> &src = shape->nodes;
+
+	// Each visited node can leave up to three more siblings on the stack
+	max_stack = std::max(max_stack, 3 * depth + 1);
+
+	// Pull up the grandchildren of the largest inner child until the node has four children
+	int children[4] = { src[binary_node].left, src[binary_node].right };
+	int count = 2;
+	while (count < 4)
+	{
+		int best = -1;
+		float best_area = -1.0f;
+		for (int i = 0; i < count; i++)
+		{
+			const TriangleMeshShape::Node &child = src[children[i]];
+			if (child.triangle_count == 0)
+			{
+				FVector3 e = child.aabb.max - child.aabb.min;
+				float area = e.X * e.Y + e.Y * e.Z + e.Z * e.X;
+				if (area > best_area)
+				{
+					best = i;
+					best_area = area;
+				}
+			}
+		}
+		if (best == -1)
+			break;
+
+		int opened = children[best];
+		children[best] = src[opened].left;
+		children[count++] = src[opened].right;
+	}
+
+	int node_index = (int)nodes.size();
+	nodes.push_back(Node());
+	for (int i = 0; i < count; i++)
+	{
+		const TriangleMeshShape::Node &child = src[children[i]];
+		int index = (child.triangle_count != 0) ? child.triangle_start : collapse(shape, children[i], depth + 1);
+		set_child(nodes[node_index], i, child, index);
+	}
+	nodes[node_index].child_count = count;
+	return node_index;
+}
+
+int TriangleMeshBVH4::intersect_children(const Node &node, const Ray &ray, float tmax, float *tnear)
+{
+	// The far distance is pushed out a little so that rounding can't make the ray miss a flat box it touches
+	const float far_scale = 1.0f + 4.0f * FLT_EPSILON;
+
+#ifndef DISABLE_SSE
+	__m128 tx0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.min_x), ray.origin_x), ray.inv_dir_x);
+	__m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.max_x), ray.origin_x), ray.inv_dir_x);
+	__m128 ty0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.min_y), ray.origin_y), ray.inv_dir_y);
+	__m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.max_y), ray.origin_y), ray.inv_dir_y);
+	__m128 tz0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.min_z), ray.origin_z), ray.inv_dir_z);
+	__m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.max_z), ray.origin_z), ray.inv_dir_z);
+
+	__m128 t0 = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx0, tx1), _mm_min_ps(ty0, ty1)), _mm_max_ps(_mm_min_ps(tz0, tz1), _mm_setzero_ps()));
+	__m128 t1 = _mm_min_ps(_mm_max_ps(tx0, tx1), _mm_min_ps(_mm_max_ps(ty0, ty1), _mm_max_ps(tz0, tz1)));
+	t1 = _mm_min_ps(_mm_mul_ps(t1, _mm_set1_ps(far_scale)), _mm_set1_ps(tmax));
+
+	_mm_storeu_ps(tnear, t0);
+	return _mm_movemask_ps(_mm_cmple_ps(t0, t1)) & ((1 << node.child_count) - 1);
+#else
+	int mask = 0;
+	for (int i = 0; i < node.child_count; i++)
+	{
+		float tx0 = (node.min_x[i] - ray.start.X) * ray.inv_dir.X;
+		float tx1 = (node.max_x[i] - ray.start.X) * ray.inv_dir.X;
+		float ty0 = (node.min_y[i] - ray.start.Y) * ray.inv_dir.Y;
+		float ty1 = (node.max_y[i] - ray.start.Y) * ray.inv_dir.Y;
+		float tz0 = (node.min_z[i] - ray.start.Z) * ray.inv_dir.Z;
+		float tz1 = (node.max_z[i] - ray.start.Z) * ray.inv_dir.Z;
+
+		float t0 = std::max({ std::min(tx0, tx1), std::min(ty0, ty1), std::min(tz0, tz1), 0.0f });
+		float t1 = std::min({ std::max(tx0, tx1), std::max(ty0, ty1), std::max(tz0, tz1) });
+		t1 = std::min(t1 * far_scale, tmax);
+
+		tnear[i] = t0;
+		if (t0 <= t1)
+			mask |= 1 << i;
+	}
+	return mask;
+#endif
+}
+
+float TriangleMeshBVH4::intersect_triangle_ray(const Ray &ray, const TriangleRecord &triangle, bool cull_back_faces, float &barycentricB, float &barycentricC)
+{
+	// Moeller-Trumbore ray-triangle intersection. The edges are precomputed in the triangle record.
+
+	FVector3 P = ray.dir ^ triangle.e2;
+	float det = triangle.e1 | P;
+	if (det > -FLT_EPSILON && det < FLT_EPSILON)
+		return 1.0f;
+
+	// det is the negated dot product between the ray direction and the triangle normal
+	if (cull_back_faces && det > 0.0f)
+		return 1.0f;
+
+	float inv_det = 1.0f / det;
+	FVector3 T = ray.start - triangle.v0;
+
+	float u = (T | P) * inv_det;
+	if (u < 0.f || u > 1.f)
+		return 1.0f;
+
+	FVector3 Q = T ^ triangle.e1;
+	float v = (ray.dir | Q) * inv_det;
+	if (v < 0.f || u + v > 1.f)
+		return 1.0f;
+
+	float t = (triangle.e2 | Q) * inv_det;
+	if (t <= FLT_EPSILON)
+		return 1.0f;
+
+	barycentricB = u;
+	barycentricC = v;
+	return t;
+}
+
+template<bool any_hit>
+void TriangleMeshBVH4::traverse(const TriangleMeshBVH4 *bvh, const Ray &ray, TraceHit &hit, bool cull_back_faces, const std::function<bool(const TraceHit &hit)> *filter)
+{
+	struct StackEntry
+	{
+		int node;
+		float tnear;
 	};
 
-	int axis_order[3] = { 0, 1, 2 };
-	std::sort(axis_order, axis_order + 3, [&](int a, int b) { return axis_lengths[a] > axis_lengths[b]; });
+	StackEntry stack_buffer[256];
+	std::vector<StackEntry> stack_heap;
+	StackEntry *stack = stack_buffer;
+	if (bvh->max_stack > 256)
+	{
+		stack_heap.resize(bvh->max_stack);
+		stack = stack_heap.data();
+	}
 
-	// Try split at longest axis, then if that fails the next longest, and then the remaining one
-	int left_count, right_count;
-	FVector3 axis;
-	for (int attempt = 0; attempt < 3; attempt++)
+	int stack_size = 0;
+	stack[stack_size++] = { 0, 0.0f };
+	while (stack_size > 0)
 	{
-		// Find the split plane for axis
-		switch (axis_order[attempt])
+		StackEntry entry = stack[--stack_size];
+		if (entry.tnear > hit.fraction)
+			continue;
+
+		const Node &node = bvh->nodes[entry.node];
+		float tnear[4];
+		int mask = intersect_children(node, ray, hit.fraction, tnear);
+		if (mask == 0)
+			continue;
+
+		// Sort the children that were hit from nearest to farthest
+		int order[4];
+		int count = 0;
+		for (int i = 0; i < 4; i++)
 		{
-		default:
-		case 0: axis = FVector3(1.0f, 0.0f, 0.0f); break;
-		case 1: axis = FVector3(0.0f, 1.0f, 0.0f); break;
-		case 2: axis = FVector3(0.0f, 0.0f, 1.0f); break;
+			if (mask & (1 << i))
+			{
+				int j = count++;
+				while (j > 0 && tnear[order[j - 1]] > tnear[i])
+				{
+					order[j] = order[j - 1];
+					j--;
+				}
+				order[j] = i;
+			}
 		}
-		FVector4 plane(axis, -(median | axis)); // plane(axis, -dot(median, axis));
 
-		// Split triangles into two
-		left_count = 0;
-		right_count = 0;
-		for (int i = 0; i < num_triangles; i++)
+		// Test the leaves right away, nearest first
+		for (int i = 0; i < count; i++)
 		{
-			int triangle = triangles[i];
-			int element_index = triangle * 3;
+			int slot = order[i];
+			if (node.triangle_count[slot] == 0 || tnear[slot] > hit.fraction)
+				continue;
 
-			float side = (FVector4(centroids[triangles[i]], 1.0f) | plane); // dot(FVector4(centroids[triangles[i]], 1.0f), plane);
-			if (side >= 0.0f)
+			const TriangleRecord *leaf = bvh->triangles.data() + node.child[slot];
+			for (int j = 0; j < node.triangle_count[slot]; j++)
 			{
-				work_buffer[left_count] = triangle;
-				left_count++;
+				float baryB, baryC;
+				float t = intersect_triangle_ray(ray, leaf[j], cull_back_faces, baryB, baryC);
+				if (t < hit.fraction)
+				{
+					TraceHit candidate;
+					candidate.fraction = t;
+					candidate.triangle = leaf[j].triangle;
+					candidate.b = baryB;
+					candidate.c = baryC;
+					candidate.surface = leaf[j].surface;
+					if (!any_hit || !filter || (*filter)(candidate))
+					{
+						hit = candidate;
+						if (any_hit)
+							return;
+					}
+				}
 			}
-			else
+		}
+
+		// Push the inner nodes so that the nearest one is visited next
+		for (int i = count - 1; i >= 0; i--)
+		{
+			int slot = order[i];
+			if (node.triangle_count[slot] == 0 && tnear[slot] <= hit.fraction)
+				stack[stack_size++] = { node.child[slot], tnear[slot] };
+		}
+	}
+}
+
+int TriangleMeshBVH4::intersect_children(const Node &node, const Packet &packet, int ray_mask, int *child_masks, float *tnear)
+{
+	const float far_scale = 1.0f + 4.0f * FLT_EPSILON;
+
+	int mask = 0;
+	for (int slot = 0; slot < node.child_count; slot++)
+	{
+		child_masks[slot] = 0;
+		tnear[slot] = FLT_MAX;
+
+		// Skip the child without looking at the individual rays if it is outside the box around the packet
+		if (node.min_x[slot] > packet.bbox_max.X || node.max_x[slot] < packet.bbox_min.X ||
+			node.min_y[slot] > packet.bbox_max.Y || node.max_y[slot] < packet.bbox_min.Y ||
+			node.min_z[slot] > packet.bbox_max.Z || node.max_z[slot] < packet.bbox_min.Z)
+			continue;
+
+#ifndef DISABLE_SSE
+		__m128 min_x = _mm_set1_ps(node.min_x[slot]);
+		__m128 min_y = _mm_set1_ps(node.min_y[slot]);
+		__m128 min_z = _mm_set1_ps(node.min_z[slot]);
+		__m128 max_x = _mm_set1_ps(node.max_x[slot]);
+		__m128 max_y = _mm_set1_ps(node.max_y[slot]);
+		__m128 max_z = _mm_set1_ps(node.max_z[slot]);
+		__m128 nearest = _mm_set1_ps(FLT_MAX);
+		for (int group = 0; group < packet.group_count; group++)
+		{
+			int lanes = (ray_mask >> (group * 4)) & 0xf;
+			if (lanes == 0)
+				continue;
+
+			int i = group * 4;
+			__m128 origin_x = _mm_load_ps(packet.start_x + i);
+			__m128 origin_y = _mm_load_ps(packet.start_y + i);
+			__m128 origin_z = _mm_load_ps(packet.start_z + i);
+			__m128 inv_dir_x = _mm_load_ps(packet.inv_dir_x + i);
+			__m128 inv_dir_y = _mm_load_ps(packet.inv_dir_y + i);
+			__m128 inv_dir_z = _mm_load_ps(packet.inv_dir_z + i);
+
+			__m128 tx0 = _mm_mul_ps(_mm_sub_ps(min_x, origin_x), inv_dir_x);
+			__m128 tx1 = _mm_mul_ps(_mm_sub_ps(max_x, origin_x), inv_dir_x);
+			__m128 ty0 = _mm_mul_ps(_mm_sub_ps(min_y, origin_y), inv_dir_y);
+			__m128 ty1 = _mm_mul_ps(_mm_sub_ps(max_y, origin_y), inv_dir_y);
+			__m128 tz0 = _mm_mul_ps(_mm_sub_ps(min_z, origin_z), inv_dir_z);
+			__m128 tz1 = _mm_mul_ps(_mm_sub_ps(max_z, origin_z), inv_dir_z);
+
+			__m128 t0 = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx0, tx1), _mm_min_ps(ty0, ty1)), _mm_max_ps(_mm_min_ps(tz0, tz1), _mm_setzero_ps()));
+			__m128 t1 = _mm_min_ps(_mm_max_ps(tx0, tx1), _mm_min_ps(_mm_max_ps(ty0, ty1), _mm_max_ps(tz0, tz1)));
+			t1 = _mm_min_ps(_mm_mul_ps(t1, _mm_set1_ps(far_scale)), _mm_load_ps(packet.tmax + i));
+
+			__m128 hit = _mm_cmple_ps(t0, t1);
+			int hits = _mm_movemask_ps(hit) & lanes;
+			if (hits == 0)
+				continue;
+
+			static const int lane_bits[16][4] =
 			{
-				work_buffer[num_triangles + right_count] = triangle;
-				right_count++;
+				{ 0, 0, 0, 0 }, { -1, 0, 0, 0 }, { 0, -1, 0, 0 }, { -1, -1, 0, 0 },
+				{ 0, 0, -1, 0 }, { -1, 0, -1, 0 }, { 0, -1, -1, 0 }, { -1, -1, -1, 0 },
+				{ 0, 0, 0, -1 }, { -1, 0, 0, -1 }, { 0, -1, 0, -1 }, { -1, -1, 0, -1 },
+				{ 0, 0, -1, -1 }, { -1, 0, -1, -1 }, { 0, -1, -1, -1 }, { -1, -1, -1, -1 }
+			};
+			__m128 active = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*)lane_bits[hits]));
+			nearest = _mm_min_ps(nearest, _mm_or_ps(_mm_and_ps(active, t0), _mm_andnot_ps(active, _mm_set1_ps(FLT_MAX))));
+			child_masks[slot] |= hits << i;
+		}
+
+		if (child_masks[slot] != 0)
+		{
+			nearest = _mm_min_ps(nearest, _mm_shuffle_ps(nearest, nearest, _MM_SHUFFLE(1, 0, 3, 2)));
+			nearest = _mm_min_ps(nearest, _mm_shuffle_ps(nearest, nearest, _MM_SHUFFLE(2, 3, 0, 1)));
+			tnear[slot] = _mm_cvtss_f32(nearest);
+			mask |= 1 << slot;
+		}
+#else
+		for (int i = 0; i < packet.count; i++)
+		{
+			if ((ray_mask & (1 << i)) == 0)
+				continue;
+
+			float tx0 = (node.min_x[slot] - packet.start_x[i]) * packet.inv_dir_x[i];
+			float tx1 = (node.max_x[slot] - packet.start_x[i]) * packet.inv_dir_x[i];
+			float ty0 = (node.min_y[slot] - packet.start_y[i]) * packet.inv_dir_y[i];
+			float ty1 = (node.max_y[slot] - packet.start_y[i]) * packet.inv_dir_y[i];
+			float tz0 = (node.min_z[slot] - packet.start_z[i]) * packet.inv_dir_z[i];
+			float tz1 = (node.max_z[slot] - packet.start_z[i]) * packet.inv_dir_z[i];
+
+			float t0 = std::max({ std::min(tx0, tx1), std::min(ty0, ty1), std::min(tz0, tz1), 0.0f });
+			float t1 = std::min({ std::max(tx0, tx1), std::max(ty0, ty1), std::max(tz0, tz1) });
+			t1 = std::min(t1 * far_scale, packet.tmax[i]);
+
+			if (t0 <= t1)
+			{
+				child_masks[slot] |= 1 << i;
+				tnear[slot] = std::min(tnear[slot], t0);
 			}
 		}
+		if (child_masks[slot] != 0)
+			mask |= 1 << slot;
+#endif
+	}
+	return mask;
+}
 
-		if (left_count != 0 && right_count != 0)
-			break;
+int TriangleMeshBVH4::intersect_triangle_packet(const Packet &packet, int group, const TriangleRecord &triangle, bool cull_back_faces, float *t, float *barycentricB, float *barycentricC)
+{
+	// intersect_triangle_ray for four rays at once. Returns the lanes that hit the triangle closer than their current hit.
+
+	int i = group * 4;
+#ifndef DISABLE_SSE
+	__m128 dir_x = _mm_load_ps(packet.dir_x + i);
+	__m128 dir_y = _mm_load_ps(packet.dir_y + i);
+	__m128 dir_z = _mm_load_ps(packet.dir_z + i);
+	__m128 e1_x = _mm_set1_ps(triangle.e1.X);
+	__m128 e1_y = _mm_set1_ps(triangle.e1.Y);
+	__m128 e1_z = _mm_set1_ps(triangle.e1.Z);
+	__m128 e2_x = _mm_set1_ps(triangle.e2.X);
+	__m128 e2_y = _mm_set1_ps(triangle.e2.Y);
+	__m128 e2_z = _mm_set1_ps(triangle.e2.Z);
+
+	// P = dir ^ e2
+	__m128 P_x = _mm_sub_ps(_mm_mul_ps(dir_y, e2_z), _mm_mul_ps(dir_z, e2_y));
+	__m128 P_y = _mm_sub_ps(_mm_mul_ps(dir_z, e2_x), _mm_mul_ps(dir_x, e2_z));
+	__m128 P_z = _mm_sub_ps(_mm_mul_ps(dir_x, e2_y), _mm_mul_ps(dir_y, e2_x));
+
+	__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1_x, P_x), _mm_mul_ps(e1_y, P_y)), _mm_mul_ps(e1_z, P_z));
+	__m128 valid = _mm_or_ps(_mm_cmple_ps(det, _mm_set1_ps(-FLT_EPSILON)), _mm_cmpge_ps(det, _mm_set1_ps(FLT_EPSILON)));
+	if (cull_back_faces)
+		valid = _mm_and_ps(valid, _mm_cmple_ps(det, _mm_setzero_ps()));
+	if (_mm_movemask_ps(valid) == 0)
+		return 0;
+
+	__m128 inv_det = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+	// T = start - v0
+	__m128 T_x = _mm_sub_ps(_mm_load_ps(packet.start_x + i), _mm_set1_ps(triangle.v0.X));
+	__m128 T_y = _mm_sub_ps(_mm_load_ps(packet.start_y + i), _mm_set1_ps(triangle.v0.Y));
+	__m128 T_z = _mm_sub_ps(_mm_load_ps(packet.start_z + i), _mm_set1_ps(triangle.v0.Z));
+
+	__m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(T_x, P_x), _mm_mul_ps(T_y, P_y)), _mm_mul_ps(T_z, P_z)), inv_det);
+	valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(u, _mm_setzero_ps()), _mm_cmple_ps(u, _mm_set1_ps(1.0f))));
+	if (_mm_movemask_ps(valid) == 0)
+		return 0;
+
+	// Q = T ^ e1
+	__m128 Q_x = _mm_sub_ps(_mm_mul_ps(T_y, e1_z), _mm_mul_ps(T_z, e1_y));
+	__m128 Q_y = _mm_sub_ps(_mm_mul_ps(T_z, e1_x), _mm_mul_ps(T_x, e1_z));
+	__m128 Q_z = _mm_sub_ps(_mm_mul_ps(T_x, e1_y), _mm_mul_ps(T_y, e1_x));
+
+	__m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dir_x, Q_x), _mm_mul_ps(dir_y, Q_y)), _mm_mul_ps(dir_z, Q_z)), inv_det);
+	valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(v, _mm_setzero_ps()), _mm_cmple_ps(_mm_add_ps(u, v), _mm_set1_ps(1.0f))));
+
+	__m128 dist = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2_x, Q_x), _mm_mul_ps(e2_y, Q_y)), _mm_mul_ps(e2_z, Q_z)), inv_det);
+	valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpgt_ps(dist, _mm_set1_ps(FLT_EPSILON)), _mm_cmplt_ps(dist, _mm_load_ps(packet.tmax + i))));
+
+	_mm_storeu_ps(t, dist);
+	_mm_storeu_ps(barycentricB, u);
+	_mm_storeu_ps(barycentricC, v);
+	return _mm_movemask_ps(valid);
+#else
+	int mask = 0;
+	for (int lane = 0; lane < 4; lane++)
+	{
+		Ray ray(FVector3(packet.start_x[i + lane], packet.start_y[i + lane], packet.start_z[i + lane]), FVector3(packet.start_x[i + lane] + packet.dir_x[i + lane], packet.start_y[i + lane] + packet.dir_y[i + lane], packet.start_z[i + lane] + packet.dir_z[i + lane]));
+		ray.dir = FVector3(packet.dir_x[i + lane], packet.dir_y[i + lane], packet.dir_z[i + lane]);
+		t[lane] = intersect_triangle_ray(ray, triangle, cull_back_faces, barycentricB[lane], barycentricC[lane]);
+		if (t[lane] < packet.tmax[i + lane])
+			mask |= 1 << lane;
 	}
+	return mask;
+#endif
+}
+
+template<bool any_hit>
+void TriangleMeshBVH4::traverse_packet(const TriangleMeshBVH4 *bvh, Packet &packet, TraceHit *hits, bool cull_back_faces, const std::function<bool(int ray, const TraceHit &hit)> *filter)
+{
+	// Same walk as traverse, except that each stack entry remembers which rays hit the node
+
+	struct StackEntry
+	{
+		int node;
+		int ray_mask;
+	};
 
-	// Check if something went wrong when splitting and do a random split instead
-	if (left_count == 0 || right_count == 0)
+	StackEntry stack_buffer[256];
+	std::vector<StackEntry> stack_heap;
+	StackEntry *stack = stack_buffer;
+	if (bvh->max_stack > 256)
 	{
-		left_count = num_triangles / 2;
-		right_count = num_triangles - left_count;
+		stack_heap.resize(bvh->max_stack);
+		stack = stack_heap.data();
 	}
-	else
+
+	int active = (1 << packet.count) - 1; // Rays still looking for a hit
+	int stack_size = 0;
+	stack[stack_size++] = { 0, active };
+	while (stack_size > 0)
+	{
+		StackEntry entry = stack[--stack_size];
+		int ray_mask = entry.ray_mask & active;
+		if (ray_mask == 0)
+			continue;
+
+		const Node &node = bvh->nodes[entry.node];
+		int child_masks[4];
+		float tnear[4];
+		int mask = intersect_children(node, packet, ray_mask, child_masks, tnear);
+		if (mask == 0)
+			continue;
+
+		// Sort the children that were hit from nearest to farthest, using the nearest ray of each
+		int order[4];
+		int count = 0;
+		for (int i = 0; i < 4; i++)
+		{
+			if (mask & (1 << i))
+			{
+				int j = count++;
+				while (j > 0 && tnear[order[j - 1]] > tnear[i])
+				{
+					order[j] = order[j - 1];
+					j--;
+				}
+				order[j] = i;
+			}
+		}
+
+		// Test the leaves right away, nearest first
+		for (int i = 0; i < count; i++)
+		{
+			int slot = order[i];
+			if (node.triangle_count[slot] == 0)
+				continue;
+
+			const TriangleRecord *leaf = bvh->triangles.data() + node.child[slot];
+			for (int j = 0; j < node.triangle_count[slot]; j++)
+			{
+				int leaf_rays = child_masks[slot] & active;
+				for (int group = 0; group < packet.group_count; group++)
+				{
+					int lanes = (leaf_rays >> (group * 4)) & 0xf;
+					if (lanes == 0)
+						continue;
+
+					float t[4], baryB[4], baryC[4];
+					lanes &= intersect_triangle_packet(packet, group, leaf[j], cull_back_faces, t, baryB, baryC);
+					for (int lane = 0; lanes != 0; lane++, lanes >>= 1)
+					{
+						if ((lanes & 1) == 0)
+							continue;
+
+						int ray = group * 4 + lane;
+						TraceHit candidate;
+						candidate.fraction = t[lane];
+						candidate.triangle = leaf[j].triangle;
+						candidate.b = baryB[lane];
+						candidate.c = baryC[lane];
+						candidate.surface = leaf[j].surface;
+						if (!any_hit || !filter || (*filter)(ray, candidate))
+						{
+							hits[ray] = candidate;
+							if (any_hit)
+								active &= ~(1 << ray);
+							else
+								packet.tmax[ray] = t[lane];
+						}
+					}
+				}
+			}
+			if (active == 0)
+				return;
+		}
+
+		// Push the inner nodes so that the nearest one is visited next
+		for (int i = count - 1; i >= 0; i--)
+		{
+			int slot = order[i];
+			if (node.triangle_count[slot] == 0)
+				stack[stack_size++] = { node.child[slot], child_masks[slot] };
+		}
+	}
+}
+
+bool TriangleMeshBVH4::find_any_hit(const TriangleMeshBVH4 *bvh, const FVector3 &ray_start, const FVector3 &ray_end)
+{
+	if (bvh->nodes.empty())
+		return false;
+
+	TraceHit hit;
+	traverse<true>(bvh, Ray(ray_start, ray_end), hit, false, nullptr);
+	return hit.triangle != -1;
+}
+
+bool TriangleMeshBVH4::find_any_hit(const TriangleMeshBVH4 *bvh, const FVector3 &ray_start, const FVector3 &ray_end, const std::function<bool(const TraceHit &hit)> &filter)
+{
+	if (bvh->nodes.empty())
+		return false;
+
+	TraceHit hit;
+	traverse<true>(bvh, Ray(ray_start, ray_end), hit, false, &filter);
+	return hit.triangle != -1;
+}
+
+TraceHit TriangleMeshBVH4::find_first_hit(const TriangleMeshBVH4 *bvh, const FVector3 &ray_start, const FVector3 &ray_end, bool cull_back_faces)
+{
+	TraceHit hit;
+	if (!bvh->nodes.empty())
+		traverse<false>(bvh, Ray(ray_start, ray_end), hit, cull_back_faces, nullptr);
+	return hit;
+}
+
+void TriangleMeshBVH4::find_first_hit(const TriangleMeshBVH4 *bvh, const FVector3 *ray_start, const FVector3 *ray_end, int count, TraceHit *hits, bool cull_back_faces)
+{
+	for (int i = 0; i < count; i++)
+		hits[i] = TraceHit();
+
+	for (int i = 0; i < count && !bvh->nodes.empty(); i += max_packet_size)
 	{
-		// Move result back into triangles list:
-		for (int i = 0; i < left_count; i++)
-			triangles[i] = work_buffer[i];
-		for (int i = 0; i < right_count; i++)
-			triangles[i + left_count] = work_buffer[num_triangles + i];
+		int packet_size = std::min(count - i, max_packet_size);
+		Packet packet(ray_start + i, ray_end + i, packet_size);
+		traverse_packet<false>(bvh, packet, hits + i, cull_back_faces, nullptr);
 	}
+}
 
-	// Create child nodes:
-	int left_index = -1;
-	int right_index = -1;
-	if (left_count > 0)
-		left_index = subdivide(triangles, left_count, centroids, work_buffer);
-	if (right_count > 0)
-		right_index = subdivide(triangles + left_count, right_count, centroids, work_buffer);
+void TriangleMeshBVH4::find_any_hit(const TriangleMeshBVH4 *bvh, const FVector3 *ray_start, const FVector3 *ray_end, int count, TraceHit *hits, const std::function<bool(int ray, const TraceHit &hit)> &filter)
+{
+	for (int i = 0; i < count; i++)
+		hits[i] = TraceHit();
 
-	nodes.push_back(Node(min, max, left_index, right_index));
-	return (int)nodes.size() - 1;
+	for (int i = 0; i < count && !bvh->nodes.empty(); i += max_packet_size)
+	{
+		int packet_size = std::min(count - i, max_packet_size);
+		Packet packet(ray_start + i, ray_end + i, packet_size);
+		if (i == 0)
+		{
+			traverse_packet<true>(bvh, packet, hits, false, &filter);
+		}
+		else
+		{
+			// The filter gets the ray index within the whole list
+			std::function<bool(int ray, const TraceHit &hit)> offset_filter = [&](int ray, const TraceHit &hit) { return filter(i + ray, hit); };
+			traverse_packet<true>(bvh, packet, hits + i, false, &offset_filter);
+		}
+	}
 }
 
 /////////////////////////////////////////////////////////////////////////////
@@ -785,7 +1377,7 @@ static const uint32_t clearsignbitmask[] = { 0x7fffffff, 0x7fffffff, 0x7fffffff,
 
 IntersectionTest::OverlapResult IntersectionTest::ray_aabb(const RayBBox &ray, const CollisionBBox &aabb)
 {
-#ifndef NO_SSE
+#ifndef DISABLE_SSE
 
 	__m128 v = _mm_loadu_ps(&ray.v.X);
 	__m128 w = _mm_loadu_ps(&ray.w.X);
@@ -25,6 +25,8 @@
 #include "framework/vectors.h"
 #include "flatvertices.h"
 #include <vector>
+#include <utility>
+#include <functional>
 #include <cmath>
 
 class SphereShape
@@ -43,6 +45,7 @@ struct TraceHit
 	int triangle = -1;
 	float b = 0.0f;
 	float c = 0.0f;
+	int surface = -1; // Only filled in by TriangleMeshBVH4
 };
 
 class CollisionBBox
@@ -100,25 +103,23 @@ public:
 
 	static bool find_any_hit(TriangleMeshShape *shape1, TriangleMeshShape *shape2);
 	static bool find_any_hit(TriangleMeshShape *shape1, SphereShape *shape2);
-	static bool find_any_hit(TriangleMeshShape *shape, const FVector3 &ray_start, const FVector3 &ray_end);
 
 	static std::vector<int> find_all_hits(TriangleMeshShape* shape1, SphereShape* shape2);
 
-	static TraceHit find_first_hit(TriangleMeshShape *shape, const FVector3 &ray_start, const FVector3 &ray_end);
-
 	struct Node
 	{
 		Node() = default;
-		Node(const FVector3 &aabb_min, const FVector3 &aabb_max, int element_index) : aabb(aabb_min, aabb_max), element_index(element_index) { }
-		Node(const FVector3 &aabb_min, const FVector3 &aabb_max, int left, int right) : aabb(aabb_min, aabb_max), left(left), right(right) { }
+		Node(const FVector3 &aabb_min, const FVector3 &aabb_max) : aabb(aabb_min, aabb_max) { }
 
 		CollisionBBox aabb;
 		int left = -1;
 		int right = -1;
-		int element_index = -1;
+		int triangle_start = -1; // Leaf nodes: first entry in the triangles list
+		int triangle_count = 0;
 	};
 
 	const std::vector<Node>& get_nodes() const { return nodes; }
+	const std::vector<int>& get_triangles() const { return triangles; }
 	int get_root() const { return root; }
 
 private:
@@ -128,34 +129,105 @@ private:
 	int num_elements = 0;
 
 	std::vector<Node> nodes;
+	std::vector<int> triangles; // Triangle indices in leaf order
 	int root = -1;
 
+	struct TriangleBounds
+	{
+		FVector3 min, max, centroid;
+	};
+
 	static float sweep(TriangleMeshShape *shape1, SphereShape *shape2, int a, const FVector3 &target);
 
 	static bool find_any_hit(TriangleMeshShape *shape1, TriangleMeshShape *shape2, int a, int b);
 	static bool find_any_hit(TriangleMeshShape *shape1, SphereShape *shape2, int a);
-	static bool find_any_hit(TriangleMeshShape *shape1, const RayBBox &ray, int a);
 
 	static void find_all_hits(TriangleMeshShape* shape1, SphereShape* shape2, int a, std::vector<int>& hits);
 
-	static void find_first_hit(TriangleMeshShape *shape1, const RayBBox &ray, int a, TraceHit *hit);
-
-	inline static bool overlap_bv_ray(TriangleMeshShape *shape, const RayBBox &ray, int a);
-	inline static float intersect_triangle_ray(TriangleMeshShape *shape, const RayBBox &ray, int a, float &barycentricB, float &barycentricC);
-
 	inline static bool sweep_overlap_bv_sphere(TriangleMeshShape *shape1, SphereShape *shape2, int a, const FVector3 &target);
-	inline static float sweep_intersect_triangle_sphere(TriangleMeshShape *shape1, SphereShape *shape2, int a, const FVector3 &target);
+	inline static float sweep_intersect_triangle_sphere(TriangleMeshShape *shape1, SphereShape *shape2, int triangle, const FVector3 &target);
 
 	inline static bool overlap_bv(TriangleMeshShape *shape1, TriangleMeshShape *shape2, int a, int b);
 	inline static bool overlap_bv_triangle(TriangleMeshShape *shape1, TriangleMeshShape *shape2, int a, int b);
 	inline static bool overlap_bv_sphere(TriangleMeshShape *shape1, SphereShape *shape2, int a);
 	inline static bool overlap_triangle_triangle(TriangleMeshShape *shape1, TriangleMeshShape *shape2, int a, int b);
-	inline static bool overlap_triangle_sphere(TriangleMeshShape *shape1, SphereShape *shape2, int a);
+	inline static bool overlap_triangle_sphere(TriangleMeshShape *shape1, SphereShape *shape2, int triangle);
 
 	inline bool is_leaf(int node_index);
 	inline float volume(int node_index);
 
-	int subdivide(int *triangles, int num_triangles, const FVector3 *centroids, int *work_buffer);
+	int subdivide(std::vector<Node> &out_nodes, int start, int count, const TriangleBounds *bounds, std::vector<std::pair<int, int>> *subtrees, int subtree_size);
+
+	friend class TriangleMeshBVH4;
+};
+
+// Four-wide version of the TriangleMeshShape tree for ray queries on the CPU.
+// The binary tree is collapsed so that each node has up to four children, with the child bounds
+// stored per axis so that one SSE slab test covers all of them. Closest children are visited first.
+class TriangleMeshBVH4
+{
+public:
+	TriangleMeshBVH4(const TriangleMeshShape *shape, const int *surface_indexes, int num_surface_indexes);
+
+	static bool find_any_hit(const TriangleMeshBVH4 *bvh, const FVector3 &ray_start, const FVector3 &ray_end);
+
+	// Back face culling skips the triangles where (v1 - v0) ^ (v2 - v0) points away from the ray direction
+	static TraceHit find_first_hit(const TriangleMeshBVH4 *bvh, const FVector3 &ray_start, const FVector3 &ray_end, bool cull_back_faces = false);
+
+	// Calls filter for the hits along the ray, in no particular order, until it accepts one by returning true
+	static bool find_any_hit(const TriangleMeshBVH4 *bvh, const FVector3 &ray_start, const FVector3 &ray_end, const std::function<bool(const TraceHit &hit)> &filter);
+
+	// Ray packets. The rays are traced together with one walk through the tree, testing four rays at a time against
+	// each box and triangle. This is faster than tracing them one by one when they mostly visit the same nodes,
+	// like the shadow rays from a texel towards an area light.
+	static constexpr int max_packet_size = 16;
+	static void find_first_hit(const TriangleMeshBVH4 *bvh, const FVector3 *ray_start, const FVector3 *ray_end, int count, TraceHit *hits, bool cull_back_faces = false);
+	static void find_any_hit(const TriangleMeshBVH4 *bvh, const FVector3 *ray_start, const FVector3 *ray_end, int count, TraceHit *hits, const std::function<bool(int ray, const TraceHit &hit)> &filter);
+
+	struct alignas(16) Node
+	{
+		float min_x[4] = { }, min_y[4] = { }, min_z[4] = { };
+		float max_x[4] = { }, max_y[4] = { }, max_z[4] = { };
+		int child[4] = { -1, -1, -1, -1 }; // Inner children: node index. Leaves: first entry in the triangles list
+		int triangle_count[4] = { }; // Zero for inner children
+		int child_count = 0;
+	};
+
+	const std::vector<Node>& get_nodes() const { return nodes; }
+
+private:
+	struct Ray;
+	struct Packet;
+
+	// Triangle positions with the edges already calculated, so that a leaf test doesn't have to go through the index and vertex buffers.
+	// A leaf reads its records as one run of up to four, so they are packed at 48 bytes rather than padded to a cache line each.
+	// Padding to 64 bytes made the CPU bake no faster and the records a third larger.
+	struct alignas(16) TriangleRecord
+	{
+		FVector3 v0;
+		FVector3 e1;
+		FVector3 e2;
+		int triangle;
+		int surface;
+	};
+
+	std::vector<Node> nodes;
+	std::vector<TriangleRecord> triangles; // In leaf order
+	int max_stack = 0;
+
+	int collapse(const TriangleMeshShape *shape, int binary_node, int depth);
+
+	static int intersect_children(const Node &node, const Ray &ray, float tmax, float *tnear);
+	static float intersect_triangle_ray(const Ray &ray, const TriangleRecord &triangle, bool cull_back_faces, float &barycentricB, float &barycentricC);
+
+	static int intersect_children(const Node &node, const Packet &packet, int ray_mask, int *child_masks, float *tnear);
+	static int intersect_triangle_packet(const Packet &packet, int group, const TriangleRecord &triangle, bool cull_back_faces, float *t, float *barycentricB, float *barycentricC);
+
+	template<bool any_hit>
+	static void traverse(const TriangleMeshBVH4 *bvh, const Ray &ray, TraceHit &hit, bool cull_back_faces, const std::function<bool(const TraceHit &hit)> *filter);
+
+	template<bool any_hit>
+	static void traverse_packet(const TriangleMeshBVH4 *bvh, Packet &packet, TraceHit *hits, bool cull_back_faces, const std::function<bool(int ray, const TraceHit &hit)> *filter);
 };
 
 class IntersectionTest
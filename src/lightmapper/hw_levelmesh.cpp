@@ -1,5 +1,15 @@
 
 #include "hw_levelmesh.h"
+#include "framework/worker.h"
+#include "framework/halffloat.h"
+#include <algorithm>
+#include <cfloat>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
 
 LevelMesh::LevelMesh()
 {
@@ -54,14 +64,14 @@ LevelMeshSurface* LevelMesh::Trace(const FVector3& start, FVector3 direction, fl
 	{
 		FVector3 end = origin + direction * maxDist;
 
-		TraceHit hit = TriangleMeshShape::find_first_hit(Collision.get(), origin, end);
+		TraceHit hit = TriangleMeshBVH4::find_first_hit(CollisionBVH4.get(), origin, end);
 
 		if (hit.triangle < 0)
 		{
 			return nullptr;
 		}
 
-		hitSurface = GetSurface(Mesh.SurfaceIndexes[hit.triangle]);
+		hitSurface = GetSurface(hit.surface);
 
 		int portal = hitSurface->PortalIndex;
 		if (!portal)
@@ -108,6 +118,75 @@ LevelMeshTileStats LevelMesh::GatherTilePixelStats()
 void LevelMesh::UpdateCollision()
 {
 	Collision = std::make_unique<TriangleMeshShape>(Mesh.Vertices.Data(), Mesh.Vertices.Size(), Mesh.Indexes.Data(), Mesh.Indexes.Size());
+	CollisionBVH4 = std::make_unique<TriangleMeshBVH4>(Collision.get(), Mesh.SurfaceIndexes.Data(), Mesh.SurfaceIndexes.Size());
+}
+
+namespace
+{
+	// Lights in a leaf of a light tree. The lightmapper checks the lights of a leaf one by one.
+	const int LightTreeLeafSize = 4;
+
+	// Adds the subtree for the lights in indexes[start, start + count) and sorts them into the order of its leaves
+	void BuildLightTree(const TArray<LevelMeshLight>& lights, TArray<int32_t>& indexes, int start, int count, TArray<LevelMeshLightNode>& nodes)
+	{
+		LevelMeshLightNode node;
+		node.BoundsMin = FVector3(FLT_MAX, FLT_MAX, FLT_MAX);
+		node.BoundsMax = FVector3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+		node.MaxRadius = 0.0f;
+		node.MaxPower = 0.0f;
+		node.LightStart = start;
+		node.LightCount = count;
+		for (int i = start; i < start + count; i++)
+		{
+			const LevelMeshLight& light = lights[indexes[i]];
+			for (int axis = 0; axis < 3; axis++)
+			{
+				node.BoundsMin[axis] = std::min(node.BoundsMin[axis], light.RelativeOrigin[axis]);
+				node.BoundsMax[axis] = std::max(node.BoundsMax[axis], light.RelativeOrigin[axis]);
+			}
+			node.MaxRadius = std::max(node.MaxRadius, light.Radius);
+			node.MaxPower = std::max(node.MaxPower, std::abs(light.Intensity) * (light.Color.X + light.Color.Y + light.Color.Z));
+		}
+
+		unsigned int nodeIndex = nodes.Push(node);
+		if (count > LightTreeLeafSize)
+		{
+			// Median split on the longest axis
+			FVector3 extent = node.BoundsMax - node.BoundsMin;
+			int axis = (extent.X >= extent.Y && extent.X >= extent.Z) ? 0 : (extent.Y >= extent.Z) ? 1 : 2;
+			int half = count / 2;
+			std::nth_element(&indexes[start], &indexes[start + half], &indexes[start] + count, [&](int32_t a, int32_t b) { return lights[a].RelativeOrigin[axis] < lights[b].RelativeOrigin[axis]; });
+
+			BuildLightTree(lights, indexes, start, half, nodes);
+			BuildLightTree(lights, indexes, start + half, count - half, nodes);
+		}
+		nodes[nodeIndex].Skip = nodes.Size();
+	}
+}
+
+void LevelMesh::BuildLightTrees()
+{
+	int surfaceCount = GetSurfaceCount();
+	std::vector<TArray<LevelMeshLightNode>> surfaceNodes(surfaceCount);
+	Worker::RunJob(surfaceCount, [&](int i) {
+		LevelMeshSurface* surface = GetSurface(i);
+		if (surface->LightList.Count > 0)
+			BuildLightTree(Mesh.Lights, Mesh.LightIndexes, surface->LightList.Pos, surface->LightList.Count, surfaceNodes[i]);
+	});
+
+	Mesh.LightNodes.Clear();
+	for (int i = 0; i < surfaceCount; i++)
+	{
+		LevelMeshSurface* surface = GetSurface(i);
+		int nodePos = Mesh.LightNodes.Size();
+		surface->LightList.NodePos = nodePos;
+		surface->LightList.NodeCount = surfaceNodes[i].Size();
+		for (LevelMeshLightNode node : surfaceNodes[i])
+		{
+			node.Skip += nodePos;
+			Mesh.LightNodes.Push(node);
+		}
+	}
 }
 
 struct LevelMeshPlaneGroup
@@ -115,36 +194,189 @@ struct LevelMeshPlaneGroup
 	FVector4 plane = FVector4(0, 0, 1, 0);
 	int sectorGroup = 0;
 	std::vector<LevelMeshSurface*> surfaces;
+
+	// Surfaces sorted into a 2D grid on the two axes that the tiles in this plane project onto
+	int gridAxis = -1; // LightmapTile::PlaneAxis of the grid, or -1 if the group has no grid
+	int gridSize = 0;
+	FVector2 gridMin = FVector2(0.0f, 0.0f);
+	FVector2 gridCellSize = FVector2(1.0f, 1.0f);
+	std::vector<int> cellStart; // gridSize * gridSize + 1 entries into cellSurfaces
+	std::vector<int> cellSurfaces; // Index into the surfaces list
 };
 
+namespace
+{
+	// The world axes that the tile U and V coordinates follow for a LightmapTile::PlaneAxis
+	void GetTileAxes(int planeAxis, int& axisU, int& axisV)
+	{
+		axisU = (planeAxis == LightmapTile::AXIS_YZ) ? 1 : 0;
+		axisV = (planeAxis == LightmapTile::AXIS_XY) ? 1 : 2;
+	}
+
+	void BuildPlaneGroupGrid(LevelMeshPlaneGroup& group)
+	{
+		int axisU, axisV;
+		int planeAxis = LightmapTile::BestAxis(group.plane);
+		GetTileAxes(planeAxis, axisU, axisV);
+
+		FVector2 minPos(FLT_MAX, FLT_MAX);
+		FVector2 maxPos(-FLT_MAX, -FLT_MAX);
+		for (LevelMeshSurface* surface : group.surfaces)
+		{
+			minPos.X = std::min(minPos.X, surface->Bounds.min[axisU]);
+			minPos.Y = std::min(minPos.Y, surface->Bounds.min[axisV]);
+			maxPos.X = std::max(maxPos.X, surface->Bounds.max[axisU]);
+			maxPos.Y = std::max(maxPos.Y, surface->Bounds.max[axisV]);
+		}
+		if (!std::isfinite(minPos.X) || !std::isfinite(minPos.Y) || !std::isfinite(maxPos.X) || !std::isfinite(maxPos.Y))
+			return;
+
+		int gridSize = std::clamp((int)std::ceil(std::sqrt((float)group.surfaces.size())), 1, 256);
+		FVector2 cellSize(std::max((maxPos.X - minPos.X) / gridSize, 1.0f), std::max((maxPos.Y - minPos.Y) / gridSize, 1.0f));
+
+		auto forEachCell = [&](int index, auto&& callback)
+		{
+			const BBox& bounds = group.surfaces[index]->Bounds;
+			int x0 = std::clamp((int)((bounds.min[axisU] - minPos.X) / cellSize.X), 0, gridSize - 1);
+			int y0 = std::clamp((int)((bounds.min[axisV] - minPos.Y) / cellSize.Y), 0, gridSize - 1);
+			int x1 = std::clamp((int)((bounds.max[axisU] - minPos.X) / cellSize.X), 0, gridSize - 1);
+			int y1 = std::clamp((int)((bounds.max[axisV] - minPos.Y) / cellSize.Y), 0, gridSize - 1);
+			for (int y = y0; y <= y1; y++)
+			{
+				for (int x = x0; x <= x1; x++)
+					callback(x + y * gridSize);
+			}
+		};
+
+		std::vector<int> cellCount(gridSize * gridSize, 0);
+		for (int i = 0, count = (int)group.surfaces.size(); i < count; i++)
+			forEachCell(i, [&](int cell) { cellCount[cell]++; });
+
+		group.cellStart.resize(gridSize * gridSize + 1);
+		group.cellStart[0] = 0;
+		for (int i = 0; i < gridSize * gridSize; i++)
+			group.cellStart[i + 1] = group.cellStart[i] + cellCount[i];
+
+		group.cellSurfaces.resize(group.cellStart.back());
+		std::vector<int> cellPos(group.cellStart.begin(), group.cellStart.end() - 1);
+		for (int i = 0, count = (int)group.surfaces.size(); i < count; i++)
+			forEachCell(i, [&](int cell) { group.cellSurfaces[cellPos[cell]++] = i; });
+
+		group.gridAxis = planeAxis;
+		group.gridSize = gridSize;
+		group.gridMin = minPos;
+		group.gridCellSize = cellSize;
+	}
+
+	// Finds the group surfaces that may be visible in the tile, plus the target surface, in the order of the group
+	void FindPlaneGroupCandidates(const LevelMeshPlaneGroup& group, const LightmapTile* tile, int target, std::vector<int>& candidates)
+	{
+		candidates.clear();
+
+		int axisU = 0, axisV = 0;
+		float scaleU = 0.0f, scaleV = 0.0f;
+		if (group.gridAxis != -1 && LightmapTile::BestAxis(tile->Plane) == group.gridAxis)
+		{
+			GetTileAxes(group.gridAxis, axisU, axisV);
+			scaleU = tile->Transform.ProjLocalToU[axisU];
+			scaleV = tile->Transform.ProjLocalToV[axisV];
+		}
+		if (!(scaleU > 0.0f) || !(scaleV > 0.0f))
+		{
+			for (int i = 0, count = (int)group.surfaces.size(); i < count; i++)
+				candidates.push_back(i);
+			return;
+		}
+
+		// The area covered by the tile, with a texel of margin for rounding errors
+		float minU = tile->Transform.TranslateWorldToLocal[axisU] - 1.0f / scaleU;
+		float minV = tile->Transform.TranslateWorldToLocal[axisV] - 1.0f / scaleV;
+		float maxU = tile->Transform.TranslateWorldToLocal[axisU] + (tile->AtlasLocation.Width + 1.0f) / scaleU;
+		float maxV = tile->Transform.TranslateWorldToLocal[axisV] + (tile->AtlasLocation.Height + 1.0f) / scaleV;
+
+		candidates.push_back(target);
+
+		int gridSize = group.gridSize;
+		int x0 = std::clamp((int)std::floor((minU - group.gridMin.X) / group.gridCellSize.X), 0, gridSize - 1);
+		int y0 = std::clamp((int)std::floor((minV - group.gridMin.Y) / group.gridCellSize.Y), 0, gridSize - 1);
+		int x1 = std::clamp((int)std::floor((maxU - group.gridMin.X) / group.gridCellSize.X), 0, gridSize - 1);
+		int y1 = std::clamp((int)std::floor((maxV - group.gridMin.Y) / group.gridCellSize.Y), 0, gridSize - 1);
+		for (int y = y0; y <= y1; y++)
+		{
+			for (int x = x0; x <= x1; x++)
+			{
+				int cell = x + y * gridSize;
+				candidates.insert(candidates.end(), group.cellSurfaces.begin() + group.cellStart[cell], group.cellSurfaces.begin() + group.cellStart[cell + 1]);
+			}
+		}
+
+		std::sort(candidates.begin(), candidates.end());
+		candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+	}
+}
+
 void LevelMesh::BuildTileSurfaceLists()
 {
+	int surfaceCount = GetSurfaceCount();
+
 	// Plane group surface is to be rendered with
-	TArray<LevelMeshPlaneGroup> PlaneGroups;
-	TArray<int> PlaneGroupIndexes(GetSurfaceCount());
+	std::vector<LevelMeshPlaneGroup> PlaneGroups;
+	std::vector<int> PlaneGroupIndexes(surfaceCount);
+	std::vector<int> PlaneGroupSlots(surfaceCount); // Position of the surface in its group
+
+	// The plane groups are hashed on their sector group and quantized plane. Each group goes into the neighbouring
+	// buckets as well, so that a surface finds all the groups within the tolerances below by looking in its own bucket.
+	// The cell sizes assume unit length plane normals.
+	float maxPlaneDistance = 0.0f;
+	for (int i = 0; i < surfaceCount; i++)
+	{
+		float distance = std::abs(GetSurface(i)->Plane.W);
+		if (std::isfinite(distance))
+			maxPlaneDistance = std::max(maxPlaneDistance, distance);
+	}
+	const float normalCellSize = 0.1f;
+	const float distanceCellSize = 1.0f + 0.002f * maxPlaneDistance;
 
-	for (int i = 0, count = GetSurfaceCount(); i < count; i++)
+	auto getPlaneKey = [&](const FVector4& plane, int sectorGroup, int offsetX, int offsetY, int offsetZ, int offsetW) -> uint64_t
+	{
+		uint64_t x = (uint8_t)((int)std::floor(plane.X / normalCellSize) + offsetX);
+		uint64_t y = (uint8_t)((int)std::floor(plane.Y / normalCellSize) + offsetY);
+		uint64_t z = (uint8_t)((int)std::floor(plane.Z / normalCellSize) + offsetZ);
+		uint64_t w = (uint16_t)((int)std::floor(plane.W / distanceCellSize) + offsetW);
+		return ((uint64_t)(uint32_t)sectorGroup << 40) | (x << 32) | (y << 24) | (z << 16) | w;
+	};
+
+	std::unordered_map<uint64_t, std::vector<int>> planeBuckets;
+	for (int i = 0; i < surfaceCount; i++)
 	{
 		auto surface = GetSurface(i);
 
+		// A plane with NaNs can't be in the same plane as anything
+		const FVector4& plane = surface->Plane;
+		bool hashable = std::isfinite(plane.X) && std::isfinite(plane.Y) && std::isfinite(plane.Z) && std::isfinite(plane.W);
+
 		// Is this surface in the same plane as an existing plane group?
 		int planeGroupIndex = -1;
 
-		for (size_t j = 0; j < PlaneGroups.Size(); j++)
+		auto bucket = hashable ? planeBuckets.find(getPlaneKey(plane, surface->SectorGroup, 0, 0, 0, 0)) : planeBuckets.end();
+		if (bucket != planeBuckets.end())
 		{
-			if (surface->SectorGroup == PlaneGroups[j].sectorGroup)
+			for (int j : bucket->second)
 			{
-				float direction = PlaneGroups[j].plane.XYZ() | surface->Plane.XYZ();
-				if (direction >= 0.999f && direction <= 1.01f)
+				if (surface->SectorGroup == PlaneGroups[j].sectorGroup)
 				{
-					auto point = (surface->Plane.XYZ() * surface->Plane.W);
-					auto planeDistance = (PlaneGroups[j].plane.XYZ() | point) - PlaneGroups[j].plane.W;
-
-					float dist = std::abs(planeDistance);
-					if (dist <= 0.1f)
+					float direction = PlaneGroups[j].plane.XYZ() | surface->Plane.XYZ();
+					if (direction >= 0.999f && direction <= 1.01f)
 					{
-						planeGroupIndex = (int)j;
-						break;
+						auto point = (surface->Plane.XYZ() * surface->Plane.W);
+						auto planeDistance = (PlaneGroups[j].plane.XYZ() | point) - PlaneGroups[j].plane.W;
+
+						float dist = std::abs(planeDistance);
+						if (dist <= 0.1f)
+						{
+							planeGroupIndex = j;
+							break;
+						}
 					}
 				}
 			}
@@ -153,37 +385,64 @@ void LevelMesh::BuildTileSurfaceLists()
 		// Surface is in a new plane. Create a plane group for it
 		if (planeGroupIndex == -1)
 		{
-			planeGroupIndex = PlaneGroups.Size();
+			planeGroupIndex = (int)PlaneGroups.size();
 
 			LevelMeshPlaneGroup group;
 			group.plane = surface->Plane;
 			group.sectorGroup = surface->SectorGroup;
-			PlaneGroups.Push(group);
+			PlaneGroups.push_back(std::move(group));
+
+			if (hashable)
+			{
+				for (int w = -1; w <= 1; w++)
+					for (int z = -1; z <= 1; z++)
+						for (int y = -1; y <= 1; y++)
+							for (int x = -1; x <= 1; x++)
+								planeBuckets[getPlaneKey(plane, surface->SectorGroup, x, y, z, w)].push_back(planeGroupIndex);
+			}
 		}
 
+		PlaneGroupSlots[i] = (int)PlaneGroups[planeGroupIndex].surfaces.size();
 		PlaneGroups[planeGroupIndex].surfaces.push_back(surface);
-		PlaneGroupIndexes.Push(planeGroupIndex);
+		PlaneGroupIndexes[i] = planeGroupIndex;
 	}
 
-	for (auto& tile : LightmapTiles)
-		tile.Surfaces.Clear();
+	// Only the larger groups need a grid to find the surfaces near a tile
+	Worker::RunJob((int)PlaneGroups.size(), [&](int i) {
+		if (PlaneGroups[i].surfaces.size() > 32)
+			BuildPlaneGroupGrid(PlaneGroups[i]);
+	});
 
-	for (int i = 0, count = GetSurfaceCount(); i < count; i++)
+	std::vector<std::vector<int>> tileTargetSurfaces(LightmapTiles.Size());
+	for (int i = 0; i < surfaceCount; i++)
 	{
-		LevelMeshSurface* targetSurface = GetSurface(i);
-		if (targetSurface->LightmapTileIndex < 0)
-			continue;
-		LightmapTile* tile = &LightmapTiles[targetSurface->LightmapTileIndex];
-		for (LevelMeshSurface* surface : PlaneGroups[PlaneGroupIndexes[i]].surfaces)
+		int tileIndex = GetSurface(i)->LightmapTileIndex;
+		if (tileIndex >= 0)
+			tileTargetSurfaces[tileIndex].push_back(i);
+	}
+
+	Worker::RunJob((int)LightmapTiles.Size(), [&](int tileIndex) {
+		LightmapTile* tile = &LightmapTiles[tileIndex];
+		tile->Surfaces.Clear();
+
+		std::vector<int> candidates;
+		for (int i : tileTargetSurfaces[tileIndex])
 		{
-			FVector2 minUV = tile->ToUV(surface->Bounds.min);
-			FVector2 maxUV = tile->ToUV(surface->Bounds.max);
-			if (surface != targetSurface && (maxUV.X < 0.0f || maxUV.Y < 0.0f || minUV.X > 1.0f || minUV.Y > 1.0f))
-				continue; // Bounding box not visible
+			LevelMeshSurface* targetSurface = GetSurface(i);
+			const LevelMeshPlaneGroup& group = PlaneGroups[PlaneGroupIndexes[i]];
+			FindPlaneGroupCandidates(group, tile, PlaneGroupSlots[i], candidates);
+			for (int candidate : candidates)
+			{
+				LevelMeshSurface* surface = group.surfaces[candidate];
+				FVector2 minUV = tile->ToUV(surface->Bounds.min);
+				FVector2 maxUV = tile->ToUV(surface->Bounds.max);
+				if (surface != targetSurface && (maxUV.X < 0.0f || maxUV.Y < 0.0f || minUV.X > 1.0f || minUV.Y > 1.0f))
+					continue; // Bounding box not visible
 
-			tile->Surfaces.Push(GetSurfaceIndex(surface));
+				tile->Surfaces.Push(GetSurfaceIndex(surface));
+			}
 		}
-	}
+	});
 }
 
 void LevelMesh::SetupTileTransforms()
@@ -194,30 +453,240 @@ void LevelMesh::SetupTileTransforms()
 	}
 }
 
+namespace
+{
+	// Where a tile ended up in the lightmap atlas
+	struct AtlasPlacement
+	{
+		int X = 0;
+		int Y = 0;
+		int Page = 0;
+	};
+
+	// Skyline packer with any number of pages. Each tile goes into the first page it fits in.
+	class SkylineAtlasPacker
+	{
+	public:
+		enum class Heuristic
+		{
+			BottomLeft, // Place where the top edge of the tile ends up lowest
+			MinWaste    // Place where the least space is lost below the tile
+		};
+
+		SkylineAtlasPacker(int pageSize, Heuristic heuristic) : PageSize(pageSize), Fit(heuristic)
+		{
+		}
+
+		AtlasPlacement Insert(int width, int height)
+		{
+			for (size_t i = 0; i < Pages.size(); i++)
+			{
+				AtlasPlacement placement;
+				if (Insert(Pages[i], width, height, placement))
+				{
+					placement.Page = (int)i;
+					return placement;
+				}
+			}
+
+			Pages.push_back(Page());
+			Pages.back().Skyline.push_back({ 0, 0, PageSize });
+
+			AtlasPlacement placement;
+			if (!Insert(Pages.back(), width, height, placement))
+				throw std::runtime_error("Lightmap tile is too big for the lightmap texture");
+			placement.Page = (int)Pages.size() - 1;
+			return placement;
+		}
+
+		int GetPageCount() const { return (int)Pages.size(); }
+
+	private:
+		struct Segment
+		{
+			int X, Y, Width;
+		};
+
+		struct Page
+		{
+			std::vector<Segment> Skyline;
+			int MinY = 0; // Lowest point of the skyline
+		};
+
+		bool Insert(Page& page, int width, int height, AtlasPlacement& placement)
+		{
+			// Nothing fits on top of the lowest point
+			if (height > PageSize - page.MinY)
+				return false;
+
+			int64_t bestWaste = INT64_MAX;
+			int bestTop = INT_MAX, bestX = 0, bestSegment = -1;
+			for (int i = 0, count = (int)page.Skyline.size(); i < count; i++)
+			{
+				int y = FitSegment(page, i, width, height);
+				if (y == -1)
+					continue;
+
+				int64_t waste = Fit == Heuristic::MinWaste ? GetWastedArea(page, i, width, y) : 0;
+				if (waste < bestWaste || (waste == bestWaste && (y + height < bestTop || (y + height == bestTop && page.Skyline[i].X < bestX))))
+				{
+					bestWaste = waste;
+					bestTop = y + height;
+					bestX = page.Skyline[i].X;
+					bestSegment = i;
+				}
+			}
+			if (bestSegment == -1)
+				return false;
+
+			placement.X = bestX;
+			placement.Y = bestTop - height;
+			AddSkylineLevel(page, bestSegment, bestX, bestTop, width);
+			return true;
+		}
+
+		// Returns the height the rectangle would be placed at if its left edge is at the start of the segment, or -1 if it doesn't fit
+		int FitSegment(const Page& page, int index, int width, int height) const
+		{
+			if (page.Skyline[index].X + width > PageSize)
+				return -1;
+
+			int y = 0;
+			int widthLeft = width;
+			for (int i = index; widthLeft > 0; i++)
+			{
+				y = std::max(y, page.Skyline[i].Y);
+				if (y + height > PageSize)
+					return -1;
+				widthLeft -= page.Skyline[i].Width;
+			}
+			return y;
+		}
+
+		// Area between the skyline and the bottom of a rectangle placed at the start of the segment
+		int64_t GetWastedArea(const Page& page, int index, int width, int y) const
+		{
+			int64_t waste = 0;
+			for (int i = index; width > 0; i++)
+			{
+				int segmentWidth = std::min(width, page.Skyline[i].Width);
+				waste += (int64_t)(y - page.Skyline[i].Y) * segmentWidth;
+				width -= segmentWidth;
+			}
+			return waste;
+		}
+
+		void AddSkylineLevel(Page& page, int index, int x, int y, int width)
+		{
+			std::vector<Segment>& skyline = page.Skyline;
+			skyline.insert(skyline.begin() + index, { x, y, width });
+
+			// Cut the segments now covered by the new one
+			for (size_t i = index + 1; i < skyline.size(); i++)
+			{
+				int shrink = skyline[i - 1].X + skyline[i - 1].Width - skyline[i].X;
+				if (shrink <= 0)
+					break;
+
+				skyline[i].X += shrink;
+				skyline[i].Width -= shrink;
+				if (skyline[i].Width > 0)
+					break;
+
+				skyline.erase(skyline.begin() + i);
+				i--;
+			}
+
+			// Merge neighbours at the same height
+			for (size_t i = 0; i + 1 < skyline.size(); i++)
+			{
+				if (skyline[i].Y == skyline[i + 1].Y)
+				{
+					skyline[i].Width += skyline[i + 1].Width;
+					skyline.erase(skyline.begin() + i + 1);
+					i--;
+				}
+			}
+
+			page.MinY = PageSize;
+			for (const Segment& segment : skyline)
+				page.MinY = std::min(page.MinY, segment.Y);
+		}
+
+		int PageSize;
+		Heuristic Fit;
+		std::vector<Page> Pages;
+	};
+}
+
 void LevelMesh::PackLightmapAtlas(int lightmapStartIndex)
 {
-	std::vector<LightmapTile*> sortedTiles;
-	sortedTiles.reserve(LightmapTiles.Size());
+	int tileCount = LightmapTiles.Size();
 
-	for (auto& tile : LightmapTiles)
+	// Tallest tiles first. This keeps the skyline flat as tiles of the same height end up next to each other.
+	std::vector<int> sortedTiles(tileCount);
+	uint64_t tilePixels = 0;
+	for (int i = 0; i < tileCount; i++)
 	{
-		sortedTiles.push_back(&tile);
+		sortedTiles[i] = i;
+		tilePixels += LightmapTiles[i].AtlasLocation.Area();
 	}
-
-	std::sort(sortedTiles.begin(), sortedTiles.end(), [](LightmapTile* a, LightmapTile* b) { return a->AtlasLocation.Height != b->AtlasLocation.Height ? a->AtlasLocation.Height > b->AtlasLocation.Height : a->AtlasLocation.Width > b->AtlasLocation.Width; });
+	std::sort(sortedTiles.begin(), sortedTiles.end(), [&](int a, int b) {
+		const auto& la = LightmapTiles[a].AtlasLocation;
+		const auto& lb = LightmapTiles[b].AtlasLocation;
+		return la.Height != lb.Height ? la.Height > lb.Height : la.Width > lb.Width;
+	});
 
 	// We do not need to add spacing here as this is already built into the tile size itself.
-	RectPacker packer(LMTextureSize, LMTextureSize, RectPacker::Spacing(0), RectPacker::Padding(0));
+	auto pack = [&](SkylineAtlasPacker::Heuristic heuristic, std::vector<AtlasPlacement>& placements) {
+		SkylineAtlasPacker packer(LMTextureSize, heuristic);
+		placements.resize(tileCount);
+		for (int i : sortedTiles)
+			placements[i] = packer.Insert(LightmapTiles[i].AtlasLocation.Width, LightmapTiles[i].AtlasLocation.Height);
+		return packer.GetPageCount();
+	};
+
+	std::vector<AtlasPlacement> bestPlacements;
+	int bestPageCount = pack(SkylineAtlasPacker::Heuristic::BottomLeft, bestPlacements);
 
-	for (LightmapTile* tile : sortedTiles)
+	// Second pass with the slower heuristic if there are pages we could still get rid of
+	uint64_t pageArea = (uint64_t)LMTextureSize * LMTextureSize;
+	int minPageCount = (int)((tilePixels + pageArea - 1) / pageArea);
+	if (bestPageCount > minPageCount)
 	{
-		auto result = packer.insert(tile->AtlasLocation.Width, tile->AtlasLocation.Height);
-		tile->AtlasLocation.X = result.pos.x;
-		tile->AtlasLocation.Y = result.pos.y;
-		tile->AtlasLocation.ArrayIndex = lightmapStartIndex + (int)result.pageIndex;
+		std::vector<AtlasPlacement> placements;
+		int pageCount = pack(SkylineAtlasPacker::Heuristic::MinWaste, placements);
+		if (pageCount < bestPageCount)
+		{
+			bestPageCount = pageCount;
+			bestPlacements = std::move(placements);
+		}
+	}
+
+	std::vector<uint64_t> pagePixels(bestPageCount, 0);
+	for (int i = 0; i < tileCount; i++)
+	{
+		LightmapTile& tile = LightmapTiles[i];
+		const AtlasPlacement& placement = bestPlacements[i];
+		tile.AtlasLocation.X = placement.X;
+		tile.AtlasLocation.Y = placement.Y;
+		tile.AtlasLocation.ArrayIndex = lightmapStartIndex + placement.Page;
+		pagePixels[placement.Page] += tile.AtlasLocation.Area();
 	}
 
-	LMTextureCount = (int)packer.getNumPages();
+	LMTextureCount = bestPageCount;
+
+	if (LMTextureCount > 0)
+	{
+		uint64_t totalPixels = 0;
+		std::string fill;
+		for (int i = 0; i < LMTextureCount; i++)
+		{
+			totalPixels += pagePixels[i];
+			fill += std::to_string((int)std::round(pagePixels[i] * 100.0 / pageArea)) + (i + 1 < LMTextureCount ? "% " : "%");
+		}
+		printf("   Lightmap atlas: %d pages, %.1f%% filled (%s)\n", LMTextureCount, totalPixels * 100.0 / (pageArea * LMTextureCount), fill.c_str());
+	}
 
 	// Calculate final texture coordinates
 	for (int i = 0, count = GetSurfaceCount(); i < count; i++)
@@ -283,3 +752,114 @@ void LevelMesh::PackLightmapAtlas(int lightmapStartIndex)
 	}
 #endif
 }
+
+void LevelMesh::CollapseUniformTiles(float tolerance)
+{
+	int tileCount = LightmapTiles.Size();
+
+	// A tile is uniform when no channel varies more than the tolerance times its brightest texel (or 0.1 for dark tiles)
+	std::vector<FVector4> uniformColors(tileCount);
+	std::vector<uint8_t> uniform(tileCount, 0);
+	Worker::RunJob(tileCount, [&](int i) {
+		const LightmapTile& tile = LightmapTiles[i];
+		const auto& location = tile.AtlasLocation;
+		const uint16_t* pixels = LMTextureData.Data() + (size_t)location.ArrayIndex * LMTextureSize * LMTextureSize * 4;
+
+		FVector4 minColor(FLT_MAX, FLT_MAX, FLT_MAX, FLT_MAX), maxColor(-FLT_MAX, -FLT_MAX, -FLT_MAX, -FLT_MAX);
+		std::vector<float> line(location.Width * 4);
+		for (int y = 0; y < location.Height; y++)
+		{
+			halfToFloat(pixels + (location.X + (size_t)(location.Y + y) * LMTextureSize) * 4, line.data(), line.size());
+			for (int x = 0; x < location.Width; x++)
+			{
+				FVector4 color(line[x * 4], line[x * 4 + 1], line[x * 4 + 2], line[x * 4 + 3]);
+				minColor = FVector4(std::min(minColor.X, color.X), std::min(minColor.Y, color.Y), std::min(minColor.Z, color.Z), std::min(minColor.W, color.W));
+				maxColor = FVector4(std::max(maxColor.X, color.X), std::max(maxColor.Y, color.Y), std::max(maxColor.Z, color.Z), std::max(maxColor.W, color.W));
+			}
+		}
+
+		float brightest = std::max(std::max(maxColor.X, maxColor.Y), maxColor.Z);
+		float limit = tolerance * std::max(brightest, 0.1f);
+		if (maxColor.X - minColor.X <= limit && maxColor.Y - minColor.Y <= limit && maxColor.Z - minColor.Z <= limit)
+		{
+			uniform[i] = 1;
+			uniformColors[i] = (minColor + maxColor) * 0.5f;
+		}
+	});
+
+	int collapsedCount = 0;
+	uint64_t collapsedPixels = 0;
+	for (int i = 0; i < tileCount; i++)
+	{
+		if (uniform[i] && LightmapTiles[i].AtlasLocation.Area() > 4)
+		{
+			collapsedCount++;
+			collapsedPixels += LightmapTiles[i].AtlasLocation.Area();
+		}
+		else
+		{
+			uniform[i] = 0;
+		}
+	}
+	if (collapsedCount == 0)
+		return;
+
+	printf("   Collapsing %d uniform lightmap tiles (%llu texels)\n", collapsedCount, (unsigned long long)collapsedPixels);
+
+	// Shrink the uniform tiles to 2x2. The surface is mapped onto the square between the four texel centers,
+	// so that the linear sampler never reads outside the tile.
+	std::vector<decltype(LightmapTile::AtlasLocation)> oldLocations(tileCount);
+	for (int i = 0; i < tileCount; i++)
+	{
+		oldLocations[i] = LightmapTiles[i].AtlasLocation;
+		if (!uniform[i])
+			continue;
+
+		LightmapTile& tile = LightmapTiles[i];
+		FVector3 projU = tile.Transform.ProjLocalToU / (float)tile.AtlasLocation.Width;
+		FVector3 projV = tile.Transform.ProjLocalToV / (float)tile.AtlasLocation.Height;
+
+		// U and V run along different axes, so each half texel offset only moves its own coordinate
+		tile.Transform.TranslateWorldToLocal -= projU * (0.5f / (projU | projU)) + projV * (0.5f / (projV | projV));
+		tile.Transform.ProjLocalToU = projU;
+		tile.Transform.ProjLocalToV = projV;
+		tile.AtlasLocation.Width = 2;
+		tile.AtlasLocation.Height = 2;
+	}
+
+	PackLightmapAtlas(0);
+
+	// Move the texels into the new atlas
+	TArray<uint16_t> oldTextureData;
+	oldTextureData.Swap(LMTextureData);
+	LMTextureData.Resize(LMTextureSize * LMTextureSize * LMTextureCount * 4);
+	memset(LMTextureData.Data(), 0, LMTextureData.Size() * sizeof(uint16_t));
+
+	Worker::RunJob(tileCount, [&](int i) {
+		const auto& src = oldLocations[i];
+		const auto& dest = LightmapTiles[i].AtlasLocation;
+		const uint16_t* srcPixels = oldTextureData.Data() + (size_t)src.ArrayIndex * LMTextureSize * LMTextureSize * 4;
+		uint16_t* destPixels = LMTextureData.Data() + (size_t)dest.ArrayIndex * LMTextureSize * LMTextureSize * 4;
+
+		if (uniform[i])
+		{
+			const FVector4& color = uniformColors[i];
+			uint16_t texel[4] = { floatToHalf(color.X), floatToHalf(color.Y), floatToHalf(color.Z), floatToHalf(color.W) };
+			for (int y = 0; y < 2; y++)
+			{
+				for (int x = 0; x < 2; x++)
+					memcpy(destPixels + (dest.X + x + (size_t)(dest.Y + y) * LMTextureSize) * 4, texel, sizeof(texel));
+			}
+		}
+		else
+		{
+			for (int y = 0; y < dest.Height; y++)
+			{
+				memcpy(
+					destPixels + (dest.X + (size_t)(dest.Y + y) * LMTextureSize) * 4,
+					srcPixels + (src.X + (size_t)(src.Y + y) * LMTextureSize) * 4,
+					dest.Width * 4 * sizeof(uint16_t));
+			}
+		}
+	});
+}
@@ -58,6 +58,7 @@ public:
 
 		// Lights
 		TArray<LevelMeshLight> Lights;
+		TArray<LevelMeshLightNode> LightNodes;
 
 		// Index data
 		TArray<uint32_t> Indexes;
@@ -76,6 +77,7 @@ public:
 	} Mesh;
 
 	std::unique_ptr<TriangleMeshShape> Collision;
+	std::unique_ptr<TriangleMeshBVH4> CollisionBVH4; // For ray queries on the CPU
 
 	TArray<LevelSubmeshDrawRange> DrawList;
 	TArray<LevelSubmeshDrawRange> PortalList;
@@ -92,10 +94,14 @@ public:
 	uint32_t AtlasPixelCount() const { return uint32_t(LMTextureCount * LMTextureSize * LMTextureSize); }
 
 	void UpdateCollision();
+	void BuildLightTrees();
 	void BuildTileSurfaceLists();
 	void SetupTileTransforms();
 	void PackLightmapAtlas(int lightmapStartIndex);
 
+	// Shrinks the baked tiles whose texels are all about the same color to 2x2 and packs the atlas again
+	void CollapseUniformTiles(float tolerance);
+
 	void AddEmptyMesh();
 };
 
@@ -17,3 +17,16 @@ public:
 	int SectorGroup;
 	float SoftShadowRadius;
 };
+
+// Node in the light tree of a surface. The tree sorts the light list of the surface so that every node
+// covers a range of it, and stores the nodes depth first with the right child at the Skip of the left one.
+struct LevelMeshLightNode
+{
+	FVector3 BoundsMin; // Bounds of the RelativeOrigin of the lights
+	FVector3 BoundsMax;
+	float MaxRadius;
+	float MaxPower; // Largest Intensity * (R + G + B)
+	int LightStart; // Position in LightIndexes
+	int LightCount;
+	int Skip; // Next node after this subtree. A leaf has no children when this is the node after it.
+};
@@ -39,6 +39,8 @@ struct LevelMeshSurface
 	{
 		int Pos = 0;
 		int Count = 0;
+		int NodePos = 0; // Light tree in LevelMesh::Mesh.LightNodes
+		int NodeCount = 0;
 	} LightList;
 
 	TArray<ThingLight*> Lights;
@@ -0,0 +1,493 @@
+
+#include "hw_lightmapcache.h"
+#include "hw_levelmesh.h"
+#include "framework/file.h"
+#include "framework/worker.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+extern bool lm_ao;
+extern bool lm_softshadows;
+extern bool lm_sunlight;
+extern bool lm_blur;
+extern bool lm_bounce;
+extern bool lm_adaptive;
+extern float lm_lightcutoff;
+extern int lm_lightbudget;
+extern int lm_radiosity;
+extern int lm_aosamples;
+extern int lm_bouncesamples;
+extern int lm_softshadowsamples;
+extern bool lm_denoise;
+
+namespace
+{
+	// Change this whenever the lightmapper bakes something different for the same input
+	const uint32_t CacheVersion = 1;
+	const uint32_t CacheMagic = 0x434d4c5a; // ZLMC
+
+	// How far from a texel the lightmapper looks for ambient occlusion and bounce light
+	const float AODistance = 100.0f;
+	const float BounceDistance = 1000.0f;
+
+	// Sun rays spread out a little for the soft shadows. This is more than they do.
+	const float SunSpread = 0.01f;
+
+	// Size of the cells in the grid that the hashes of the occluders are summed up in
+	const float OccluderCellSize = 256.0f;
+
+	struct InputHash
+	{
+		uint64_t Value = 0xcbf29ce484222325ull;
+
+		void Add(const void* data, size_t size)
+		{
+			const uint8_t* bytes = (const uint8_t*)data;
+			for (size_t i = 0; i < size; i++)
+			{
+				Value ^= bytes[i];
+				Value *= 0x100000001b3ull;
+			}
+		}
+
+		void Add(uint32_t value) { Add(&value, sizeof(uint32_t)); }
+		void Add(uint64_t value) { Add(&value, sizeof(uint64_t)); }
+		void Add(float value) { Add(&value, sizeof(float)); }
+		void Add(const FVector3& v) { Add(v.X); Add(v.Y); Add(v.Z); }
+		void Add(const FVector4& v) { Add(v.X); Add(v.Y); Add(v.Z); Add(v.W); }
+
+		// The occluder hashes are summed up, which needs every bit of the hash to depend on every byte
+		uint64_t Finish() const
+		{
+			uint64_t h = Value;
+			h ^= h >> 33;
+			h *= 0xff51afd7ed558ccdull;
+			h ^= h >> 33;
+			h *= 0xc4ceb9fe1a85ec53ull;
+			h ^= h >> 33;
+			return h;
+		}
+	};
+
+	void AddSurfaceHash(InputHash& hash, const LevelMeshSurface* surface)
+	{
+		hash.Add((uint32_t)surface->Texture.GetIndex());
+		hash.Add(surface->Alpha);
+		hash.Add((uint32_t)surface->IsSky);
+		hash.Add((uint32_t)surface->PortalIndex);
+	}
+
+	BBox Union(const BBox& a, const BBox& b)
+	{
+		BBox box;
+		box.min = FVector3(std::min(a.min.X, b.min.X), std::min(a.min.Y, b.min.Y), std::min(a.min.Z, b.min.Z));
+		box.max = FVector3(std::max(a.max.X, b.max.X), std::max(a.max.Y, b.max.Y), std::max(a.max.Z, b.max.Z));
+		return box;
+	}
+
+	// Hashes of the triangles in a 2D grid over the map, as a summed area table so any box of cells can be hashed in constant time
+	class OccluderGrid
+	{
+	public:
+		OccluderGrid(LevelMesh* mesh)
+		{
+			const auto& vertices = mesh->Mesh.Vertices;
+			const auto& indexes = mesh->Mesh.Indexes;
+
+			Bounds.Clear();
+			for (unsigned int i = 0; i < indexes.Size(); i++)
+				Bounds.AddPoint(vertices[indexes[i]].fPos());
+			if (indexes.Size() == 0)
+				Bounds = BBox(FVector3(0.0f, 0.0f, 0.0f), FVector3(0.0f, 0.0f, 0.0f));
+
+			Width = (int)std::floor((Bounds.max.X - Bounds.min.X) / OccluderCellSize) + 1;
+			Height = (int)std::floor((Bounds.max.Y - Bounds.min.Y) / OccluderCellSize) + 1;
+
+			std::vector<uint64_t> cells(Width * Height, 0);
+			for (unsigned int i = 0; i + 2 < indexes.Size(); i += 3)
+			{
+				InputHash hash;
+				FVector3 v[3];
+				for (int j = 0; j < 3; j++)
+				{
+					v[j] = vertices[indexes[i + j]].fPos();
+					hash.Add(v[j]);
+				}
+				int surfaceIndex = mesh->Mesh.SurfaceIndexes[i / 3];
+				if (surfaceIndex >= 0)
+					AddSurfaceHash(hash, mesh->GetSurface(surfaceIndex));
+				uint64_t triangleHash = hash.Finish();
+
+				int x0 = GetCellX(std::min({ v[0].X, v[1].X, v[2].X }));
+				int x1 = GetCellX(std::max({ v[0].X, v[1].X, v[2].X }));
+				int y0 = GetCellY(std::min({ v[0].Y, v[1].Y, v[2].Y }));
+				int y1 = GetCellY(std::max({ v[0].Y, v[1].Y, v[2].Y }));
+				for (int y = y0; y <= y1; y++)
+				{
+					for (int x = x0; x <= x1; x++)
+						cells[x + y * Width] += triangleHash;
+				}
+			}
+
+			Sums.resize((Width + 1) * (Height + 1), 0);
+			for (int y = 0; y < Height; y++)
+			{
+				for (int x = 0; x < Width; x++)
+					Sums[(x + 1) + (y + 1) * (Width + 1)] = cells[x + y * Width] + Sums[x + (y + 1) * (Width + 1)] + Sums[(x + 1) + y * (Width + 1)] - Sums[x + y * (Width + 1)];
+			}
+		}
+
+		// Hash of all the triangles overlapping the cells that the box overlaps
+		uint64_t GetHash(const BBox& box) const
+		{
+			int x0 = GetCellX(box.min.X);
+			int x1 = GetCellX(box.max.X) + 1;
+			int y0 = GetCellY(box.min.Y);
+			int y1 = GetCellY(box.max.Y) + 1;
+			return Sums[x1 + y1 * (Width + 1)] - Sums[x0 + y1 * (Width + 1)] - Sums[x1 + y0 * (Width + 1)] + Sums[x0 + y0 * (Width + 1)];
+		}
+
+		BBox Bounds;
+
+	private:
+		int GetCellX(float x) const { return std::clamp((int)std::floor((x - Bounds.min.X) / OccluderCellSize), 0, Width - 1); }
+		int GetCellY(float y) const { return std::clamp((int)std::floor((y - Bounds.min.Y) / OccluderCellSize), 0, Height - 1); }
+
+		int Width = 0;
+		int Height = 0;
+		std::vector<uint64_t> Sums;
+	};
+
+	// Reads the cache file and throws if it is cut short
+	class CacheReader
+	{
+	public:
+		CacheReader(const std::vector<uint8_t>& data) : data(data) {}
+
+		void Read(void* dest, size_t size)
+		{
+			if (size > data.size() - pos)
+				throw std::runtime_error("unexpected end of file");
+			memcpy(dest, data.data() + pos, size);
+			pos += size;
+		}
+
+		uint16_t Read16() { uint16_t v; Read(&v, sizeof(uint16_t)); return v; }
+		uint32_t Read32() { uint32_t v; Read(&v, sizeof(uint32_t)); return v; }
+		uint64_t Read64() { uint64_t v; Read(&v, sizeof(uint64_t)); return v; }
+
+	private:
+		const std::vector<uint8_t>& data;
+		size_t pos = 0;
+	};
+
+	class CacheWriter
+	{
+	public:
+		void Write(const void* src, size_t size)
+		{
+			const uint8_t* bytes = (const uint8_t*)src;
+			Data.insert(Data.end(), bytes, bytes + size);
+		}
+
+		void Write16(uint16_t v) { Write(&v, sizeof(uint16_t)); }
+		void Write32(uint32_t v) { Write(&v, sizeof(uint32_t)); }
+		void Write64(uint64_t v) { Write(&v, sizeof(uint64_t)); }
+
+		std::vector<uint8_t> Data;
+	};
+}
+
+void LightmapCache::Load(const std::string& filename, const std::string& mapName, bool cpu)
+{
+	cpuRaytracer = cpu;
+	maps.clear();
+	currentMap = mapName;
+
+	std::vector<uint8_t> data;
+	try
+	{
+		data = File::read_all_bytes(filename);
+	}
+	catch (const std::exception&)
+	{
+		printf("   Lightmap cache %s not found. It will be created.\n", filename.c_str());
+		return;
+	}
+
+	try
+	{
+		CacheReader reader(data);
+		if (reader.Read32() != CacheMagic)
+			throw std::runtime_error("not a lightmap cache");
+		if (reader.Read32() != CacheVersion)
+			throw std::runtime_error("made by a different version of the lightmapper");
+
+		uint32_t mapCount = reader.Read32();
+		for (uint32_t i = 0; i < mapCount; i++)
+		{
+			std::string name(reader.Read32(), '\0');
+			reader.Read(name.data(), name.size());
+
+			MapEntry& map = maps[name];
+			map.SettingsHash = reader.Read64();
+			uint32_t tileCount = reader.Read32();
+			for (uint32_t j = 0; j < tileCount; j++)
+			{
+				LightmapTileBinding binding;
+				binding.Type = reader.Read32();
+				binding.TypeIndex = reader.Read32();
+				binding.ControlSector = reader.Read32();
+
+				TileEntry& tile = map.Tiles[binding];
+				tile.InputHash = reader.Read64();
+				tile.Width = reader.Read16();
+				tile.Height = reader.Read16();
+				tile.Pixels.resize((size_t)tile.Width * tile.Height * 4);
+				reader.Read(tile.Pixels.data(), tile.Pixels.size() * sizeof(uint16_t));
+			}
+		}
+	}
+	catch (const std::exception& e)
+	{
+		printf("   Ignoring lightmap cache %s: %s\n", filename.c_str(), e.what());
+		maps.clear();
+	}
+}
+
+void LightmapCache::Apply(LevelMesh* mesh)
+{
+	FindTileHashes(mesh);
+
+	cachedTiles.clear();
+	auto it = maps.find(currentMap);
+	if (it != maps.end() && it->second.SettingsHash == GetSettingsHash(mesh))
+	{
+		for (unsigned int i = 0; i < mesh->LightmapTiles.Size(); i++)
+		{
+			LightmapTile& tile = mesh->LightmapTiles[i];
+			if (tileHashes[i] == 0 || tile.AtlasLocation.ArrayIndex == -1)
+				continue;
+
+			auto entry = it->second.Tiles.find(tile.Binding);
+			if (entry != it->second.Tiles.end() && entry->second.InputHash == tileHashes[i] && entry->second.Width == tile.AtlasLocation.Width && entry->second.Height == tile.AtlasLocation.Height)
+			{
+				cachedTiles.push_back(i);
+				tile.NeedsUpdate = false;
+			}
+		}
+	}
+
+	printf("   Lightmap cache: %d of %d tiles unchanged\n", (int)cachedTiles.size(), (int)mesh->LightmapTiles.Size());
+
+	CopyCachedTiles(mesh);
+}
+
+void LightmapCache::CopyCachedTiles(LevelMesh* mesh)
+{
+	if (cachedTiles.empty())
+		return;
+
+	size_t textureDataSize = (size_t)mesh->LMTextureSize * mesh->LMTextureSize * mesh->LMTextureCount * 4;
+	if (mesh->LMTextureData.Size() != textureDataSize)
+	{
+		mesh->LMTextureData.Resize(textureDataSize);
+		memset(mesh->LMTextureData.Data(), 0, textureDataSize * sizeof(uint16_t));
+	}
+
+	const MapEntry& map = maps[currentMap];
+	for (int tileIndex : cachedTiles)
+	{
+		const LightmapTile& tile = mesh->LightmapTiles[tileIndex];
+		const TileEntry& entry = map.Tiles.find(tile.Binding)->second;
+
+		int textureSize = mesh->LMTextureSize;
+		uint16_t* dest = mesh->LMTextureData.Data() + (size_t)tile.AtlasLocation.ArrayIndex * textureSize * textureSize * 4;
+		for (int y = 0; y < entry.Height; y++)
+		{
+			uint16_t* line = dest + ((size_t)(tile.AtlasLocation.Y + y) * textureSize + tile.AtlasLocation.X) * 4;
+			memcpy(line, entry.Pixels.data() + (size_t)y * entry.Width * 4, entry.Width * 4 * sizeof(uint16_t));
+		}
+	}
+}
+
+void LightmapCache::Save(LevelMesh* mesh, const std::string& filename)
+{
+	MapEntry& map = maps[currentMap];
+	map.SettingsHash = GetSettingsHash(mesh);
+	map.Tiles.clear();
+
+	int textureSize = mesh->LMTextureSize;
+	for (unsigned int i = 0; i < mesh->LightmapTiles.Size(); i++)
+	{
+		const LightmapTile& tile = mesh->LightmapTiles[i];
+		if (tileHashes[i] == 0 || tile.AtlasLocation.ArrayIndex == -1)
+			continue;
+
+		TileEntry& entry = map.Tiles[tile.Binding];
+		entry.InputHash = tileHashes[i];
+		entry.Width = (uint16_t)tile.AtlasLocation.Width;
+		entry.Height = (uint16_t)tile.AtlasLocation.Height;
+		entry.Pixels.resize((size_t)entry.Width * entry.Height * 4);
+
+		const uint16_t* src = mesh->LMTextureData.Data() + (size_t)tile.AtlasLocation.ArrayIndex * textureSize * textureSize * 4;
+		for (int y = 0; y < entry.Height; y++)
+		{
+			const uint16_t* line = src + ((size_t)(tile.AtlasLocation.Y + y) * textureSize + tile.AtlasLocation.X) * 4;
+			memcpy(entry.Pixels.data() + (size_t)y * entry.Width * 4, line, entry.Width * 4 * sizeof(uint16_t));
+		}
+	}
+
+	CacheWriter writer;
+	writer.Write32(CacheMagic);
+	writer.Write32(CacheVersion);
+	writer.Write32((uint32_t)maps.size());
+	for (const auto& it : maps)
+	{
+		writer.Write32((uint32_t)it.first.size());
+		writer.Write(it.first.data(), it.first.size());
+		writer.Write64(it.second.SettingsHash);
+		writer.Write32((uint32_t)it.second.Tiles.size());
+		for (const auto& tile : it.second.Tiles)
+		{
+			writer.Write32(tile.first.Type);
+			writer.Write32(tile.first.TypeIndex);
+			writer.Write32(tile.first.ControlSector);
+			writer.Write64(tile.second.InputHash);
+			writer.Write16(tile.second.Width);
+			writer.Write16(tile.second.Height);
+			writer.Write(tile.second.Pixels.data(), tile.second.Pixels.size() * sizeof(uint16_t));
+		}
+	}
+
+	File::write_all_bytes(filename, writer.Data.data(), writer.Data.size());
+	printf("   Saved %d tiles to lightmap cache %s\n", (int)map.Tiles.size(), filename.c_str());
+}
+
+uint64_t LightmapCache::GetSettingsHash(LevelMesh* mesh)
+{
+	InputHash hash;
+	hash.Add((uint32_t)lm_ao);
+	hash.Add((uint32_t)lm_softshadows);
+	hash.Add((uint32_t)lm_sunlight);
+	hash.Add((uint32_t)lm_blur);
+	hash.Add((uint32_t)lm_bounce);
+	hash.Add((uint32_t)lm_adaptive);
+	hash.Add(lm_lightcutoff);
+	hash.Add((uint32_t)lm_lightbudget);
+	hash.Add((uint32_t)lm_radiosity);
+	hash.Add((uint32_t)lm_aosamples);
+	hash.Add((uint32_t)lm_bouncesamples);
+	hash.Add((uint32_t)lm_softshadowsamples);
+	hash.Add((uint32_t)lm_denoise);
+	hash.Add((uint32_t)cpuRaytracer);
+	hash.Add(mesh->SunDirection);
+	hash.Add(mesh->SunColor);
+	return hash.Finish();
+}
+
+void LightmapCache::FindTileHashes(LevelMesh* mesh)
+{
+	int tileCount = mesh->LightmapTiles.Size();
+	tileHashes.assign(tileCount, 0);
+
+	// Rays passing through a portal can end up anywhere
+	for (int i = 0, count = mesh->GetSurfaceCount(); i < count; i++)
+	{
+		if (mesh->GetSurface(i)->PortalIndex != 0)
+		{
+			printf("   Lightmap cache is not used for maps with portals\n");
+			return;
+		}
+	}
+
+	OccluderGrid occluders(mesh);
+	float mapSize = (occluders.Bounds.max - occluders.Bounds.min).Length();
+	bool useSunLight = lm_sunlight && mesh->SunColor != FVector3(0.0f, 0.0f, 0.0f);
+	float bounceDistance = lm_bounce ? BounceDistance * std::max(lm_radiosity, 1) : 0.0f;
+
+	Worker::RunJob(tileCount, [&](int tileIndex) {
+		const LightmapTile& tile = mesh->LightmapTiles[tileIndex];
+
+		InputHash hash;
+		hash.Add(tile.Binding.Type);
+		hash.Add(tile.Binding.TypeIndex);
+		hash.Add(tile.Binding.ControlSector);
+		hash.Add((uint32_t)tile.AtlasLocation.Width);
+		hash.Add((uint32_t)tile.AtlasLocation.Height);
+		hash.Add((uint32_t)tile.SampleDimension);
+		hash.Add(tile.Transform.TranslateWorldToLocal);
+		hash.Add(tile.Transform.ProjLocalToU);
+		hash.Add(tile.Transform.ProjLocalToV);
+		hash.Add(tile.Plane);
+
+		// The geometry of the tile and the lights that reach it directly
+		std::vector<int> lights;
+		for (int surfaceIndex : tile.Surfaces)
+		{
+			const LevelMeshSurface* surface = mesh->GetSurface(surfaceIndex);
+			AddSurfaceHash(hash, surface);
+			hash.Add(surface->Plane);
+			const uint32_t* elements = mesh->Mesh.Indexes.Data() + surface->MeshLocation.StartElementIndex;
+			for (unsigned int i = 0; i < surface->MeshLocation.NumElements; i++)
+				hash.Add(mesh->Mesh.Vertices[elements[i]].fPos());
+
+			for (int j = surface->LightList.Pos, end = surface->LightList.Pos + surface->LightList.Count; j < end; j++)
+				lights.push_back(mesh->Mesh.LightIndexes[j]);
+		}
+
+		// Bounce light comes from the lights of the surfaces that the bounce rays hit. Even a light too far away to
+		// add anything changes which of the other lights the light cutoff randomly skips on those surfaces.
+		if (lm_bounce)
+		{
+			BBox bounceBox = tile.Bounds + bounceDistance;
+			for (unsigned int i = 0; i < mesh->Mesh.Lights.Size(); i++)
+			{
+				const LevelMeshLight& light = mesh->Mesh.Lights[i];
+				FVector3 closest(
+					std::clamp(light.RelativeOrigin.X, bounceBox.min.X, bounceBox.max.X),
+					std::clamp(light.RelativeOrigin.Y, bounceBox.min.Y, bounceBox.max.Y),
+					std::clamp(light.RelativeOrigin.Z, bounceBox.min.Z, bounceBox.max.Z));
+				if ((closest - light.RelativeOrigin).Length() < light.Radius)
+					lights.push_back(i);
+			}
+		}
+
+		std::sort(lights.begin(), lights.end());
+		lights.erase(std::unique(lights.begin(), lights.end()), lights.end());
+
+		// Anything inside the reach of the lights can cast a shadow on the tile
+		BBox reach = tile.Bounds + AODistance;
+		for (int lightIndex : lights)
+		{
+			const LevelMeshLight& light = mesh->Mesh.Lights[lightIndex];
+			hash.Add(light.Origin);
+			hash.Add(light.RelativeOrigin);
+			hash.Add(light.Radius);
+			hash.Add(light.Intensity);
+			hash.Add(light.InnerAngleCos);
+			hash.Add(light.OuterAngleCos);
+			hash.Add(light.SpotDir);
+			hash.Add(light.Color);
+			hash.Add(light.SoftShadowRadius);
+			reach = Union(reach, BBox(light.RelativeOrigin - light.Radius, light.RelativeOrigin + light.Radius));
+		}
+
+		if (lm_bounce)
+			reach = Union(reach, tile.Bounds + bounceDistance);
+
+		// Sun light is blocked by anything between the reach and the sky
+		if (useSunLight)
+		{
+			BBox sky = BBox(reach.min + mesh->SunDirection * mapSize, reach.max + mesh->SunDirection * mapSize) + mapSize * SunSpread;
+			reach = Union(reach, sky);
+		}
+
+		hash.Add(occluders.GetHash(reach));
+
+		// Zero is for tiles that can't be cached
+		tileHashes[tileIndex] = std::max(hash.Finish(), (uint64_t)1);
+	});
+}
@@ -0,0 +1,55 @@
+
+#pragma once
+
+#include "hw_lightmaptile.h"
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+class LevelMesh;
+
+// Keeps the baked lightmap tiles of a map between runs, so that only the tiles whose inputs changed are traced again.
+//
+// A tile is found by its binding and reused when the hash of everything that can change its texels is the same.
+// That is the bake settings, the geometry of the tile, the lights reaching it and the geometry around it that can
+// cast a shadow or bounce light onto it. The hash errs on the side of tracing a tile again.
+class LightmapCache
+{
+public:
+	// Reads the entries of the map from the cache file, if there is one. The tiles of the other ray tracer are not reused.
+	void Load(const std::string& filename, const std::string& mapName, bool cpu);
+
+	// Marks the tiles that are in the cache as up to date and copies their texels into the lightmap texture
+	void Apply(LevelMesh* mesh);
+
+	// Copies the cached texels into the lightmap texture again, for ray tracers that replace the whole texture
+	void CopyCachedTiles(LevelMesh* mesh);
+
+	// Replaces the entries of the map with the tiles in the lightmap texture and writes the cache file
+	void Save(LevelMesh* mesh, const std::string& filename);
+
+private:
+	struct TileEntry
+	{
+		uint64_t InputHash = 0;
+		uint16_t Width = 0;
+		uint16_t Height = 0;
+		std::vector<uint16_t> Pixels; // RGBA half floats, like LevelMesh::LMTextureData
+	};
+
+	struct MapEntry
+	{
+		uint64_t SettingsHash = 0;
+		std::map<LightmapTileBinding, TileEntry> Tiles;
+	};
+
+	uint64_t GetSettingsHash(LevelMesh* mesh);
+	void FindTileHashes(LevelMesh* mesh);
+
+	std::map<std::string, MapEntry> maps; // Every map in the file, so that saving keeps the ones not built this time
+	std::string currentMap;
+	bool cpuRaytracer = false;
+	std::vector<uint64_t> tileHashes; // Input hash of each tile in LevelMesh::LightmapTiles, or 0 if it can't be cached
+	std::vector<int> cachedTiles;
+};
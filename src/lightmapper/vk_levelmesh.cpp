@@ -48,6 +48,7 @@ void VkLevelMesh::Reset()
 	deletelist->Add(std::move(UniformIndexBuffer));
 	deletelist->Add(std::move(IndexBuffer));
 	deletelist->Add(std::move(NodeBuffer));
+	deletelist->Add(std::move(NodeTriangleBuffer));
 	deletelist->Add(std::move(SurfaceBuffer));
 	deletelist->Add(std::move(UniformsBuffer));
 	deletelist->Add(std::move(SurfaceIndexBuffer));
@@ -220,6 +221,12 @@ void VkLevelMesh::CreateBuffers()
 		.DebugName("NodeBuffer")
 		.Create(fb->GetDevice());
 
+	NodeTriangleBuffer = BufferBuilder()
+		.Usage(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT)
+		.Size((size_t)(Mesh->Mesh.MaxIndexes / 3) * sizeof(int))
+		.DebugName("NodeTriangleBuffer")
+		.Create(fb->GetDevice());
+
 	SurfaceIndexBuffer = BufferBuilder()
 		.Usage(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT)
 		.Size(Mesh->Mesh.MaxSurfaceIndexes * sizeof(int))
@@ -545,7 +552,8 @@ void VkLevelMeshUploader::UploadNodes()
 			info.extents = SwapYZ(node.aabb.Extents);
 			info.left = node.left;
 			info.right = node.right;
-			info.element_index = node.element_index;
+			info.triangle_start = node.triangle_start;
+			info.triangle_count = node.triangle_count;
 			*(nodes++) = info;
 		}
 
@@ -554,6 +562,17 @@ void VkLevelMeshUploader::UploadNodes()
 			cmdbuffer->copyBuffer(transferBuffer.get(), Mesh->NodeBuffer.get(), datapos, sizeof(CollisionNodeBufferHeader) + range.Offset * sizeof(CollisionNode), copysize);
 		datapos += copysize;
 	}
+
+	// The leaf triangle list is rebuilt along with the nodes
+	if (Mesh->Locations.Node.Size() > 0)
+	{
+		const std::vector<int>& triangles = Mesh->Mesh->Collision->get_triangles();
+		size_t copysize = triangles.size() * sizeof(int);
+		memcpy(data + datapos, triangles.data(), copysize);
+		if (copysize > 0)
+			cmdbuffer->copyBuffer(transferBuffer.get(), Mesh->NodeTriangleBuffer.get(), datapos, 0, copysize);
+		datapos += copysize;
+	}
 }
 
 template<typename T>
@@ -687,6 +706,7 @@ size_t VkLevelMeshUploader::GetTransferSize()
 	size_t transferBufferSize = 0;
 	if (Mesh->Locations.Node.Size() > 0) transferBufferSize += sizeof(CollisionNodeBufferHeader) + sizeof(CollisionNode);
 	for (const MeshBufferRange& range : Mesh->Locations.Node) transferBufferSize += range.Size * sizeof(CollisionNode);
+	if (Mesh->Locations.Node.Size() > 0) transferBufferSize += Mesh->Mesh->Collision->get_triangles().size() * sizeof(int);
 	for (const MeshBufferRange& range : Mesh->Locations.Vertex) transferBufferSize += range.Size * sizeof(FFlatVertex);
 	for (const MeshBufferRange& range : Mesh->Locations.UniformIndexes) transferBufferSize += range.Size * sizeof(int);
 	for (const MeshBufferRange& range : Mesh->Locations.Index) transferBufferSize += range.Size * sizeof(uint32_t);
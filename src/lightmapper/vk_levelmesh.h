@@ -23,8 +23,8 @@ struct CollisionNode
 	float padding2;
 	int left;
 	int right;
-	int element_index;
-	int padding3;
+	int triangle_start;
+	int triangle_count;
 };
 
 struct SurfaceInfo
@@ -83,6 +83,7 @@ public:
 	VulkanBuffer* GetUniformIndexBuffer() { return UniformIndexBuffer.get(); }
 	VulkanBuffer* GetIndexBuffer() { return IndexBuffer.get(); }
 	VulkanBuffer* GetNodeBuffer() { return NodeBuffer.get(); }
+	VulkanBuffer* GetNodeTriangleBuffer() { return NodeTriangleBuffer.get(); }
 	VulkanBuffer* GetSurfaceIndexBuffer() { return SurfaceIndexBuffer.get(); }
 	VulkanBuffer* GetSurfaceBuffer() { return SurfaceBuffer.get(); }
 	VulkanBuffer* GetUniformsBuffer() { return UniformsBuffer.get(); }
@@ -146,6 +147,7 @@ private:
 	std::unique_ptr<VulkanBuffer> LightIndexBuffer;
 
 	std::unique_ptr<VulkanBuffer> NodeBuffer;
+	std::unique_ptr<VulkanBuffer> NodeTriangleBuffer;
 
 	BLAS StaticBLAS;
 	BLAS DynamicBLAS;
@@ -32,6 +32,14 @@ bool lm_softshadows = true;
 bool lm_sunlight = true;
 bool lm_blur = true;
 bool lm_bounce = true;
+bool lm_adaptive = true;
+float lm_lightcutoff = 0.01f;
+int lm_lightbudget = 0;
+int lm_radiosity = 0;
+int lm_aosamples = 128;
+int lm_bouncesamples = 8;
+int lm_softshadowsamples = 10;
+bool lm_denoise = false;
 
 VkLightmapper::VkLightmapper(VulkanRenderDevice* fb) : fb(fb)
 {
@@ -236,6 +244,11 @@ void VkLightmapper::UploadUniforms()
 	values.SunDir = SwapYZ(mesh->SunDirection);
 	values.SunColor = mesh->SunColor;
 	values.SunIntensity = 1.0f;
+	values.AdaptiveSampling = lm_adaptive ? 1 : 0;
+	values.LightCutoff = lm_lightcutoff;
+	values.AOSampleCount = lm_aosamples;
+	values.BounceSampleCount = lm_bouncesamples;
+	values.SoftShadowSampleCount = lm_softshadowsamples;
 
 	uniforms.Uniforms = (uint8_t*)uniforms.TransferBuffer->Map(0, uniforms.NumStructs * uniforms.StructStride);
 	*reinterpret_cast<Uniforms*>(uniforms.Uniforms + uniforms.StructStride * uniforms.Index) = values;
@@ -678,6 +691,7 @@ void VkLightmapper::CreateRaytracePipeline()
 			.AddBinding(0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_FRAGMENT_BIT)
 			.AddBinding(1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_FRAGMENT_BIT)
 			.AddBinding(2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_FRAGMENT_BIT)
+			.AddBinding(3, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_FRAGMENT_BIT)
 			.DebugName("raytrace.descriptorSetLayout1")
 			.Create(fb->GetDevice());
 	}
@@ -744,7 +758,7 @@ void VkLightmapper::CreateRaytracePipeline()
 	else
 	{
 		raytrace.descriptorPool1 = DescriptorPoolBuilder()
-			.AddPoolSize(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 3)
+			.AddPoolSize(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 4)
 			.MaxSets(1)
 			.DebugName("raytrace.descriptorPool1")
 			.Create(fb->GetDevice());
@@ -773,6 +787,7 @@ void VkLightmapper::UpdateAccelStructDescriptors()
 			.AddBuffer(raytrace.descriptorSet1.get(), 0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, fb->GetLevelMesh()->GetNodeBuffer())
 			.AddBuffer(raytrace.descriptorSet1.get(), 1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, fb->GetLevelMesh()->GetVertexBuffer())
 			.AddBuffer(raytrace.descriptorSet1.get(), 2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, fb->GetLevelMesh()->GetIndexBuffer())
+			.AddBuffer(raytrace.descriptorSet1.get(), 3, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, fb->GetLevelMesh()->GetNodeTriangleBuffer())
 			.Execute(fb->GetDevice());
 	}
 
@@ -13,9 +13,13 @@ class ShaderIncludeResult;
 struct Uniforms
 {
 	FVector3 SunDir;
-	float Padding1;
+	uint32_t AdaptiveSampling;
 	FVector3 SunColor;
 	float SunIntensity;
+	float LightCutoff;
+	uint32_t AOSampleCount;
+	uint32_t BounceSampleCount;
+	uint32_t SoftShadowSampleCount;
 };
 
 struct LightmapRaytracePC
@@ -142,6 +142,10 @@ void VulkanRenderDevice::DrawViewer(const FVector3& cameraPos, const VSMatrix& v
 	}
 	write.AddBuffer(Viewer.DescriptorSet.get(), 6, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, GetLevelMesh()->GetVertexBuffer());
 	write.AddBuffer(Viewer.DescriptorSet.get(), 7, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, GetLevelMesh()->GetIndexBuffer());
+	if (!useRayQuery)
+	{
+		write.AddBuffer(Viewer.DescriptorSet.get(), 8, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, GetLevelMesh()->GetNodeTriangleBuffer());
+	}
 	write.Execute(device.get());
 
 	auto commands = GetCommands()->GetDrawCommands();
@@ -256,12 +260,16 @@ void VulkanRenderDevice::CreateViewerObjects()
 	}
 	builder.AddBinding(6, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_FRAGMENT_BIT);
 	builder.AddBinding(7, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_FRAGMENT_BIT);
+	if (!useRayQuery)
+	{
+		builder.AddBinding(8, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_FRAGMENT_BIT);
+	}
 	builder.DebugName("Viewer.DescriptorSetLayout");
 	Viewer.DescriptorSetLayout = builder.Create(device.get());
 
 	Viewer.DescriptorPool = DescriptorPoolBuilder()
 		.AddPoolSize(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1)
-		.AddPoolSize(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 6)
+		.AddPoolSize(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 9)
 		.MaxSets(1)
 		.DebugName("Viewer.DescriptorPool")
 		.Create(device.get());
@@ -54,6 +54,7 @@
 #include <string.h>
 #include <stdarg.h>
 #include <thread>
+#include <algorithm>
 
 #include "framework/zdray.h"
 #include "framework/filesystem.h"
@@ -90,6 +91,15 @@ static void CheckSSE();
 extern "C" int optind;
 extern "C" char *optarg;
 
+extern bool lm_adaptive;
+extern float lm_lightcutoff;
+extern int lm_lightbudget;
+extern int lm_radiosity;
+extern int lm_aosamples;
+extern int lm_bouncesamples;
+extern int lm_softshadowsamples;
+extern bool lm_denoise;
+
 // PUBLIC DATA DEFINITIONS -------------------------------------------------
 
 const char		*Map = nullptr;
@@ -101,6 +111,7 @@ bool			 ConformNodes = false;
 bool			 NoPrune = false;
 EBlockmapMode	 BlockmapMode = EBM_Rebuild;
 ERejectMode		 RejectMode = ERM_DontTouch;
+ELightmapEncoding LightmapEncoding = ELE_F16;
 bool			 WriteComments = false;
 int				 MaxSegs = 64;
 int				 SplitCost = 8;
@@ -121,11 +132,28 @@ bool			 VKDebug = false;
 bool			 DumpMesh = false;
 bool			 NoRtx = false;
 bool			 showviewer = false;
-
-int ambientSampleCount = 2048;
+bool			 CPURaytrace = false;
+const char		*LightmapCacheFile = nullptr;
+float			 UniformTileTolerance = -1.0f; // Negative keeps the uniform tiles at full size
 
 // PRIVATE DATA DEFINITIONS ------------------------------------------------
 
+// Rays per texel for the ambient occlusion, the bounce light and the soft shadows of each bake quality
+struct QualityPreset
+{
+	const char *Name;
+	int AOSamples;
+	int BounceSamples;
+	int SoftShadowSamples;
+};
+
+static const QualityPreset QualityPresets[] =
+{
+	{ "preview",	16,		4,		4 },
+	{ "normal",		128,	8,		10 },
+	{ "final",		512,	32,		32 },
+};
+
 static option long_opts[] =
 {
 	{"help",			no_argument,		0,	1000},
@@ -164,6 +192,19 @@ static option long_opts[] =
 	{"preview",			no_argument,		0,	1005},
 	{"no-rtx",			no_argument,		0,	1006},
 	{"viewer",			no_argument,		0,	1007},
+	{"cpu",				no_argument,		0,	1008},
+	{"light-cutoff",	required_argument,	0,	1009},
+	{"no-adaptive",		no_argument,		0,	1020},
+	{"light-budget",	required_argument,	0,	1010},
+	{"radiosity",		required_argument,	0,	1011},
+	{"lightmap-cache",	required_argument,	0,	1012},
+	{"ao-samples",		required_argument,	0,	1013},
+	{"denoise",			no_argument,		0,	1014},
+	{"quality",			required_argument,	0,	1015},
+	{"bounce-samples",	required_argument,	0,	1016},
+	{"shadow-samples",	required_argument,	0,	1017},
+	{"lightmap-format",	required_argument,	0,	1018},
+	{"collapse-uniform-tiles",	optional_argument,	0,	1019},
 	{0,0,0,0}
 };
 
@@ -356,6 +397,10 @@ static void ParseArgs(int argc, char **argv)
 {
 	int ch;
 
+	// The sample counts given on their own override the ones of the preset, whatever the order of the options
+	const QualityPreset *quality = &QualityPresets[1];
+	int aoSamples = 0, bounceSamples = 0, shadowSamples = 0;
+
 	while ((ch = getopt_long(argc, argv, short_opts, long_opts, nullptr)) != EOF)
 	{
 		switch (ch)
@@ -484,7 +529,7 @@ static void ParseArgs(int argc, char **argv)
 			DumpMesh = true;
 			break;
 		case 1005:
-			ambientSampleCount = 16;
+			quality = &QualityPresets[0];
 			break;
 		case 1006:
 			NoRtx = true;
@@ -492,6 +537,70 @@ static void ParseArgs(int argc, char **argv)
 		case 1007:
 			showviewer = true;
 			break;
+		case 1008:
+			CPURaytrace = true;
+			break;
+		case 1009:
+			lm_lightcutoff = (float)atof(optarg);
+			if (lm_lightcutoff < 0.0f) lm_lightcutoff = 0.0f;
+			break;
+		case 1020:
+			lm_adaptive = false;
+			break;
+		case 1010:
+			lm_lightbudget = atoi(optarg);
+			if (lm_lightbudget < 0) lm_lightbudget = 0;
+			break;
+		case 1011:
+			lm_radiosity = atoi(optarg);
+			if (lm_radiosity < 0) lm_radiosity = 0;
+			break;
+		case 1012:
+			LightmapCacheFile = optarg;
+			break;
+		case 1013:
+			// Whole ray packets of 16 rays, and a power of two for the Hammersley rounds
+			aoSamples = RoundPowerOfTwo(std::clamp(atoi(optarg), 16, 4096));
+			break;
+		case 1014:
+			lm_denoise = true;
+			break;
+		case 1015:
+			quality = nullptr;
+			for (const QualityPreset &preset : QualityPresets)
+			{
+				if (stricmp(optarg, preset.Name) == 0)
+					quality = &preset;
+			}
+			if (quality == nullptr)
+			{
+				printf("Unknown quality '%s'. Use preview, normal or final.\n", optarg);
+				exit(0);
+			}
+			break;
+		case 1016:
+			// Rounds of 4 rays, and a power of two for the Hammersley rounds
+			bounceSamples = RoundPowerOfTwo(std::clamp(atoi(optarg), 4, 256));
+			break;
+		case 1017:
+			shadowSamples = std::clamp(atoi(optarg), 4, 64);
+			break;
+		case 1018:
+			if (stricmp(optarg, "f16") == 0)
+				LightmapEncoding = ELE_F16;
+			else if (stricmp(optarg, "rgb9e5") == 0)
+				LightmapEncoding = ELE_RGB9E5;
+			else if (stricmp(optarg, "bc6h") == 0)
+				LightmapEncoding = ELE_BC6H;
+			else
+			{
+				printf("Unknown lightmap format '%s'. Use f16, rgb9e5 or bc6h.\n", optarg);
+				exit(0);
+			}
+			break;
+		case 1019:
+			UniformTileTolerance = optarg ? std::max((float)atof(optarg), 0.0f) : 0.01f;
+			break;
 		case 1000:
 			ShowUsage();
 			exit(0);
@@ -500,6 +609,10 @@ static void ParseArgs(int argc, char **argv)
 			exit(0);
 		}
 	}
+
+	lm_aosamples = aoSamples ? aoSamples : quality->AOSamples;
+	lm_bouncesamples = bounceSamples ? bounceSamples : quality->BounceSamples;
+	lm_softshadowsamples = shadowSamples ? shadowSamples : quality->SoftShadowSamples;
 }
 
 //==========================================================================
@@ -533,11 +646,25 @@ static void ShowUsage()
 		"  -s, --split-cost=NNN     Cost for splitting segs (default %d)\n"
 		"  -d, --diagonal-cost=NNN  Cost for avoiding diagonal splitters (default %d)\n"
 		"  -P, --no-polyobjs        Do not check for polyobject subsector splits\n"
-		"  -j, --threads=NNN        Number of threads used for raytracing (default %d)\n"
+		"  -j, --threads=NNN        Number of threads used for map parsing and raytracing (default %d)\n"
 		"  -S, --size=NNN           lightmap texture dimensions for width and height must be in powers of two (1, 2, 4, 8, 16, etc)\n"
 		"  -D, --vkdebug            Print messages from the Vulkan validation layer\n"
 		"      --dump-mesh          Export level mesh and lightmaps for debugging\n"
 		"      --no-rtx             Do not use RTX acceleration for the ray tracing\n"
+		"      --cpu                Ray trace the lightmaps on the CPU instead of using Vulkan\n"
+		"      --light-cutoff=X     Randomly skip lights that add less than X to a texel (default %g)\n"
+		"      --no-adaptive        Trace every sample of every texel instead of stopping once a texel has converged\n"
+		"      --light-budget=NNN   Trace at most NNN of the lights in range of a texel, 0 for all (CPU only)\n"
+		"      --radiosity=NNN      Gather NNN bounces from the baked lightmap instead of tracing one (CPU only)\n"
+		"      --lightmap-cache=FILE  Reuse the lightmap tiles whose lights and geometry are unchanged since the last run\n"
+		"      --quality=NAME       Bake quality preset: preview, normal or final (default normal)\n"
+		"      --preview            Same as --quality=preview\n"
+		"      --ao-samples=NNN     Ambient occlusion rays per texel, rounded up to a power of two (normal 128)\n"
+		"      --bounce-samples=NNN Bounce light rays per texel, rounded up to a power of two (normal 8)\n"
+		"      --shadow-samples=NNN Soft shadow rays per texel and light, from 4 to 64 (normal 10)\n"
+		"      --denoise            Filter the noise of low sample counts out of the lightmap tiles (CPU only)\n"
+		"      --lightmap-format=NAME  Pixel format of the LIGHTMAP lump: f16, rgb9e5 or bc6h (default f16)\n"
+		"      --collapse-uniform-tiles[=X]  Shrink lightmap tiles whose colors vary less than X (relative, default 0.01) to 2x2\n"
 		"  -w, --warn               Show warning messages\n"
 #if HAVE_TIMING
 		"  -t, --no-timing          Suppress timing information\n"
@@ -551,6 +678,7 @@ static void ShowUsage()
 		, SplitCost
 		, AAPreference
 		, (int)std::thread::hardware_concurrency()
+		, lm_lightcutoff
 	);
 }
 
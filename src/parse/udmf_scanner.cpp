@@ -0,0 +1,506 @@
+/*
+    Reentrant UDMF text map scanner
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string>
+#include <stdexcept>
+#include <algorithm>
+#include "udmf_scanner.h"
+#include "framework/zdray.h"
+#include "framework/xs_Float.h"
+
+#ifndef DISABLE_SSE
+#include <emmintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#pragma warning(disable:4996)
+#endif
+
+// Character classes matching sc_man in C mode. Control characters and anything
+// above 127 separate tokens, and the stop characters are always tokens of their own.
+struct UDMFCharClasses
+{
+	constexpr UDMFCharClasses() : Space(), Stop()
+	{
+		for (int i = 0; i < 256; i++)
+			Space[i] = (i <= ' ' || i >= 128);
+
+		const char *stopchars = "`~!@#$%^&*(){}[]/=?+|;:<>,";
+		for (int i = 0; stopchars[i] != 0; i++)
+			Stop[(unsigned char)stopchars[i]] = true;
+	}
+
+	bool Space[256];
+	bool Stop[256];
+};
+
+static constexpr UDMFCharClasses CharClasses;
+
+UDMFScanner::UDMFScanner(char *text, size_t size, int line) : Line(line), ScriptPtr(text), ScriptEndPtr(text + size), TokenPtr(text), TokenLine(line)
+{
+}
+
+//==========================================================================
+//
+// Reads the next token. Quoted strings are returned including their quotes
+// and with escape sequences left untouched, the same way sc_man did it.
+//
+//==========================================================================
+
+bool UDMFScanner::GetString()
+{
+	if (AlreadyGot)
+	{
+		AlreadyGot = false;
+		return true;
+	}
+
+	char *p = ScriptPtr;
+	char *end = ScriptEndPtr;
+	while (true)
+	{
+		while (p < end && CharClasses.Space[(unsigned char)*p])
+		{
+			if (*p++ == '\n')
+				Line++;
+		}
+
+		if (p >= end)
+		{
+			ScriptPtr = p;
+			return false;
+		}
+
+		if (p[0] != '/' || p + 1 >= end || (p[1] != '/' && p[1] != '*'))
+			break;
+
+		if (p[1] == '*')
+		{
+			p += 2;
+			while (p + 1 < end && (p[0] != '*' || p[1] != '/'))
+			{
+				if (*p++ == '\n')
+					Line++;
+			}
+			if (p + 1 >= end)
+			{
+				ScriptPtr = end;
+				return false;
+			}
+			p += 2;
+		}
+		else
+		{
+			while (p < end && *p != '\n')
+				p++;
+		}
+	}
+
+	TokenPtr = p;
+	TokenLine = Line;
+
+	if (*p == '"')
+	{
+		// Control characters are dropped from quoted strings. That is the only case where
+		// the token doesn't match the lump text, so compact it in place when it happens.
+		char *compact = nullptr;
+		p++;
+		while (true)
+		{
+			if (p >= end)
+			{
+				ScriptPtr = p;
+				ScriptError("Unterminated string constant.");
+			}
+
+			char c = *p;
+			if (c == '"')
+			{
+				break;
+			}
+			else if ((unsigned char)c < ' ')
+			{
+				if (c == '\n')
+					Line++;
+				if (!compact)
+					compact = p;
+				p++;
+			}
+			else
+			{
+				int count = (c == '\\' && p + 1 < end) ? 2 : 1;
+				for (int i = 0; i < count; i++)
+				{
+					if (compact)
+						*compact++ = *p;
+					p++;
+				}
+			}
+		}
+
+		if (compact)
+		{
+			// Pad with spaces so the token reads the same if the scanner ever returns to it
+			*compact = '"';
+			String = std::string_view(TokenPtr, compact + 1 - TokenPtr);
+			memset(compact + 1, ' ', p - compact);
+		}
+		else
+		{
+			String = std::string_view(TokenPtr, p + 1 - TokenPtr);
+		}
+		p++;
+	}
+	else if (CharClasses.Stop[(unsigned char)*p])
+	{
+		p++;
+		String = std::string_view(TokenPtr, 1);
+	}
+	else
+	{
+		while (p < end && !CharClasses.Space[(unsigned char)*p] && !CharClasses.Stop[(unsigned char)*p])
+			p++;
+		String = std::string_view(TokenPtr, p - TokenPtr);
+	}
+
+	ScriptPtr = p;
+	return true;
+}
+
+void UDMFScanner::MustGetString()
+{
+	if (!GetString())
+	{
+		ScriptError("Missing string (unexpected end of file).");
+	}
+}
+
+void UDMFScanner::MustGetStringName(const char *name)
+{
+	MustGetString();
+	if (!Compare(name))
+	{
+		ScriptError("Expected '%s', got '%.*s'.", name, (int)String.size(), String.data());
+	}
+}
+
+bool UDMFScanner::CheckString(const char *name)
+{
+	if (GetString())
+	{
+		if (Compare(name))
+		{
+			return true;
+		}
+		UnGet();
+	}
+	return false;
+}
+
+void UDMFScanner::UnGet()
+{
+	AlreadyGot = true;
+}
+
+bool UDMFScanner::Compare(const char *name) const
+{
+	size_t len = strlen(name);
+	return len == String.size() && strnicmp(String.data(), name, len) == 0;
+}
+
+//===========================================================================
+//
+// Parses a 'key = value;' line of the map
+//
+// Both the key and the value are null terminated in place. The byte after
+// each of them belongs to a separator or comment that has already been
+// scanned past by the time the closing ';' is read.
+//
+//===========================================================================
+
+const char *UDMFScanner::ParseKey(const char *&value)
+{
+	MustGetString();
+	char *key = TokenPtr;
+	size_t keylen = String.size();
+	MustGetStringName("=");
+	return ParseValue(key, keylen, value);
+}
+
+bool UDMFScanner::CheckKey(const char *&key, const char *&value)
+{
+	if (!GetString())
+		return false;
+
+	char *keyptr = TokenPtr;
+	int keyline = TokenLine;
+	size_t keylen = String.size();
+	if (!GetString() || !Compare("="))
+	{
+		ScriptPtr = keyptr;
+		Line = keyline;
+		AlreadyGot = false;
+		return false;
+	}
+
+	key = ParseValue(keyptr, keylen, value);
+	return true;
+}
+
+const char *UDMFScanner::ParseValue(char *key, size_t keylen, const char *&value)
+{
+	MustGetString();
+	char *val = TokenPtr;
+	size_t vallen = String.size();
+	MustGetStringName(";");
+
+	key[keylen] = 0;
+	val[vallen] = 0;
+	Value = value = val;
+	return key;
+}
+
+//===========================================================================
+//
+// Numeric conversions of the value returned by the last ParseKey call.
+// Like the sc_man based parser, a value that isn't a number converts to
+// whatever numeric prefix it has (usually 0).
+//
+//===========================================================================
+
+int UDMFScanner::CheckInt(const char *key) const
+{
+	// Plain decimal integers are by far the most common values
+	const char *p = Value;
+	bool negative = (*p == '-');
+	if (negative)
+		p++;
+	if (*p >= '0' && *p <= '9')
+	{
+		int number = 0;
+		int digits = 0;
+		while (*p >= '0' && *p <= '9' && digits < 9)
+		{
+			number = number * 10 + (*p++ - '0');
+			digits++;
+		}
+		if (*p == 0)
+			return negative ? -number : number;
+	}
+
+	char *stopper;
+	double number = strtod(Value, &stopper);
+	if (*stopper != 0)
+	{
+		Warn("Integer value expected for key '%s' in line %d\n", key, Line);
+	}
+	return (int)number;
+}
+
+double UDMFScanner::CheckFloat(const char *key) const
+{
+	char *stopper;
+	double number = strtod(Value, &stopper);
+	if (*stopper != 0)
+	{
+		Warn("Floating point value expected for key '%s' in line %d\n", key, Line);
+	}
+	return number;
+}
+
+fixed_t UDMFScanner::CheckFixed(const char *key) const
+{
+	double val = CheckFloat(key);
+	if (val < -32768 || val > 32767)
+	{
+		ScriptError("Fixed point value is out of range for key '%s'\n\t%.2f should be within [-32768,32767]", key, val / 65536);
+	}
+	return xs_Fix<16>::ToFix(val);
+}
+
+//===========================================================================
+//
+// Errors are thrown rather than exiting so that they can be reported from
+// whichever thread happened to be parsing.
+//
+//===========================================================================
+
+void UDMFScanner::ScriptError(const char *message, ...) const
+{
+	char composed[2048];
+	va_list arglist;
+	va_start(arglist, message);
+	vsnprintf(composed, sizeof(composed), message, arglist);
+	va_end(arglist);
+
+	throw std::runtime_error("Script error, line " + std::to_string(Line) + ":\n" + composed);
+}
+
+//===========================================================================
+//
+// Locates all top level { } blocks without tokenizing anything, so that
+// the blocks themselves can be handed out to different threads.
+//
+//===========================================================================
+
+static inline int FindFirstBit(unsigned int mask)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return (int)index;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+// Returns the first brace, quote or slash at or after p
+static char *FindStructureChar(char *p, char *end)
+{
+#ifndef DISABLE_SSE
+	const __m128i openbrace = _mm_set1_epi8('{');
+	const __m128i closebrace = _mm_set1_epi8('}');
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i slash = _mm_set1_epi8('/');
+	while (end - p >= 16)
+	{
+		__m128i chars = _mm_loadu_si128((const __m128i*)p);
+		__m128i braces = _mm_or_si128(_mm_cmpeq_epi8(chars, openbrace), _mm_cmpeq_epi8(chars, closebrace));
+		__m128i others = _mm_or_si128(_mm_cmpeq_epi8(chars, quote), _mm_cmpeq_epi8(chars, slash));
+		unsigned int mask = _mm_movemask_epi8(_mm_or_si128(braces, others));
+		if (mask != 0)
+			return p + FindFirstBit(mask);
+		p += 16;
+	}
+#endif
+	while (p < end && *p != '{' && *p != '}' && *p != '"' && *p != '/')
+		p++;
+	return p;
+}
+
+static int CountChar(const char *p, const char *end, char c)
+{
+	int count = 0;
+#ifndef DISABLE_SSE
+	const __m128i match = _mm_set1_epi8(c);
+	while (end - p >= 16)
+	{
+		// The byte counters overflow after 255 rounds
+		int rounds = (int)std::min<ptrdiff_t>((end - p) / 16, 255);
+		__m128i counters = _mm_setzero_si128();
+		for (int i = 0; i < rounds; i++)
+		{
+			counters = _mm_sub_epi8(counters, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), match));
+			p += 16;
+		}
+		__m128i sums = _mm_sad_epu8(counters, _mm_setzero_si128());
+		count += _mm_cvtsi128_si32(sums) + _mm_cvtsi128_si32(_mm_srli_si128(sums, 8));
+	}
+#endif
+	while (p < end)
+	{
+		if (*p++ == c)
+			count++;
+	}
+	return count;
+}
+
+static int CountLines(const char *p, const char *end)
+{
+	return CountChar(p, end, '\n');
+}
+
+int UDMFScanner::CountKeys(const char *start, const char *end)
+{
+	// Every key is terminated by a semicolon. Any in strings or comments only make the estimate larger.
+	return CountChar(start, end, ';');
+}
+
+std::vector<UDMFBlock> UDMFScanner::FindBlocks(char *text, size_t size)
+{
+	std::vector<UDMFBlock> blocks;
+	char *end = text + size;
+	char *p = text;
+	char *countedPtr = text;
+	int line = 1;
+	int depth = 0;
+
+	while (true)
+	{
+		p = FindStructureChar(p, end);
+		if (p == end)
+			break;
+
+		if (*p == '{')
+		{
+			if (depth++ == 0)
+			{
+				line += CountLines(countedPtr, p);
+				countedPtr = p;
+				blocks.push_back({ p, end, line, line });
+			}
+			p++;
+		}
+		else if (*p == '}')
+		{
+			if (depth > 0 && --depth == 0)
+			{
+				line += CountLines(countedPtr, p);
+				countedPtr = p;
+				blocks.back().End = p + 1;
+				blocks.back().EndLine = line;
+			}
+			p++;
+		}
+		else if (*p == '"')
+		{
+			p++;
+			while (p < end && *p != '"')
+				p += (*p == '\\' && p + 1 < end) ? 2 : 1;
+			p = (p < end) ? p + 1 : end;
+		}
+		else if (p + 1 < end && p[1] == '/')
+		{
+			p = (char *)memchr(p, '\n', end - p);
+			if (!p)
+				p = end;
+		}
+		else if (p + 1 < end && p[1] == '*')
+		{
+			p += 2;
+			while (p + 1 < end && (p[0] != '*' || p[1] != '/'))
+				p++;
+			p = (p + 1 < end) ? p + 2 : end;
+		}
+		else
+		{
+			p++;
+		}
+	}
+
+	if (depth > 0)
+		blocks.back().EndLine = line + CountLines(countedPtr, end);
+
+	return blocks;
+}
@@ -0,0 +1,63 @@
+
+#pragma once
+
+#include <string_view>
+#include <vector>
+#include "framework/zdray.h"
+
+// Reentrant tokenizer for UDMF TEXTMAP lumps.
+//
+// All state lives in the scanner object, so any number of them can run at the same
+// time on different threads. Tokens are views into the lump text instead of copies.
+// ParseKey null terminates the key and value in place once the whole 'key = value;'
+// statement has been consumed, which means the text must be writable and has to
+// outlive any key/value pointers handed out by the scanner.
+
+struct UDMFBlock
+{
+	char *Start;	// The opening brace
+	char *End;		// One past the closing brace, or the end of the text if the block is never closed
+	int Line;		// Line of the opening brace
+	int EndLine;	// Line the block ends on
+};
+
+class UDMFScanner
+{
+public:
+	UDMFScanner(char *text, size_t size, int line = 1);
+
+	bool GetString();
+	void MustGetString();
+	void MustGetStringName(const char *name);
+	bool CheckString(const char *name);
+	void UnGet();
+	bool Compare(const char *name) const;
+
+	const char *ParseKey(const char *&value);
+	bool CheckKey(const char *&key, const char *&value);
+
+	int CheckInt(const char *key) const;
+	double CheckFloat(const char *key) const;
+	fixed_t CheckFixed(const char *key) const;
+
+	[[noreturn]] void ScriptError(const char *message, ...) const;
+
+	static std::vector<UDMFBlock> FindBlocks(char *text, size_t size);
+
+	// Upper bound for the number of keys in the text, for sizing property tables before parsing
+	static int CountKeys(const char *start, const char *end);
+
+	std::string_view String;
+	int Line = 1;
+
+private:
+	const char *ParseValue(char *key, size_t keylen, const char *&value);
+
+	char *ScriptPtr;
+	char *ScriptEndPtr;
+	char *TokenPtr = nullptr;
+	int TokenLine = 1;
+	bool AlreadyGot = false;
+
+	const char *Value = "";
+};